@@ -0,0 +1,556 @@
+/*
+ * Title: Dynamic Memory Allocator 
+ * Author: Christian Wills <cwills.dev@gmail.com>
+ * License: GPLv2 (see COPYING)
+ * File: bench/bench.c
+ */
+
+/*
+ * Allocator microbenchmarks. The binary only uses the standard malloc API so the
+ * same build can be run against glibc and, with LD_PRELOAD, against libmymalloc
+ * (see bench/run.sh and `make bench`).
+ *
+ * Usage: bench <benchmark> [-t threads] [-n ops per thread] [-l label]
+ *
+ * Every run prints one result line:
+ *   <benchmark> <label> <threads> <ops/sec> <p50 ns> <p99 ns> <p99.9 ns> <max rss kB>
+ * followed by a "hist" line with the log2 latency histogram of the sampled malloc() calls.
+ * ops/sec counts every malloc(), realloc() and free() the benchmark threads make.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/// Every SAMPLE_EVERY'th malloc() is timed for the latency histogram
+#define SAMPLE_EVERY 16
+
+/// Latency histogram buckets, bucket i counts calls that took [2^i, 2^(i+1)) ns, the last one anything slower
+#define HIST_BUCKETS 32
+
+/// Live objects per thread in the churn style benchmarks
+#define WORKING_SET 1024
+
+/// Per thread benchmark state
+typedef struct {
+	int id;
+	long ops;						// operations to run
+	long done;						// allocator calls made, frees included
+	long sampled;					// calls eligible for the histogram, every SAMPLE_EVERY'th is timed
+	unsigned int seed;
+	unsigned long hist[HIST_BUCKETS];
+	void **slots;					// larson hands these over between rounds
+	char pad[64];					// keep neighbouring threads off our cache line
+} thread_ctx_t;
+
+typedef struct {
+	const char *name;
+	const char *desc;
+	void *(*thread_fn)(void *);
+	void (*run)(thread_ctx_t *ctxs, int nthreads);	// NULL to just start thread_fn on every thread
+} benchmark_t;
+
+static int nthreads = 1;
+static long nops = 1000000;
+
+/**
+ * now_ns - Monotonic clock in nanoseconds.
+ */
+static inline uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * hist_record - Count a call that took @ns in @ctx's histogram.
+ */
+static inline void hist_record(thread_ctx_t *ctx, uint64_t ns){
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	ctx->hist[(bucket < HIST_BUCKETS) ? bucket : HIST_BUCKETS - 1]++;
+}
+
+/**
+ * timed_malloc - malloc() that records its latency in @ctx's histogram every SAMPLE_EVERY calls.
+ */
+static inline void *timed_malloc(thread_ctx_t *ctx, size_t size){
+	uint64_t start;
+	void *p;
+
+	ctx->done++;
+	if((ctx->sampled++ % SAMPLE_EVERY) != 0){
+		return malloc(size);
+	}
+
+	start = now_ns();
+	p = malloc(size);
+	hist_record(ctx, now_ns() - start);
+	return p;
+}
+
+/**
+ * counted_free - free() counted as an operation of @ctx.
+ */
+static inline void counted_free(thread_ctx_t *ctx, void *p){
+	ctx->done++;
+	free(p);
+}
+
+/**
+ * touch - Write to the first and last byte so the memory is really used.
+ */
+static inline void touch(void *p, size_t size){
+	if(p == NULL){
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	((char *) p)[0] = 1;
+	((char *) p)[size - 1] = 1;
+}
+
+/// Size distributions for the churn benchmarks
+static size_t size_small(unsigned int *seed){
+	return 8 + rand_r(seed) % 121;
+}
+
+static size_t size_mixed(unsigned int *seed){
+	// Mostly small with a long tail, roughly what a C program does
+	return 8 + (rand_r(seed) % 64) * (1 << (rand_r(seed) % 7));
+}
+
+static size_t size_large(unsigned int *seed){
+	return 4096 + rand_r(seed) % (256 * 1024);
+}
+
+/**
+ * churn - Replace random objects of a working set with new ones of random size.
+ */
+static void churn(thread_ctx_t *ctx, size_t (*size_fn)(unsigned int *)){
+	void *slots[WORKING_SET] = { 0 };
+	long i;
+	int k;
+
+	for(i = 0; i < ctx->ops; i++){
+		size_t size = size_fn(&ctx->seed);
+
+		k = rand_r(&ctx->seed) % WORKING_SET;
+		counted_free(ctx, slots[k]);
+		slots[k] = timed_malloc(ctx, size);
+		touch(slots[k], size);
+	}
+	for(k = 0; k < WORKING_SET; k++){
+		counted_free(ctx, slots[k]);
+	}
+}
+
+static void *churn_small(void *arg){
+	churn(arg, size_small);
+	return NULL;
+}
+
+static void *churn_mixed(void *arg){
+	churn(arg, size_mixed);
+	return NULL;
+}
+
+static void *churn_large(void *arg){
+	thread_ctx_t *ctx = arg;
+
+	// Each op is far more expensive, keep the run time in line with the others
+	ctx->ops /= 20;
+	churn(ctx, size_large);
+	return NULL;
+}
+
+/**
+ * larson_thread - One round of the larson server simulation: replace random objects in the slot
+ *                 array inherited from the previous round's thread.
+ */
+static void *larson_thread(void *arg){
+	thread_ctx_t *ctx = arg;
+	long i;
+	int k;
+
+	for(i = 0; i < ctx->ops; i++){
+		size_t size = 8 + rand_r(&ctx->seed) % 1000;
+
+		k = rand_r(&ctx->seed) % WORKING_SET;
+		counted_free(ctx, ctx->slots[k]);
+		ctx->slots[k] = timed_malloc(ctx, size);
+		touch(ctx->slots[k], size);
+	}
+	return NULL;
+}
+
+/**
+ * larson_run - Run rounds of larson_thread. Every round is a fresh set of threads that frees
+ *              what the previous round's threads allocated, as a server's worker threads would.
+ */
+static void larson_run(thread_ctx_t *ctxs, int nthreads){
+	pthread_t threads[nthreads];
+	long ops_per_round;
+	int round, i, k;
+	const int rounds = 10;
+
+	for(i = 0; i < nthreads; i++){
+		ctxs[i].slots = calloc(WORKING_SET, sizeof(void *));
+		for(k = 0; k < WORKING_SET; k++){
+			ctxs[i].slots[k] = malloc(8 + k % 1000);
+		}
+	}
+
+	ops_per_round = ctxs[0].ops / rounds;
+	for(i = 0; i < nthreads; i++){
+		ctxs[i].ops = ops_per_round;
+	}
+
+	for(round = 0; round < rounds; round++){
+		for(i = 0; i < nthreads; i++){
+			pthread_create(&threads[i], NULL, larson_thread, &ctxs[i]);
+		}
+		for(i = 0; i < nthreads; i++){
+			pthread_join(threads[i], NULL);
+		}
+		// Hand every thread's objects to its neighbour for the next round
+		void **first = ctxs[0].slots;
+		for(i = 0; i < nthreads - 1; i++){
+			ctxs[i].slots = ctxs[i + 1].slots;
+		}
+		ctxs[nthreads - 1].slots = first;
+	}
+
+	for(i = 0; i < nthreads; i++){
+		for(k = 0; k < WORKING_SET; k++){
+			free(ctxs[i].slots[k]);
+		}
+		free(ctxs[i].slots);
+	}
+}
+
+/**
+ * threadtest_thread - Allocate a batch of objects, free the whole batch, repeat.
+ */
+static void *threadtest_thread(void *arg){
+	thread_ctx_t *ctx = arg;
+	void *batch[WORKING_SET];
+	long i;
+	int k;
+
+	for(i = 0; i < ctx->ops; i += WORKING_SET){
+		for(k = 0; k < WORKING_SET; k++){
+			batch[k] = timed_malloc(ctx, 64);
+			touch(batch[k], 64);
+		}
+		for(k = 0; k < WORKING_SET; k++){
+			counted_free(ctx, batch[k]);
+		}
+	}
+	return NULL;
+}
+
+/// Queue between xmalloc producers and consumers
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void **items;
+	long head, tail, size;
+	long freed;						// frees made by the consumers, which have no thread_ctx_t
+	int producers_left;
+} xqueue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/// Objects moved through the queue per lock round trip
+#define XMALLOC_BATCH 64
+
+/**
+ * xmalloc_producer - Allocate objects and pass them to the consumers.
+ */
+static void *xmalloc_producer(void *arg){
+	thread_ctx_t *ctx = arg;
+	void *batch[XMALLOC_BATCH];
+	long i;
+	int k;
+
+	for(i = 0; i < ctx->ops; i += XMALLOC_BATCH){
+		for(k = 0; k < XMALLOC_BATCH; k++){
+			size_t size = size_mixed(&ctx->seed);
+			batch[k] = timed_malloc(ctx, size);
+			touch(batch[k], size);
+		}
+
+		pthread_mutex_lock(&xqueue.lock);
+		while(xqueue.tail - xqueue.head + XMALLOC_BATCH > xqueue.size){
+			pthread_cond_wait(&xqueue.cond, &xqueue.lock);
+		}
+		for(k = 0; k < XMALLOC_BATCH; k++){
+			xqueue.items[xqueue.tail++ % xqueue.size] = batch[k];
+		}
+		pthread_cond_broadcast(&xqueue.cond);
+		pthread_mutex_unlock(&xqueue.lock);
+	}
+
+	pthread_mutex_lock(&xqueue.lock);
+	xqueue.producers_left--;
+	pthread_cond_broadcast(&xqueue.cond);
+	pthread_mutex_unlock(&xqueue.lock);
+	return NULL;
+}
+
+/**
+ * xmalloc_consumer - Free whatever the producers allocated.
+ */
+static void *xmalloc_consumer(void *arg){
+	void *batch[XMALLOC_BATCH];
+	int n, k;
+
+	for(;;){
+		pthread_mutex_lock(&xqueue.lock);
+		while(xqueue.head == xqueue.tail && xqueue.producers_left > 0){
+			pthread_cond_wait(&xqueue.cond, &xqueue.lock);
+		}
+		if(xqueue.head == xqueue.tail){
+			pthread_mutex_unlock(&xqueue.lock);
+			return NULL;
+		}
+		for(n = 0; n < XMALLOC_BATCH && xqueue.head != xqueue.tail; n++){
+			batch[n] = xqueue.items[xqueue.head++ % xqueue.size];
+		}
+		pthread_cond_broadcast(&xqueue.cond);
+		pthread_mutex_unlock(&xqueue.lock);
+
+		for(k = 0; k < n; k++){
+			free(batch[k]);
+		}
+		__atomic_add_fetch(&xqueue.freed, n, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * xmalloc_run - Half the threads (at least one) produce, the rest consume. Every object
+ *               is freed by a different thread than the one that allocated it.
+ */
+static void xmalloc_run(thread_ctx_t *ctxs, int nthreads){
+	int nproducers = (nthreads + 1) / 2;
+	int nconsumers = (nthreads / 2 > 0) ? nthreads / 2 : 1;
+	pthread_t threads[nproducers + nconsumers];
+	int i;
+
+	xqueue.size = 16 * XMALLOC_BATCH * nproducers;
+	xqueue.items = malloc(xqueue.size * sizeof(void *));
+	xqueue.producers_left = nproducers;
+
+	// With one thread the producer's share of the work is all of it
+	for(i = 0; i < nproducers; i++){
+		ctxs[i].ops = ctxs[i].ops * nthreads / nproducers;
+		pthread_create(&threads[i], NULL, xmalloc_producer, &ctxs[i]);
+	}
+	for(i = 0; i < nconsumers; i++){
+		pthread_create(&threads[nproducers + i], NULL, xmalloc_consumer, NULL);
+	}
+	for(i = 0; i < nproducers + nconsumers; i++){
+		pthread_join(threads[i], NULL);
+	}
+	ctxs[0].done += xqueue.freed;
+	free(xqueue.items);
+}
+
+/**
+ * realloc_thread - Grow buffers from 16 bytes to 1MB with realloc() in small steps.
+ */
+static void *realloc_thread(void *arg){
+	thread_ctx_t *ctx = arg;
+	size_t size;
+	char *buf;
+	long i = 0;
+
+	while(i < ctx->ops){
+		buf = NULL;
+		for(size = 16; size <= 1024 * 1024 && i < ctx->ops; size += size / 8 + 16, i++){
+			uint64_t start = 0;
+
+			if((ctx->sampled % SAMPLE_EVERY) == 0){
+				start = now_ns();
+			}
+			buf = realloc(buf, size);
+			if((ctx->sampled++ % SAMPLE_EVERY) == 0){
+				hist_record(ctx, now_ns() - start);
+			}
+			ctx->done++;
+			touch(buf, size);
+		}
+		counted_free(ctx, buf);
+	}
+	return NULL;
+}
+
+/// Objects allocated by the main thread for cache-scratch, one per thread
+static char **scratch_objs;
+
+/**
+ * cache_scratch_thread - Free an object the main thread allocated next to the other threads'
+ *                        ones, then repeatedly allocate a small object and hammer on it. An
+ *                        allocator that hands back memory sharing a cache line with another
+ *                        thread's object shows up as false sharing here.
+ */
+static void *cache_scratch_thread(void *arg){
+	thread_ctx_t *ctx = arg;
+	long i;
+	int k;
+
+	free(scratch_objs[ctx->id]);
+
+	for(i = 0; i < ctx->ops; i += 100){
+		volatile char *obj = timed_malloc(ctx, 8);
+
+		for(k = 0; k < 100; k++){
+			obj[k % 8]++;
+		}
+		counted_free(ctx, (void *) obj);
+	}
+	return NULL;
+}
+
+static void cache_scratch_run(thread_ctx_t *ctxs, int nthreads){
+	pthread_t threads[nthreads];
+	int i;
+
+	scratch_objs = malloc(nthreads * sizeof(char *));
+	for(i = 0; i < nthreads; i++){
+		scratch_objs[i] = malloc(8);
+	}
+	for(i = 0; i < nthreads; i++){
+		pthread_create(&threads[i], NULL, cache_scratch_thread, &ctxs[i]);
+	}
+	for(i = 0; i < nthreads; i++){
+		pthread_join(threads[i], NULL);
+	}
+	free(scratch_objs);
+}
+
+static const benchmark_t benchmarks[] = {
+	{ "churn-small", "malloc/free churn, 8-128 bytes", churn_small, NULL },
+	{ "churn-mixed", "malloc/free churn, 8 bytes-4k long tail", churn_mixed, NULL },
+	{ "churn-large", "malloc/free churn, 4k-260k", churn_large, NULL },
+	{ "larson", "larson server simulation, objects freed by the next round's threads", larson_thread, larson_run },
+	{ "threadtest", "allocate a batch of 64 byte objects, free the batch", threadtest_thread, NULL },
+	{ "xmalloc", "producer threads allocate, consumer threads free", NULL, xmalloc_run },
+	{ "realloc", "grow buffers to 1MB with realloc()", realloc_thread, NULL },
+	{ "cache-scratch", "false sharing between objects of different threads", cache_scratch_thread, cache_scratch_run },
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void usage(void){
+	size_t i;
+
+	fprintf(stderr, "usage: bench <benchmark> [-t threads] [-n ops per thread] [-l label]\n\nbenchmarks:\n");
+	for(i = 0; i < NBENCHMARKS; i++){
+		fprintf(stderr, "  %-14s %s\n", benchmarks[i].name, benchmarks[i].desc);
+	}
+	exit(2);
+}
+
+/**
+ * percentile - Upper bound in ns of the histogram bucket holding the @pct'th percentile.
+ */
+static unsigned long percentile(const unsigned long *hist, unsigned long total, double pct){
+	unsigned long seen = 0;
+	int i;
+
+	for(i = 0; i < HIST_BUCKETS; i++){
+		seen += hist[i];
+		if(seen >= total * pct){
+			return 2UL << i;
+		}
+	}
+	return 2UL << (HIST_BUCKETS - 1);
+}
+
+int main(int argc, char **argv){
+	const benchmark_t *bench = NULL;
+	const char *label = "default";
+	unsigned long hist[HIST_BUCKETS] = { 0 };
+	unsigned long samples = 0;
+	thread_ctx_t *ctxs;
+	struct rusage usage_info;
+	uint64_t start, elapsed;
+	long total_ops = 0;
+	size_t i;
+	int opt, t;
+
+	if(argc < 2){
+		usage();
+	}
+	for(i = 0; i < NBENCHMARKS; i++){
+		if(!strcmp(argv[1], benchmarks[i].name)){
+			bench = &benchmarks[i];
+		}
+	}
+	if(bench == NULL){
+		usage();
+	}
+
+	optind = 2;
+	while( (opt = getopt(argc, argv, "t:n:l:")) != -1){
+		switch(opt){
+			case 't': nthreads = atoi(optarg); break;
+			case 'n': nops = atol(optarg); break;
+			case 'l': label = optarg; break;
+			default: usage();
+		}
+	}
+	if(nthreads < 1){
+		nthreads = 1;
+	}
+
+	ctxs = calloc(nthreads, sizeof(*ctxs));
+	for(t = 0; t < nthreads; t++){
+		ctxs[t].id = t;
+		ctxs[t].ops = nops;
+		ctxs[t].seed = 12345 + t;
+	}
+
+	start = now_ns();
+	if(bench->run != NULL){
+		bench->run(ctxs, nthreads);
+	}
+	else {
+		pthread_t threads[nthreads];
+
+		for(t = 0; t < nthreads; t++){
+			pthread_create(&threads[t], NULL, bench->thread_fn, &ctxs[t]);
+		}
+		for(t = 0; t < nthreads; t++){
+			pthread_join(threads[t], NULL);
+		}
+	}
+	elapsed = now_ns() - start;
+
+	for(t = 0; t < nthreads; t++){
+		total_ops += ctxs[t].done;
+		for(i = 0; i < HIST_BUCKETS; i++){
+			hist[i] += ctxs[t].hist[i];
+			samples += ctxs[t].hist[i];
+		}
+	}
+	getrusage(RUSAGE_SELF, &usage_info);
+
+	printf("%s %s %d %.0f %lu %lu %lu %ld\n", bench->name, label, nthreads,
+	       total_ops / (elapsed / 1e9),
+	       percentile(hist, samples, 0.50), percentile(hist, samples, 0.99), percentile(hist, samples, 0.999),
+	       usage_info.ru_maxrss);
+
+	printf("hist %s %s", bench->name, label);
+	for(i = 0; i < HIST_BUCKETS; i++){
+		printf(" %lu", hist[i]);
+	}
+	printf("\n");
+
+	free(ctxs);
+	return 0;
+}
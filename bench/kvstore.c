@@ -0,0 +1,224 @@
+/*
+ * Title: Dynamic Memory Allocator 
+ * Author: Christian Wills <cwills.dev@gmail.com>
+ * License: GPLv2 (see COPYING)
+ * File: bench/kvstore.c
+ */
+
+/*
+ * Synthetic in-memory key-value store, the multithreaded workload of bench/macro.sh. Threads run a
+ * get/put/delete mix over a shared hash table with one lock per bucket. Keys are short strings, values
+ * are a few bytes to a few kB and get replaced with a different size on every put, so the store keeps
+ * allocating and freeing across threads the way a cache server does.
+ *
+ * Usage: kvstore [-t threads] [-n ops per thread] [-k keys]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/// Hash buckets, each with its own lock
+#define NBUCKETS 65536
+
+/// Out of every 100 operations, this many are puts and this many deletes, the rest gets
+#define PUT_PCT 30
+#define DEL_PCT 10
+
+typedef struct entry {
+	struct entry *next;
+	char *key;
+	char *value;
+	size_t value_len;
+} entry_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	entry_t *head;
+} bucket_t;
+
+static bucket_t *buckets;
+static int nthreads = 1;
+static long nops = 1000000;
+static long nkeys = 100000;
+
+/**
+ * hash - FNV-1a of a nul terminated key.
+ */
+static unsigned long hash(const char *key){
+	unsigned long h = 14695981039346656037UL;
+
+	while(*key){
+		h = (h ^ (unsigned char) *key++) * 1099511628211UL;
+	}
+	return h;
+}
+
+static void *xmalloc(size_t size){
+	void *p = malloc(size);
+
+	if(p == NULL){
+		fprintf(stderr, "kvstore: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+/**
+ * value_size - Mostly small values with a long tail, like a session or page fragment cache.
+ */
+static size_t value_size(unsigned int *seed){
+	return 16 + (rand_r(seed) % 64) * (1 << (rand_r(seed) % 7));
+}
+
+/**
+ * kv_put - Insert or replace @key. A replaced value is freed and a new one of a different size allocated.
+ */
+static void kv_put(const char *key, unsigned int *seed){
+	bucket_t *b = &buckets[hash(key) % NBUCKETS];
+	size_t len = value_size(seed);
+	char *value = xmalloc(len);
+	entry_t *e;
+
+	memset(value, key[0], len);
+
+	pthread_mutex_lock(&b->lock);
+	for(e = b->head; e != NULL; e = e->next){
+		if(!strcmp(e->key, key)){
+			free(e->value);
+			e->value = value;
+			e->value_len = len;
+			pthread_mutex_unlock(&b->lock);
+			return;
+		}
+	}
+	e = xmalloc(sizeof(*e));
+	e->key = strdup(key);
+	e->value = value;
+	e->value_len = len;
+	e->next = b->head;
+	b->head = e;
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * kv_get - Look @key up and copy its value out, the way a server fills a reply buffer.
+ *          Returns the value's length, 0 if the key is missing.
+ */
+static size_t kv_get(const char *key){
+	bucket_t *b = &buckets[hash(key) % NBUCKETS];
+	size_t len = 0;
+	char *reply = NULL;
+	entry_t *e;
+
+	pthread_mutex_lock(&b->lock);
+	for(e = b->head; e != NULL; e = e->next){
+		if(!strcmp(e->key, key)){
+			len = e->value_len;
+			reply = xmalloc(len);
+			memcpy(reply, e->value, len);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	free(reply);
+	return len;
+}
+
+static void kv_delete(const char *key){
+	bucket_t *b = &buckets[hash(key) % NBUCKETS];
+	entry_t **pp, *e;
+
+	pthread_mutex_lock(&b->lock);
+	for(pp = &b->head; (e = *pp) != NULL; pp = &e->next){
+		if(!strcmp(e->key, key)){
+			*pp = e->next;
+			free(e->key);
+			free(e->value);
+			free(e);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void *kv_thread(void *arg){
+	unsigned int seed = 12345 + (unsigned int) (long) arg;
+	char key[32];
+	long i;
+	int op;
+
+	for(i = 0; i < nops; i++){
+		snprintf(key, sizeof(key), "key:%ld", rand_r(&seed) % nkeys);
+		op = rand_r(&seed) % 100;
+		if(op < PUT_PCT){
+			kv_put(key, &seed);
+		}
+		else if(op < PUT_PCT + DEL_PCT){
+			kv_delete(key);
+		}
+		else {
+			kv_get(key);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv){
+	unsigned int seed = 1;
+	char key[32];
+	entry_t *e, *next;
+	long i;
+	int opt, t;
+
+	while( (opt = getopt(argc, argv, "t:n:k:")) != -1){
+		switch(opt){
+			case 't': nthreads = atoi(optarg); break;
+			case 'n': nops = atol(optarg); break;
+			case 'k': nkeys = atol(optarg); break;
+			default:
+				fprintf(stderr, "usage: kvstore [-t threads] [-n ops per thread] [-k keys]\n");
+				return 2;
+		}
+	}
+	if(nthreads < 1){
+		nthreads = 1;
+	}
+	if(nkeys < 1){
+		nkeys = 1;
+	}
+
+	buckets = xmalloc(NBUCKETS * sizeof(*buckets));
+	for(i = 0; i < NBUCKETS; i++){
+		pthread_mutex_init(&buckets[i].lock, NULL);
+		buckets[i].head = NULL;
+	}
+
+	// Start with half the key space populated
+	for(i = 0; i < nkeys; i += 2){
+		snprintf(key, sizeof(key), "key:%ld", i);
+		kv_put(key, &seed);
+	}
+
+	pthread_t threads[nthreads];
+	for(t = 0; t < nthreads; t++){
+		pthread_create(&threads[t], NULL, kv_thread, (void *) (long) t);
+	}
+	for(t = 0; t < nthreads; t++){
+		pthread_join(threads[t], NULL);
+	}
+
+	for(i = 0; i < NBUCKETS; i++){
+		for(e = buckets[i].head; e != NULL; e = next){
+			next = e->next;
+			free(e->key);
+			free(e->value);
+			free(e);
+		}
+	}
+	free(buckets);
+	return 0;
+}
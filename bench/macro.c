@@ -0,0 +1,134 @@
+/*
+ * Title: Dynamic Memory Allocator 
+ * Author: Christian Wills <cwills.dev@gmail.com>
+ * License: GPLv2 (see COPYING)
+ * File: bench/macro.c
+ */
+
+/*
+ * Runs a real program, optionally with a malloc library preloaded into it, and reports what it cost
+ * (see bench/macro.sh and `make macrobench`). The runner itself allocates from glibc, only the
+ * program and whatever it executes get the library.
+ *
+ * Usage: macro [-p preload library] [-l label] [-r runs] <workload> <command> [args...]
+ *
+ * Every run prints one result line:
+ *   <workload> <label> <wall s> <user s> <sys s> <max rss kB> <minor faults> <major faults>
+ * With -r the fastest of the runs is reported, the others are mostly noise from the page cache.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static void usage(void){
+	fprintf(stderr, "usage: macro [-p preload library] [-l label] [-r runs] <workload> <command> [args...]\n");
+	exit(2);
+}
+
+/**
+ * now_ns - Monotonic clock in nanoseconds.
+ */
+static inline uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double tv_sec(struct timeval tv){
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * run_once - Run @argv to completion with @preload in LD_PRELOAD. Returns the wall time in ns and
+ *            stores the resource usage of the program and everything it waited for in @ru.
+ *            Exits if the program does not exit with status 0, a broken workload has no numbers worth comparing.
+ * @argv: command line, argv[0] is looked up in PATH
+ * @preload: library to preload, NULL to run against glibc
+ * @ru: filled in from wait4(), the same counters getrusage(RUSAGE_CHILDREN) keeps
+ */
+static uint64_t run_once(char **argv, const char *preload, struct rusage *ru){
+	uint64_t start, elapsed;
+	pid_t pid;
+	int status;
+
+	start = now_ns();
+	pid = fork();
+	if(pid < 0){
+		perror("macro: fork");
+		exit(1);
+	}
+	if(pid == 0){
+		if(preload != NULL){
+			setenv("LD_PRELOAD", preload, 1);
+		}
+		else {
+			unsetenv("LD_PRELOAD");
+		}
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+
+	if(wait4(pid, &status, 0, ru) < 0){
+		perror("macro: wait4");
+		exit(1);
+	}
+	elapsed = now_ns() - start;
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		if(WIFSIGNALED(status)){
+			fprintf(stderr, "macro: %s killed by signal %d\n", argv[0], WTERMSIG(status));
+		}
+		else {
+			fprintf(stderr, "macro: %s exited with status %d\n", argv[0], WEXITSTATUS(status));
+		}
+		exit(1);
+	}
+	return elapsed;
+}
+
+int main(int argc, char **argv){
+	const char *preload = NULL;
+	const char *label = "default";
+	const char *workload;
+	struct rusage ru, best_ru = {0};
+	uint64_t ns, best = UINT64_MAX;
+	int runs = 1;
+	int opt, i;
+
+	// Stop at the workload name, everything after it belongs to the command
+	while( (opt = getopt(argc, argv, "+p:l:r:")) != -1){
+		switch(opt){
+			case 'p': preload = optarg; break;
+			case 'l': label = optarg; break;
+			case 'r': runs = atoi(optarg); break;
+			default: usage();
+		}
+	}
+	if(argc - optind < 2){
+		usage();
+	}
+	if(runs < 1){
+		runs = 1;
+	}
+	workload = argv[optind];
+
+	for(i = 0; i < runs; i++){
+		ns = run_once(&argv[optind + 1], preload, &ru);
+		if(ns < best){
+			best = ns;
+			best_ru = ru;
+		}
+	}
+
+	printf("%s %s %.3f %.3f %.3f %ld %ld %ld\n", workload, label, best / 1e9,
+	       tv_sec(best_ru.ru_utime), tv_sec(best_ru.ru_stime),
+	       best_ru.ru_maxrss, best_ru.ru_minflt, best_ru.ru_majflt);
+	return 0;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Title: Dynamic Memory Allocator 
+# Author: Christian Wills <cwills.dev@gmail.com>
+# License: GPLv2 (see COPYING)
+# File: bench/macro.sh
+#
+# Run real, allocation heavy programs against glibc and libmymalloc and print wall time, peak RSS and
+# page faults side by side.
+#
+# Usage: bench/macro.sh [runs] [threads]
+# WORKLOADS="cc kvstore" limits the run to the listed workloads, a workload whose program is not
+# installed is skipped. Rows where libmymalloc is more than MAX_RATIO (default 1.10) times slower
+# or bigger than glibc are marked with a !.
+# MYMALLOC_CONF is passed on, so the same table can compare runtime options against glibc.
+# The raw result lines are kept in macro_output.txt.
+
+cd "$(dirname "$0")/.." || exit 1
+
+RUNS=${1:-3}
+THREADS=${2:-$(nproc)}
+LIB=$(pwd)/bench/libmymalloc.so
+OUT=macro_output.txt
+WORKLOADS=${WORKLOADS:-"cc sort python kvstore"}
+MAX_RATIO=${MAX_RATIO:-1.10}
+CC=${CC:-gcc}
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# The workload's command line, empty if it can't run here
+workload_cmd(){
+	case "$1" in
+		# cc1 allocates a tree per expression and a lot of small bitmaps per function
+		cc)
+			command -v "$CC" > /dev/null && echo "$CC -O2 -g -c -o $TMP/cc.o malloc.c" ;;
+		# Large sort and merge buffers sized from the input, mostly over the mmap threshold
+		sort)
+			command -v sort > /dev/null && echo "env LC_ALL=C sort --parallel=$THREADS -o $TMP/sorted $TMP/lines" ;;
+		# Lots of small dicts, strings and ints, freed in bulk between rounds
+		python)
+			command -v python3 > /dev/null && echo "python3 $TMP/dicts.py" ;;
+		kvstore)
+			echo "./bench/kvstore -t $THREADS -n 50000 -k 10000" ;;
+	esac
+}
+
+# Inputs, generated once so glibc and libmymalloc work on the same data
+awk 'BEGIN { srand(1); for(i = 0; i < 1000000; i++) printf "%x %d %s\n", int(rand() * 2^31), i, substr("abcdefghijklmnopqrstuvwxyz", 1 + int(rand() * 26)) }' > "$TMP/lines"
+cat > "$TMP/dicts.py" << 'EOF'
+for r in range(5):
+    d = {}
+    for i in range(200000):
+        d["k%d" % i] = {"id": i, "name": "n" * (i % 32), "tags": [i, str(i)]}
+    for i in range(0, 200000, 3):
+        del d["k%d" % i]
+    s = sum(len(v["name"]) for v in d.values())
+EOF
+
+: > "$OUT"
+for w in $WORKLOADS; do
+	cmd=$(workload_cmd "$w")
+	if [ -z "$cmd" ]; then
+		echo "macro: skipping $w" >&2
+		continue
+	fi
+	./bench/macro -r "$RUNS" -l glibc "$w" $cmd >> "$OUT" || exit 1
+	./bench/macro -r "$RUNS" -l mymalloc -p "$LIB" "$w" $cmd >> "$OUT" || exit 1
+done
+
+# Wall time is the fastest of the runs, RSS and faults are from that run
+awk -v max="$MAX_RATIO" '
+	$2 == "glibc" { g[$1] = $0; order[n++] = $1; next }
+	$2 == "mymalloc" { m[$1] = $0 }
+	END {
+		printf "%-8s | %8s %9s %9s | %8s %9s %9s | %6s %6s\n", "", "glibc", "", "", "mymalloc", "", "", "", ""
+		printf "%-8s | %8s %9s %9s | %8s %9s %9s | %6s %6s\n", "workload", "wall s", "rss kB", "minflt", "wall s", "rss kB", "minflt", "time", "rss"
+		for(i = 0; i < n; i++){
+			split(g[order[i]], a, " ")
+			split(m[order[i]], b, " ")
+			t = b[3] / a[3]
+			r = b[6] / a[6]
+			printf "%-8s | %8.3f %9d %9d | %8.3f %9d %9d | %6.2f %6.2f %s\n", a[1], a[3], a[6], a[7], b[3], b[6], b[7], t, r, (t > max || r > max) ? "!" : ""
+		}
+	}' "$OUT"
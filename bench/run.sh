@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Title: Dynamic Memory Allocator 
+# Author: Christian Wills <cwills.dev@gmail.com>
+# License: GPLv2 (see COPYING)
+# File: bench/run.sh
+#
+# Run every microbenchmark against glibc and libmymalloc and print them side by side.
+#
+# Usage: bench/run.sh [threads] [ops per thread]
+# BENCHMARKS="churn-small larson" limits the run to the listed benchmarks.
+# The raw result and histogram lines are kept in bench_output.txt.
+
+cd "$(dirname "$0")/.." || exit 1
+
+THREADS=${1:-$(nproc)}
+OPS=${2:-1000000}
+LIB=$(pwd)/bench/libmymalloc.so
+OUT=bench_output.txt
+BENCHMARKS=${BENCHMARKS:-"churn-small churn-mixed churn-large larson threadtest xmalloc realloc cache-scratch"}
+
+: > "$OUT"
+for b in $BENCHMARKS; do
+	./bench/bench "$b" -t "$THREADS" -n "$OPS" -l glibc >> "$OUT" || exit 1
+	LD_PRELOAD="$LIB" ./bench/bench "$b" -t "$THREADS" -n "$OPS" -l mymalloc >> "$OUT" || exit 1
+done
+
+# Latency percentiles are upper bounds of log2 buckets of sampled malloc()/realloc() calls
+awk '
+	$1 == "hist" { next }
+	$2 == "glibc" { g[$1] = $0; order[n++] = $1; next }
+	$2 == "mymalloc" { m[$1] = $0 }
+	END {
+		printf "%-14s %3s | %12s %6s %6s %8s | %12s %6s %6s %8s | %6s\n", "", "", "glibc", "", "", "", "mymalloc", "", "", "", ""
+		printf "%-14s %3s | %12s %6s %6s %8s | %12s %6s %6s %8s | %6s\n", "benchmark", "thr", "ops/s", "p50ns", "p99ns", "rss kB", "ops/s", "p50ns", "p99ns", "rss kB", "ratio"
+		for(i = 0; i < n; i++){
+			split(g[order[i]], a, " ")
+			split(m[order[i]], b, " ")
+			printf "%-14s %3d | %12d %6d %6d %8d | %12d %6d %6d %8d | %6.2f\n", a[1], a[3], a[4], a[5], a[6], a[8], b[4], b[5], b[6], b[8], b[4] / a[4]
+		}
+	}' "$OUT"
@@ -4,26 +4,161 @@
  * License: GPLv2 (see COPYING)
  * File: malloc.c
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#ifdef MALLOC_HARDENED
+#include <sys/auxv.h>
+#endif
+#ifdef MALLOC_NUMA
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 #include "list.h"
 #include "malloc.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * USDT probes under the "mymalloc" provider, e.g. `bpftrace -e 'usdt:./libmymalloc.so:mymalloc:sys_malloc { @[arg1] = count(); }'`.
+ * They assemble to a single nop and are only compiled in when sys/sdt.h (systemtap-sdt-dev) is installed.
+ */
+#if !defined(MALLOC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MALLOC_PROBE(name, ...) STAP_PROBEV(mymalloc, name, __VA_ARGS__)
+#endif
+#endif
+#ifndef MALLOC_PROBE
+#define MALLOC_PROBE(name, ...) do { } while(0)
+#endif
+
+/*
+ * Per-CPU caches need restartable sequences registered by glibc (2.35 and later) and are written in
+ * x86-64 assembly. Everywhere else malloc() and free() always take the arena lock.
+ */
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#define MALLOC_PERCPU_RSEQ
+#endif
+#endif
+
+/// Default byte alignment of all requests (MYMALLOC_CONF alignment, must be a power of 2)
+#define DEFAULT_BYTE_ALIGNMENT 8
+
+/// Default minimum request size (MYMALLOC_CONF min_size)
+#define DEFAULT_MIN_MAL_SIZE 8
+
+/// Default minimum brk increase in bytes (MYMALLOC_CONF brk_increase)
+#define DEFAULT_MIN_BRK_INCREASE 8192
+
+/// Default minimum brk decrease in bytes (MYMALLOC_CONF trim_threshold), glibc's M_TRIM_THRESHOLD default
+#define DEFAULT_MIN_BRK_DECREASE (128 * 1024)
+
+/// Default request size from which memory is mmap()ed directly (MYMALLOC_CONF mmap_threshold)
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+/// Default largest request kept on a quick list when freed (MYMALLOC_CONF quick_max)
+#define DEFAULT_QUICK_MAX 256
+
+/// Default bytes an arena may hold on its quick lists before they are consolidated (MYMALLOC_CONF quick_budget)
+#define DEFAULT_QUICK_BUDGET (64 * 1024)
+
+/// Default size from which realloc() copies and calloc() clears bypass the cache (MYMALLOC_CONF stream_threshold)
+#define DEFAULT_STREAM_THRESHOLD (1024 * 1024)
+
+/// Number of quick lists per arena, one per alignment unit of usable size
+#define NQUICK_BINS 64
+
+/// Name of the environment variable holding the startup configuration
+#define CONF_ENV_VAR "MYMALLOC_CONF"
+
+/// Runtime tunables. Everything the fast paths read lives here, on as few cache lines as possible.
+struct malloc_params {
+	size_t byte_alignment;			// fullfill all requests with the given byte alignment
+	size_t pad_size;				// derived from byte_alignment, see PAD_SIZE
+	unsigned int align_shift;		// log2(byte_alignment)
+	size_t min_mal_size;			// even when malloc(0) is called, at minimum a pointer to this many bytes is returned
+	size_t min_brk_increase;		// minimum brk increase in bytes
+	size_t min_brk_decrease;		// minimum brk decrease in bytes
+	size_t mmap_threshold;			// requests of at least this many bytes get their own mapping
+	size_t quick_max;				// largest usable size kept on the quick lists (0 disables them)
+	size_t quick_budget;			// bytes an arena may hold on quick lists before consolidating
+	size_t page_size;
+	size_t stream_threshold;		// realloc() copies and calloc() clears at least this large use streaming stores
+	int placement;					// M_PLACEMENT_* policy used to pick a free chunk
+	int numa_fake_nodes;			// pretend the machine has this many NUMA nodes (0 = use sysfs)
+	unsigned int guard_sample;		// every guard_sample'th request gets guard pages (0 = never)
+	size_t quarantine_max;			// bytes of freed chunks each arena holds back before reusing them (0 disables)
+	unsigned int purge_decay;		// ms before the purge thread has given freed pages back (0 = trim inline in free())
+	int purge_advice;				// madvise() advice used to purge pages
+	unsigned int percpu;			// chunks cached per size and CPU (0 disables the per-CPU caches)
+	bool mesh;						// pools created from now on take their slabs from the mesh region
+	bool budget_cgroup;				// take unset budget limits from the cgroup's memory limits at startup
+	size_t soft_limit;				// heap and mapped bytes past which memory is purged and pressure callbacks run (0 = none)
+	size_t hard_limit;				// heap and mapped bytes the allocator never grows past (0 = none)
+	bool layout_frozen;				// set once the first chunk exists, byte_alignment can't change after that
+	bool initialized;
+} __attribute__((aligned(64)));
+
+static struct malloc_params mparams = {
+	.byte_alignment = DEFAULT_BYTE_ALIGNMENT,
+	.min_mal_size = DEFAULT_MIN_MAL_SIZE,
+	.min_brk_increase = DEFAULT_MIN_BRK_INCREASE,
+	.min_brk_decrease = DEFAULT_MIN_BRK_DECREASE,
+	.mmap_threshold = DEFAULT_MMAP_THRESHOLD,
+	.quick_max = DEFAULT_QUICK_MAX,
+	.quick_budget = DEFAULT_QUICK_BUDGET,
+	.stream_threshold = DEFAULT_STREAM_THRESHOLD,
+	.placement = M_PLACEMENT_WORST_FIT,
+	.purge_advice = MADV_DONTNEED,
+};
+
+static pthread_once_t mparams_once = PTHREAD_ONCE_INIT;
+
+/// Private set_param() ids for options that can only be given in MYMALLOC_CONF
+#define CONF_NUMA_FAKE_NODES -1000
+#define CONF_PURGE_LAZY -1001
+#define CONF_PERCPU -1002
+#define CONF_MESH -1003
+#define CONF_CGROUP -1004
+
 /// Fullfill all requests with the given byte alignment
-#define BYTE_ALIGNMENT 8
+#define BYTE_ALIGNMENT (mparams.byte_alignment)
 
 /// Even when malloc(0) is called, at minimum the a pointer to the following number of bytes is returned
-#define MIN_MAL_SIZE 8
+#define MIN_MAL_SIZE (mparams.min_mal_size)
 
 /// Minimum brk increase in bytes
-#define MIN_BRK_INCREASE 8192
+#define MIN_BRK_INCREASE (mparams.min_brk_increase)
 
 /// Minimum brk decrease in bytes
-#define MIN_BRK_DECREASE 8192
+#define MIN_BRK_DECREASE (mparams.min_brk_decrease)
+
+/// Round @size up to a multiple of @align (a power of 2)
+#define ALIGN_UP(size, align) (((size) + (align) - 1) & ~((size_t) (align) - 1))
+
+/// Requests larger than this are refused outright so size arithmetic can't wrap
+#define MAX_REQUEST_SIZE (SIZE_MAX / 2)
 
 /// Memory chunk metadata structure
 typedef struct {
@@ -31,13 +166,41 @@ typedef struct {
 	size_t size; 					// (mem requested + padding) + this struct overhead
 	struct list_head free_list;
 	short int used;					// used flag - TODO merge this into a bit field inside size
+	unsigned short tag;				// mm_malloc_tagged() tag of a chunk handed out, 0 if untagged. Fits in the padding.
+#ifdef MALLOC_HARDENED
+	unsigned int cksum;				// chunk_cksum() of prev_size and size, fits in the struct's padding
+#endif
 } malloc_chunk_t;
 
+/// used flag of a chunk that was mmap()ed on its own. prev_size holds the offset of the chunk in its mapping.
+#define CHUNK_MMAPPED 2
+
+/// used flag of a freed chunk parked on a quick list. It still looks used to its neighbours so it won't be merged.
+#define CHUNK_QUICK 3
+
+/// used flag of the top chunk, the always last chunk of the heap that new chunks are carved from
+#define CHUNK_TOP 4
+
+/// used flag of a chunk mapped on its own and followed by a PROT_NONE page. prev_size is the offset in its mapping.
+#define CHUNK_GUARDED 5
+
+/// used flag of a freed chunk held in quarantine. Poisoned, and looks used to its neighbours so it won't be merged.
+#define CHUNK_QUARANTINED 6
+
+/// used flag of a freed chunk held in a per-CPU cache. Also looks used to its neighbours.
+#define CHUNK_PERCPU 7
+
+/// Byte quarantined chunks are filled with. Anything else found on eviction was written through a stale pointer.
+#define QUARANTINE_POISON 0xdd
+
+/// Largest step the heap grows by at once when the top chunk runs out
+#define MAX_TOP_GROW (4 * 1024 * 1024)
+
 /// PAD to add to malloc_chunk_t struct so that mem returned to user is aligned
-#define PAD_SIZE (BYTE_ALIGNMENT - (sizeof(malloc_chunk_t) % BYTE_ALIGNMENT))
+#define PAD_SIZE (mparams.pad_size)
 
 /// Given a request size, returns the minimum chunk size to fullfill the request and maintain alignment
-#define CALC_CHUNK_SIZE(size) (size + (BYTE_ALIGNMENT - (size % BYTE_ALIGNMENT)) + sizeof(malloc_chunk_t) + PAD_SIZE) 
+#define CALC_CHUNK_SIZE(size) (ALIGN_UP(size, BYTE_ALIGNMENT) + sizeof(malloc_chunk_t) + PAD_SIZE) 
 
 /// Smallest chunk possible
 #define MIN_CHUNK_SIZE CALC_CHUNK_SIZE(MIN_MAL_SIZE)
@@ -48,60 +211,640 @@ typedef struct {
 /// converts a pointer to memmory to a pointer to the malloc_chunk_t that represents it
 #define mem2chunk(mem) 	(malloc_chunk_t *)(((char *) mem) - sizeof(malloc_chunk_t) - PAD_SIZE)
 
-/// Linked list of free memmory chunks
-static struct list_head free_list = LIST_HEAD_INIT(free_list); 
+/// bytes of a chunk available to the user
+#define CHUNK_USABLE(chunk) ((chunk)->size - sizeof(malloc_chunk_t) - PAD_SIZE)
+
+/// quick list a chunk with @usable bytes belongs on
+#define QUICK_INDEX(usable) ((usable) >> mparams.align_shift)
+
+#ifdef MALLOC_HARDENED
+/// Per-process secret mixed into quick list links and header checksums, see malloc_init()
+static uintptr_t malloc_secret;
+
+/// Encode or decode a quick list link stored at @pos. The position makes equal pointers encode differently.
+#define PROTECT_PTR(pos, ptr) ((((uintptr_t) (pos)) >> 12) ^ malloc_secret ^ (uintptr_t) (ptr))
+
+/// next chunk on a quick list. Quick lists are singly linked through free_list.next.
+#define QUICK_NEXT(chunk) ((malloc_chunk_t *) PROTECT_PTR(&(chunk)->free_list.next, (chunk)->free_list.next))
+
+/// link @next after @chunk on a quick list
+#define SET_QUICK_NEXT(chunk, next_chunk) ((chunk)->free_list.next = (struct list_head *) PROTECT_PTR(&(chunk)->free_list.next, next_chunk))
+
+/// Recompute @chunk's checksum after its prev_size or size changed
+#define SEAL_CHUNK(chunk) ((chunk)->cksum = chunk_cksum(chunk))
+
+/// Abort if @chunk's header was overwritten since it was last sealed. @func names the caller in the report.
+#define CHECK_CHUNK(chunk, func) do { \
+	if(((uintptr_t) (chunk) & (BYTE_ALIGNMENT - 1)) || (chunk)->cksum != chunk_cksum(chunk)){ \
+		malloc_corruption(func, "corrupted chunk header", chunk); \
+	} \
+} while(0)
+
+/// Abort if a chunk taken off a quick list is misaligned, i.e. the link leading to it was overwritten
+#define CHECK_QUICK_LINK(chunk, func) do { \
+	if((uintptr_t) (chunk) & (BYTE_ALIGNMENT - 1)){ \
+		malloc_corruption(func, "corrupted quick list", chunk); \
+	} \
+} while(0)
+#else
+/// next chunk on a quick list. Quick lists are singly linked through free_list.next.
+#define QUICK_NEXT(chunk) ((malloc_chunk_t *) (chunk)->free_list.next)
+
+/// link @next after @chunk on a quick list
+#define SET_QUICK_NEXT(chunk, next_chunk) ((chunk)->free_list.next = (struct list_head *) (next_chunk))
+
+#define SEAL_CHUNK(chunk) do { } while(0)
+#define CHECK_CHUNK(chunk, func) do { } while(0)
+#define CHECK_QUICK_LINK(chunk, func) do { } while(0)
+#endif
+
+/// A contiguous heap and the free list that indexes it. Chunks never move between arenas.
+typedef struct {
+	pthread_mutex_t lock;			// master lock for everything below
+	struct list_head free_list;		// linked list of free memmory chunks
+	malloc_chunk_t *heap_head;		// start of the heap, set on first sys_malloc()
+	malloc_chunk_t *heap_tail;		// last chunk on the heap, always the top chunk
+	size_t top_grow;				// next heap growth step, doubles up to MAX_TOP_GROW
+	size_t last_grow;				// bytes the heap grew by last time, kept as padding by shrink_brk()
+	char *seg_base;					// reserved mapping backing the heap, NULL for the brk heap
+	char *seg_top;					// current end of the heap inside the mapping
+	char *seg_end;					// end of the reserved mapping
+	size_t quick_bytes;				// bytes held on the quick lists
+	size_t heap_bytes;				// bytes of heap owned by the arena
+	size_t allocated_bytes;			// bytes of chunks (headers included) currently handed out
+	malloc_chunk_t *quick_bins[NQUICK_BINS];	// LIFO lists of freed, unmerged small chunks by usable size
+	malloc_chunk_t *quarantine_head;	// oldest quarantined chunk, linked through free_list.next like the quick lists
+	malloc_chunk_t *quarantine_tail;	// newest quarantined chunk
+	size_t quarantine_bytes;		// bytes held in quarantine
+	unsigned long top_dirty_epoch;	// purge_epoch when freed chunks were last folded into the top chunk
+	size_t top_dirty_size;			// size of the top chunk then
+} malloc_arena_t;
+
+/// The brk heap. Used by every thread unless NUMA arenas are enabled.
+static malloc_arena_t main_arena = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.free_list = LIST_HEAD_INIT(main_arena.free_list),
+};
+
+#ifdef MALLOC_NUMA
+/// Maximum number of NUMA nodes with their own arena
+#define MAX_NUMA_NODES 64
+
+/// Maximum number of CPUs in the cpu -> node table
+#define MAX_NUMA_CPUS 1024
+
+/// Address space reserved for each node arena. Pages are only backed once touched.
+#define NUMA_ARENA_RESERVE ((size_t) 1 << 36)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/// One arena per node, all carved out of a single reservation so a chunk's home is found by arithmetic
+static malloc_arena_t numa_arenas[MAX_NUMA_NODES];
+
+/// Start of the reservation holding all node arenas
+static char *numa_base = NULL;
+
+/// Number of node arenas in use. NUMA mode is off unless this is > 1.
+static int numa_nodes = 0;
+
+/// Set when the topology comes from the numa_fake_nodes option rather than sysfs
+static bool numa_fake = false;
+
+/// cpu -> node table read from sysfs
+static unsigned char numa_cpu_node[MAX_NUMA_CPUS];
+
+/// Node handed to the calling thread in fake topology mode
+static __thread int numa_thread_node = -1;
+#endif
+
+/// Bytes in chunks that have their own mapping
+static size_t mmapped_bytes = 0;
+
+/// Bytes of heap taken with arena_morecore(), all arenas together. With mmapped_bytes what the budget limits.
+static size_t heap_footprint = 0;
+
+/// Set when growth crossed the soft limit (or hit the hard one), budget_relieve() runs at the end of the malloc()
+static bool budget_pending = false;
+
+/// Held by the one thread running budget_relieve()
+static bool budget_running = false;
+
+/// Footprint from which the soft limit triggers again, so an application that stays over it isn't purged on every growth
+static size_t budget_rearm = 0;
+
+/// Set while the calling thread allocates with an allocator lock held. budget_relieve() takes those locks, it waits.
+static __thread int budget_hold = 0;
+
+/// Times budget_relieve() ran
+static size_t pressure_count = 0;
+
+/// Registered with mm_add_pressure_callback()
+#define MAX_PRESSURE_CALLBACKS 16
+
+static struct {
+	mm_pressure_fn fn;
+	void *arg;
+} pressure_callbacks[MAX_PRESSURE_CALLBACKS];
+static pthread_mutex_t pressure_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef MALLOC_PAGEMAP
+/// Address bits the page map covers, all of user space with 4-level page tables
+#define PAGEMAP_BITS 48
+
+/// log2 of the pages the map tracks. Independent of the real page size, every mapping is a multiple of it.
+#define PAGEMAP_PAGE_SHIFT 12
+
+/// log2 of the entries in a leaf, which then covers 16MB
+#define PAGEMAP_LEAF_BITS 12
+
+/// log2 of the entries in a mid level node, which then covers 64GB
+#define PAGEMAP_MID_BITS 12
+
+/// log2 of the entries in the root
+#define PAGEMAP_ROOT_BITS (PAGEMAP_BITS - PAGEMAP_PAGE_SHIFT - PAGEMAP_LEAF_BITS - PAGEMAP_MID_BITS)
+
+/// Bytes of address space one leaf covers
+#define PAGEMAP_LEAF_SPAN ((uintptr_t) 1 << (PAGEMAP_PAGE_SHIFT + PAGEMAP_LEAF_BITS))
+
+/// What the page map knows about a page: how chunks on it are freed and, for heap pages, their arena
+typedef struct {
+	short int kind;					// true for heap pages, CHUNK_MMAPPED or CHUNK_GUARDED
+	malloc_arena_t *arena;			// arena owning the heap, NULL otherwise
+} malloc_span_t;
+
+/// Last level of the page map. Besides the span of each page it holds one bit per 8 bytes of address
+/// space, set at the start of every chunk that is on a free list, so coalescing never has to read a
+/// neighbour's header to learn that it is in use.
+typedef struct {
+	malloc_span_t *spans[1 << PAGEMAP_LEAF_BITS];
+	unsigned long free_map[PAGEMAP_LEAF_SPAN / sizeof(void *) / (sizeof(unsigned long) * 8)];
+} pagemap_leaf_t;
+
+/// Root of the page map. Lower levels are mapped the first time one of their pages is registered and never freed.
+static pagemap_leaf_t **pagemap_root[1 << PAGEMAP_ROOT_BITS];
+
+/// Span of the brk heap
+static malloc_span_t main_span = { .kind = true, .arena = &main_arena };
+
+#ifdef MALLOC_NUMA
+/// Spans of the node arenas, set up by numa_init()
+static malloc_span_t numa_spans[MAX_NUMA_NODES];
+#endif
+
+/// Span shared by every chunk mapped on its own, the mapping itself is described by the chunk header
+static malloc_span_t mmap_span = { .kind = CHUNK_MMAPPED };
+
+#ifdef MALLOC_GUARD
+/// Span shared by every guarded mapping
+static malloc_span_t guard_span = { .kind = CHUNK_GUARDED };
+#endif
+
+static inline pagemap_leaf_t *pagemap_leaf(const void *ptr, bool create);
+
+/// Word and bit of the free map holding @chunk's free bit. The leaf exists as long as the chunk's heap page is registered.
+#define FREE_MAP_WORD(chunk) (pagemap_leaf(chunk, false)->free_map[((uintptr_t) (chunk) & (PAGEMAP_LEAF_SPAN - 1)) / sizeof(void *) / (sizeof(unsigned long) * 8)])
+#define FREE_MAP_BIT(chunk) (1UL << (((uintptr_t) (chunk) / sizeof(void *)) % (sizeof(unsigned long) * 8)))
+
+/// True if @chunk is on its arena's free list, read from the free map instead of its header. Arena lock held.
+#define CHUNK_IS_FREE(chunk) ((FREE_MAP_WORD(chunk) & FREE_MAP_BIT(chunk)) != 0)
+
+/// Mark @chunk free or in use. Arenas own whole pages, so two never share a word and the arena lock covers it.
+#define SET_CHUNK_FREE(chunk) (FREE_MAP_WORD(chunk) |= FREE_MAP_BIT(chunk))
+#define CLEAR_CHUNK_FREE(chunk) (FREE_MAP_WORD(chunk) &= ~FREE_MAP_BIT(chunk))
+#else
+/// Without the page map only the header knows whether a chunk is free
+#define CHUNK_IS_FREE(chunk) (!(chunk)->used)
+#define SET_CHUNK_FREE(chunk) do { } while(0)
+#define CLEAR_CHUNK_FREE(chunk) do { } while(0)
+#endif
+
+/// Most chunks a per-CPU cache holds per size (a bin is then 256 bytes)
+#define PERCPU_MAX 31
+
+/// Per-CPU cache of freed chunks of one size, a stack of count chunks
+typedef struct {
+	unsigned long count;
+	malloc_chunk_t *chunks[PERCPU_MAX];
+} percpu_bin_t;
+
+/// log2 of the bytes of per-CPU bins each CPU has, one per quick list
+#define PERCPU_SHIFT 14
+
+/// Set in a bin's count while percpu_drain() empties it. The count then looks negative to percpu_pop()
+/// and too large to percpu_push(), so both give up.
+#define PERCPU_DRAINING (1UL << 63)
+
+#ifdef MALLOC_PERCPU_RSEQ
+/// Per-CPU bins, NQUICK_BINS for each CPU. NULL while the per-CPU caches are off.
+static percpu_bin_t *percpu_bins = NULL;
+
+/// CPUs percpu_bins has room for
+static unsigned int percpu_ncpus = 0;
+
+/// True if membarrier() can restart the critical sections running on another CPU, which percpu_drain()
+/// needs to empty any bins but the calling CPU's
+static bool percpu_fence = false;
+#endif
+
+/// Ticks of the purge thread it takes for freed pages to decay completely, see purge_arena()
+#define PURGE_STEPS 16
+
+/// Most free chunks the purge thread looks at per arena and tick, bounds the time it holds an arena lock
+#define PURGE_BATCH 256
+
+/// Purge ticks since startup. Free chunks are stamped with it, so it starts at 1 and 0 means purged.
+static unsigned long purge_epoch = 1;
+
+/// Epoch the free chunk was last dirtied in, kept in the first word of its memory
+#define FREE_STAMP(chunk) (*(unsigned long *) chunk2mem(chunk))
+
+/// Set while the purge thread runs. free() leaves trimming the heap to it then.
+static bool purge_running = false;
+
+/// Bytes given back to the system by the purge thread and mm_release_free_memory()
+static size_t purged_bytes = 0;
+
+#ifdef MALLOC_PROFILE
+/// Cycle histograms of the slow paths, see mm_get_profile()
+static struct mm_profile profile;
+
+/// Start timing a slow path
+#define PROFILE_START(var) uint64_t var = read_cycles()
+
+/// Record the cycles spent in slow path @path since PROFILE_START(@var)
+#define PROFILE_END(path, var) profile_record(path, read_cycles() - (var))
+#else
+#define PROFILE_START(var) do { } while(0)
+#define PROFILE_END(path, var) do { } while(0)
+#endif
+
+#ifdef MALLOC_GUARD
+/// Freed guarded mappings kept inaccessible before they are unmapped and their addresses can be reused
+#define GUARD_QUARANTINE 1024
+
+/// FIFO of quarantined guarded mappings
+static struct {
+	char *addr;
+	size_t len;
+} guard_quarantine[GUARD_QUARANTINE];
+
+/// Next slot of guard_quarantine to fill, the oldest entry once the FIFO has wrapped
+static unsigned int guard_next = 0;
+
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Requests the calling thread makes before the next one is guarded
+static __thread unsigned int guard_countdown = 0;
+#endif
+
+/// Number of live regions
+static size_t region_count = 0;
+
+/// Bytes of blocks held by regions
+static size_t region_bytes = 0;
+
+/// Bytes handed out by mm_region_alloc() and not yet reset
+static size_t region_allocated_bytes = 0;
+
+/// Default block size of a region
+#define REGION_BLOCK_SIZE (16 * 1024)
+
+/// Block of heap memory a region bump allocates out of
+typedef struct mm_region_block {
+	struct mm_region_block *next;
+	size_t size;					// bytes of the block, header included
+} mm_region_block_t;
+
+/// Offset of the first usable byte in a region block
+#define REGION_BLOCK_HDR ALIGN_UP(sizeof(mm_region_block_t), BYTE_ALIGNMENT)
 
-/// Start of the heap, set on first call to malloc()
-static malloc_chunk_t *heap_head = NULL;
+struct mm_region {
+	mm_region_block_t *blocks;		// newest block first, the current one is always at the head
+	mm_region_block_t *large;		// blocks of their own for requests larger than block_size
+	char *cur;						// bump pointer inside the current block
+	char *end;						// end of the current block
+	size_t block_size;				// size of a regular block
+	size_t allocated_bytes;			// bytes handed out since the last reset
+};
 
-/// Last chunk on the heap
-static malloc_chunk_t *heap_tail = NULL;
+/// Smallest pool slab. Slabs are a power of 2 in size and aligned to their size.
+#define POOL_MIN_SLAB_SIZE (16 * 1024)
 
-/// Master lock
-static pthread_mutex_t master_lock = PTHREAD_MUTEX_INITIALIZER;
+/// Objects cached per thread per pool
+#define POOL_MAG_SIZE 32
+
+/// Empty slabs a pool keeps around before giving them back to the heap
+#define POOL_KEEP_EMPTY 1
+
+/// Magazine operations between two scavenges of the objects a thread left unused
+#define POOL_SCAVENGE_TICKS 1024
+
+/// Maximum number of live pools
+#define MAX_POOLS 256
+
+/// Most slabs meshed onto the physical memory of one slab
+#define MESH_MAX_ALIASES 4
+
+/// Most partial slabs of a pool mm_pool_mesh() tries to pair up in one pass
+#define MESH_MAX_CANDIDATES 64
+
+/// Address space reserved for slabs of meshable pools. Backed by a memfd, pages exist only once touched.
+#define MESH_RESERVE ((size_t) 1 << 36)
+
+/// Slab of constructed objects. The header sits at the start of the slab, objects follow.
+typedef struct mm_pool_slab {
+	struct list_head list;			// on the pool's partial, full or empty list
+	mm_pool_t *pool;
+	struct mm_pool_slab *self;		// the slab's own address, also when the header is seen through an alias
+	unsigned int naliases;
+	void *aliases[MESH_MAX_ALIASES];	// slabs meshed onto this one's memory, they now map the same pages
+	unsigned int nfree;				// entries on free_idx
+	unsigned short free_idx[];		// stack of indexes of free objects
+} mm_pool_slab_t;
+
+/// Per thread cache of free objects of one pool
+typedef struct {
+	struct list_head list;			// on the pool's mags list
+	mm_pool_t *pool;				// NULL once the pool is destroyed
+	unsigned int count;
+	unsigned int low_water;			// lowest count since the last scavenge
+	unsigned int ticks;				// operations since the last scavenge
+	unsigned int release_gen;		// release_gen seen at the last scavenge
+	void *objs[POOL_MAG_SIZE];
+} mm_pool_mag_t;
+
+struct mm_pool {
+	pthread_mutex_t lock;			// protects everything below
+	size_t obj_size;				// object stride
+	size_t slab_size;
+	size_t obj_offset;				// offset of the first object in a slab
+	unsigned int objs_per_slab;
+	void (*ctor)(void *);
+	void (*dtor)(void *);
+	struct list_head partial;		// slabs with free and used objects
+	struct list_head full;			// slabs with no free objects
+	struct list_head empty;			// slabs with no used objects
+	unsigned int nempty;
+	struct list_head mags;			// every thread's magazine for this pool
+	int id;							// index in pool_table and thread_mags
+	bool meshable;					// slabs come from the mesh region, see mm_pool_mesh()
+};
+
+/// Live pools by id
+static mm_pool_t *pool_table[MAX_POOLS];
+
+/// Free slab sized holes in the mesh region, reused before its break moves
+struct mesh_hole {
+	char *addr;
+	size_t size;
+	struct mesh_hole *next;
+};
+
+/// Mesh region: a reservation mapped MAP_SHARED onto a memfd, slab N maps file offset N. Meshing remaps a slab onto another one's offset.
+static struct {
+	pthread_mutex_t lock;			// protects everything below, and serializes mesh passes
+	int fd;							// -1 until mesh_init()
+	char *base;
+	char *brk;						// end of the slabs handed out so far
+	struct mesh_hole *holes;
+	struct sigaction old_segv;		// handler in place before mesh_init()
+} mesh = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+/// Slab being meshed away (or the last one that was). Writes to it fault while mesh_busy, mesh_segv() holds them till the remap is done.
+static char *mesh_fault_lo = NULL;
+static char *mesh_fault_hi = NULL;
+static bool mesh_busy = false;
+
+/// Bytes of pool slabs given back by meshing
+static size_t meshed_bytes = 0;
+
+/// Protects pool_table, pool ids and pool_key
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Number of live pools
+static size_t pool_count = 0;
+
+/// Bytes of slabs held by pools
+static size_t pool_bytes = 0;
+
+/// Bumped by mm_release_free_memory() so every thread empties its magazines at its next scavenge
+static unsigned int release_gen = 0;
+
+/// Calling thread's magazines, indexed by pool id
+static __thread mm_pool_mag_t **thread_mags = NULL;
+
+/// Flushes a thread's magazines when it exits
+static pthread_key_t pool_key;
+static bool pool_key_created = false;
+
+/// Per thread tag counters. Only the owning thread writes them, mm_get_tag_stats() adds them all up.
+typedef struct {
+	struct list_head list;			// on tag_threads, or tag_spare once the thread exited
+	long bytes[MM_MAX_TAGS];		// chunk bytes allocated minus freed by this thread
+	long count[MM_MAX_TAGS];		// chunks allocated minus freed by this thread
+	unsigned long allocs[MM_MAX_TAGS];	// chunks allocated by this thread
+} tag_counters_t;
+
+/// Calling thread's tag, see mm_set_tag()
+static __thread unsigned int thread_tag = 0;
+
+/// Calling thread's counters, NULL until it allocates or frees tagged memory
+static __thread tag_counters_t *thread_tag_counters = NULL;
+
+/// Protects tag_threads, tag_spare and folding into tag_exited
+static pthread_mutex_t tags_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Counters of live threads, and spare ones left behind by threads that exited
+static LIST_HEAD(tag_threads);
+static LIST_HEAD(tag_spare);
+
+/// Counters of threads that exited, and of updates made while a thread had no counters (updated atomically)
+static tag_counters_t tag_exited;
+
+/// Hands an exiting thread's counters back
+static pthread_key_t tag_key;
+static pthread_once_t tag_key_once = PTHREAD_ONCE_INIT;
+
+/// mm_set_tag_limit() caps, 0 if uncapped. tag_charged counts a capped tag's bytes from when the cap was set.
+static size_t tag_limit[MM_MAX_TAGS];
+static long tag_charged[MM_MAX_TAGS];
+static size_t tag_failed[MM_MAX_TAGS];
+
+/// "mmheap01", at the start of every shared heap. mm_heap_attach() refuses a mapping without it.
+#define SHEAP_MAGIC 0x3130706165686d6dULL
+
+/// Alignment of shared heap chunks and of the memory they hand out
+#define SHEAP_ALIGN 16
+
+/// Free chunks smaller than this are binned by exact size, larger ones by power of 2
+#define SHEAP_SMALL_LIMIT 1024
+
+/// Size classes of shared heap free chunks
+#define SHEAP_NBINS 128
+
+/// Set in a shared heap chunk's size while it is allocated
+#define SHEAP_INUSE 1
+
+/// Chunk of a shared heap. The same boundary tags as malloc_chunk_t, but the free list links are offsets
+/// from the start of the mapping, so every process can map the heap at a different address.
+typedef struct {
+	uint64_t prev_size;				// size of the previous chunk, 0 for the first one
+	uint64_t size;					// size of the chunk, header included, | SHEAP_INUSE while allocated
+	uint64_t next;					// offset of the next free chunk in the bin, 0 at the end (free chunks only)
+	uint64_t prev;					// offset of the previous one, 0 at the head (free chunks only)
+} sheap_chunk_t;
+
+/// Header bytes of a shared heap chunk. The links of a free chunk live in the memory it hands out.
+#define SHEAP_HDR offsetof(sheap_chunk_t, next)
+
+/// Smallest shared heap chunk, room for the header and the links
+#define SHEAP_MIN_CHUNK sizeof(sheap_chunk_t)
+
+/// Start of a shared heap mapping. Nothing in it is a pointer.
+typedef struct {
+	uint64_t magic;
+	uint64_t size;					// bytes of the mapping
+	uint64_t base;					// address the heap was first mapped at, reused when free
+	uint64_t clean;					// set by the last process to detach, cleared on attach
+	uint64_t checksum;				// sheap_checksum() when the last process detached
+	pthread_mutex_t lock;			// process shared and robust, protects everything below
+	uint64_t root;					// offset of the application's root object, 0 if none
+	uint64_t first;					// offset of the first chunk
+	uint64_t top;					// offset of the top chunk, always the last one and never binned
+	uint64_t allocated_bytes;		// bytes of chunks handed out, headers included
+	uint64_t binmap[SHEAP_NBINS / 64];	// bit set for every bin that isn't empty
+	uint64_t bins[SHEAP_NBINS];		// offset of the first free chunk of each size class, 0 if empty
+} sheap_hdr_t;
+
+/// Chunk at @off in the shared heap at @hdr, and the other way round
+#define SHEAP_AT(hdr, off) ((sheap_chunk_t *) ((char *) (hdr) + (off)))
+#define SHEAP_OFF(hdr, chunk) ((uint64_t) ((char *) (chunk) - (char *) (hdr)))
+
+/// Size of a shared heap chunk without the in use bit
+#define SHEAP_SIZE(chunk) ((chunk)->size & ~(uint64_t) SHEAP_INUSE)
+
+/// What a process knows about a shared heap it attached
+struct mm_heap {
+	sheap_hdr_t *hdr;				// where this process mapped it
+	size_t size;
+	int fd;							// own open file description of the heap file, flock()ed shared while attached
+};
+
+/// Byte of a shared heap file whose OFD lock gates attaching and detaching, see sheap_gate()
+#define SHEAP_GATE_BYTE 0
 
 /// Internal functions
-static void resize_chunk(malloc_chunk_t *target_chunk, size_t size);
-static void *use_free_chunk(malloc_chunk_t *target_chunk, size_t size);
-static void *sys_malloc(size_t size);
-static malloc_chunk_t *get_worst_fit_chunk(size_t size);
-static void merge_adjacent(malloc_chunk_t *target_chunk);
-static void shrink_brk(void);
+static int set_param(int param, size_t value);
+static void parse_conf(const char *conf);
+static void malloc_init(void);
+static void *mmap_chunk(size_t size);
+static void munmap_chunk(malloc_chunk_t *chunk);
+static void *mremap_chunk(malloc_chunk_t *chunk, size_t size);
+static void copy_large(void *dst, const void *src, size_t n);
+static void clear_large(void *dst, size_t n);
+#ifdef MALLOC_GUARD
+static void *guard_chunk(size_t size);
+static void guard_free(malloc_chunk_t *chunk);
+#endif
+static void *arena_morecore(malloc_arena_t *arena, intptr_t increment);
+static malloc_arena_t *get_arena(void);
+static malloc_arena_t *chunk_arena(malloc_chunk_t *chunk);
+static void resize_chunk(malloc_arena_t *arena, malloc_chunk_t *target_chunk, size_t size);
+static void *use_free_chunk(malloc_arena_t *arena, malloc_chunk_t *target_chunk, size_t size);
+static bool grow_top(malloc_arena_t *arena, size_t size);
+static void *sys_malloc(malloc_arena_t *arena, size_t size);
+static malloc_chunk_t *get_worst_fit_chunk(malloc_arena_t *arena, size_t size);
+static malloc_chunk_t *get_first_fit_chunk(malloc_arena_t *arena, size_t size);
+static malloc_chunk_t *get_best_fit_chunk(malloc_arena_t *arena, size_t size);
+static malloc_chunk_t *get_fit_chunk(malloc_arena_t *arena, size_t size);
+static void merge_adjacent(malloc_arena_t *arena, malloc_chunk_t *target_chunk);
+static void *aligned_malloc(size_t alignment, size_t size);
+static inline void *malloc_sized(size_t size, size_t idx);
+static inline void *malloc_done(void *ret, size_t size, size_t idx);
+static void *malloc_tagged(size_t size, unsigned int tag);
+static void *malloc_failed(size_t size, size_t idx);
+static bool budget_allow(size_t bytes);
+static void budget_relieve(int level);
+static void cgroup_init(void);
+static void tag_count(unsigned int tag, long bytes, long count);
+static inline bool tag_charge(unsigned int tag, long bytes);
+static inline void tag_resize(malloc_chunk_t *chunk, size_t old_size);
+static void tag_release(malloc_chunk_t *chunk);
+static void shrink_brk(malloc_arena_t *arena);
+static size_t trim_heap(malloc_arena_t *arena, size_t keep, size_t threshold);
+static void purge_start(void);
+static void consolidate_quick(malloc_arena_t *arena);
+static void free_chunk(malloc_arena_t *arena, malloc_chunk_t *target_chunk);
+static void quarantine_chunk(malloc_arena_t *arena, malloc_chunk_t *target_chunk);
+static void unlink_chunk(malloc_chunk_t *chunk);
+static inline void link_chunk(malloc_arena_t *arena, malloc_chunk_t *chunk);
+#ifdef MALLOC_PERCPU_RSEQ
+static void percpu_init(void);
+static void percpu_drain_bin(percpu_bin_t *bin, unsigned long count);
+static bool percpu_drain_cpu(unsigned int cpu);
+static void percpu_drain(void);
+#endif
+static inline void arena_lock(malloc_arena_t *arena);
+#ifdef MALLOC_HARDENED
+static inline unsigned int chunk_cksum(const malloc_chunk_t *chunk);
+#endif
+#if defined(MALLOC_HARDENED) || defined(MALLOC_PAGEMAP)
+static void malloc_corruption(const char *func, const char *what, void *ptr);
+#endif
+#ifdef MALLOC_PAGEMAP
+static bool pagemap_set(void *start, size_t len, malloc_span_t *span);
+static inline malloc_span_t *pagemap_span(const void *ptr);
+#endif
 
 #ifdef MALLOC_DEBUG
 /**
- * print_free_list - Prints out "chunk <size>\n" for each chunk in the free list. Used for debugging only.
+ * print_arena_free_list - Prints out "chunk <size>\n" for each chunk in @arena's free list.
  */
-void print_free_list(void){
+static void print_arena_free_list(malloc_arena_t *arena){
 	malloc_chunk_t *cur_chunk;
+	int i;
 	printf("FREE LIST\n");
-	printf("addr of free_list: %lu\n", &free_list);
+	printf("addr of free_list: %lu\n", &arena->free_list);
 	printf("sizeof(malloc_chunk_t) = %lu\n", sizeof(malloc_chunk_t));
 	int list_len = 0;
-	list_for_each_entry(cur_chunk, &free_list, free_list){
+	list_for_each_entry(cur_chunk, &arena->free_list, free_list){
 		printf("chunk: size = %ld, prev_size: %ld, used: %d, self: %ld next: %ld, prev: %ld\n", (long int) cur_chunk->size, cur_chunk->prev_size, cur_chunk->used, cur_chunk, cur_chunk->free_list.next, cur_chunk->free_list.prev);
 		list_len++;
 	}
 	printf("list_len: %d\n", list_len);
+
+	printf("QUICK LISTS (%lu bytes)\n", arena->quick_bytes);
+	for(i = 0; i < NQUICK_BINS; i++){
+		list_len = 0;
+		for(cur_chunk = arena->quick_bins[i]; cur_chunk != NULL; cur_chunk = QUICK_NEXT(cur_chunk)){
+			list_len++;
+		}
+		if(list_len > 0){
+			printf("usable: %lu, count: %d\n", (unsigned long) i << mparams.align_shift, list_len);
+		}
+	}
 }
+
 /**
- * print_heap_chunks
+ * print_arena_heap_chunks - Walks @arena's heap from head to tail printing every chunk.
  *
  */
-void print_heap_chunks(void){
+static void print_arena_heap_chunks(malloc_arena_t *arena){
 	malloc_chunk_t *cur_chunk;
 
-	if(!heap_head){
+	if(!arena->heap_head){
 		printf("NO HEAP YET!\n");
 		return;
 	}
 	
 	printf("HEAP CHUNKS\n");
-	printf("addr of free_list: %lu\n", &free_list);
-	cur_chunk = heap_head;
+	printf("addr of free_list: %lu\n", &arena->free_list);
+	cur_chunk = arena->heap_head;
 	size_t prev_size = 0;
 
-	while(cur_chunk != heap_tail){
+	while(cur_chunk != arena->heap_tail){
 		if(prev_size != cur_chunk->prev_size){
 			printf("PREV_SIZE INCORRECT!!!\n");
 			exit(1);
@@ -114,373 +857,4721 @@ void print_heap_chunks(void){
 	printf("chunk: size = %ld, prev_size: %ld, used: %d, self: %ld next: %ld, prev: %ld\n", (long int) cur_chunk->size, cur_chunk->prev_size, cur_chunk->used, cur_chunk, cur_chunk->free_list.next, cur_chunk->free_list.prev);
 
 }
-#endif
 
 /**
- * resize_chunk - shrink @target_chunk to minimal size to fullfill @size memory request
- *                and create new free chunk in the remaining space and add it to free list.
- * @target_chunk - chunk to split
- * @size - memory request to fullfill (target_chunk's new size will be CALC_CHUNK_SIZE(size))
+ * print_free_list - Prints the free list of every arena. Used for debugging only.
  */
-static void resize_chunk(malloc_chunk_t *target_chunk, size_t size){
-		size_t new_free_chunk_size;
-		malloc_chunk_t *after_new_free_chunk;
-		malloc_chunk_t *new_free_chunk;
-
-		new_free_chunk_size = target_chunk->size - CALC_CHUNK_SIZE(size);
-		target_chunk->size = CALC_CHUNK_SIZE(size);
-		new_free_chunk = (malloc_chunk_t *) (((char *)target_chunk) + target_chunk->size);
-
-		if(target_chunk == heap_tail){
-			heap_tail = new_free_chunk;
-		}
-		
-		new_free_chunk->prev_size = target_chunk->size;
-		new_free_chunk->size = new_free_chunk_size;
-		new_free_chunk->used = false;   
-		list_add(&(new_free_chunk->free_list), &free_list);	
-		
-		if(new_free_chunk != heap_tail){
-			after_new_free_chunk = (malloc_chunk_t *)((char *)new_free_chunk + new_free_chunk->size);
-			after_new_free_chunk->prev_size = new_free_chunk->size;
-		}
-		return;
+void print_free_list(void){
+	print_arena_free_list(&main_arena);
+#ifdef MALLOC_NUMA
+	int i;
+	for(i = 0; i < numa_nodes; i++){
+		printf("NODE %d ", i);
+		print_arena_free_list(&numa_arenas[i]);
+	}
+#endif
 }
 
 /**
- * use_free_chunk - Given a free_chunk of adequate size, fullfill the size request with that chunk.
- * 					Split the chunk and put the unused portion back in the free_list if possible.
- * @free_chunk: adequate sized free chunk from free list
- * @size: size of request
+ * print_heap_chunks - Prints the chunks of every arena. Used for debugging only.
  */
-static void *use_free_chunk(malloc_chunk_t *target_chunk, size_t size){
-	size_t new_free_chunk_size;
-	malloc_chunk_t *new_free_chunk;
-
-	if(target_chunk == NULL){
-		return NULL;
+void print_heap_chunks(void){
+	print_arena_heap_chunks(&main_arena);
+#ifdef MALLOC_NUMA
+	int i;
+	for(i = 0; i < numa_nodes; i++){
+		printf("NODE %d ", i);
+		print_arena_heap_chunks(&numa_arenas[i]);
 	}
+#endif
+}
 
-	if(target_chunk->size < (CALC_CHUNK_SIZE(size))){
-		return NULL;
-	}
+/// Report a broken invariant from check_arena()
+#define CHECK_FAIL(...) do { \
+	fprintf(stderr, "mm_check_heap: " __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	return -1; \
+} while(0)
 
-	new_free_chunk_size = target_chunk->size - CALC_CHUNK_SIZE(size);
+/**
+ * check_arena - Verify the invariants of @arena's heap. Called with the arena locked.
+ *               Returns 0 if they hold, otherwise reports the first broken one on stderr and returns -1.
+ */
+static int check_arena(malloc_arena_t *arena){
+	malloc_chunk_t *cur_chunk;
+	malloc_chunk_t *prev_chunk = NULL;
+	struct list_head *pos;
+	size_t prev_size = 0;
+	size_t heap_bytes = 0;
+	size_t allocated_bytes = 0;
+	size_t quick_bytes = 0;
+	size_t quarantine_bytes = 0;
+	size_t nfree = 0;
+	size_t nquick = 0;
+	size_t nlisted = 0;
+	char *heap_end = arena_morecore(arena, 0);
+	int i;
 
-	// If chunk is big enough split it and add unused portion back to free_list
-	if(new_free_chunk_size >= MIN_CHUNK_SIZE){
-		resize_chunk(target_chunk, size);
+	if(arena->heap_head == NULL || arena->heap_tail == NULL){
+		if(arena->heap_head != arena->heap_tail){
+			CHECK_FAIL("heap_head %p but heap_tail %p", arena->heap_head, arena->heap_tail);
+		}
+		if(!list_empty(&arena->free_list) || arena->quick_bytes != 0){
+			CHECK_FAIL("free or quick chunks without a heap");
+		}
+		return 0;
 	}
 
-	target_chunk->used = true;
-	return chunk2mem(target_chunk);
-}
+	// Walk the heap by size, checking each chunk against its neighbour
+	for(cur_chunk = arena->heap_head; ; cur_chunk = (malloc_chunk_t *) ((char *) cur_chunk + cur_chunk->size)){
+		if(cur_chunk->prev_size != prev_size){
+			CHECK_FAIL("chunk %p prev_size %lu, previous chunk has size %lu", cur_chunk, cur_chunk->prev_size, prev_size);
+		}
+		if(cur_chunk->size < MIN_CHUNK_SIZE || cur_chunk->size % BYTE_ALIGNMENT){
+			CHECK_FAIL("chunk %p has bad size %lu", cur_chunk, cur_chunk->size);
+		}
+		if(((uintptr_t) chunk2mem(cur_chunk)) % BYTE_ALIGNMENT){
+			CHECK_FAIL("chunk %p memory is not aligned", cur_chunk);
+		}
+		if((char *) cur_chunk + cur_chunk->size > heap_end || (arena->seg_base != NULL && (char *) cur_chunk < arena->seg_base)){
+			CHECK_FAIL("chunk %p is outside its arena", cur_chunk);
+		}
+#ifdef MALLOC_HARDENED
+		if(cur_chunk->cksum != chunk_cksum(cur_chunk)){
+			CHECK_FAIL("chunk %p has a bad checksum", cur_chunk);
+		}
+#endif
+		heap_bytes += cur_chunk->size;
+#ifdef MALLOC_PAGEMAP
+		if(pagemap_span(cur_chunk) == NULL || pagemap_span(cur_chunk)->arena != arena){
+			CHECK_FAIL("chunk %p is not registered to its arena in the page map", cur_chunk);
+		}
+		if(CHUNK_IS_FREE(cur_chunk) != !cur_chunk->used){
+			CHECK_FAIL("chunk %p is marked %d but %s in the free map", cur_chunk, cur_chunk->used, CHUNK_IS_FREE(cur_chunk) ? "free" : "in use");
+		}
+#endif
 
-/**
- * sys_malloc - Increase the heap size and create a new chunk to fullfill the request
- * @size: size of requested memmory in bytes
- */
-static void *sys_malloc(size_t size){
-	size_t new_chunk_size;
-	malloc_chunk_t *new_chunk_ptr;
-	size_t brk_increase;
+		switch(cur_chunk->used){
+			case false:
+				nfree++;
+				if(prev_chunk != NULL && !prev_chunk->used){
+					CHECK_FAIL("free chunks %p and %p are adjacent", prev_chunk, cur_chunk);
+				}
+				break;
+			case true:
+			case CHUNK_PERCPU:
+				allocated_bytes += cur_chunk->size;
+				break;
+			case CHUNK_QUICK:
+				nquick++;
+				quick_bytes += cur_chunk->size;
+				break;
+			case CHUNK_QUARANTINED:
+				quarantine_bytes += cur_chunk->size;
+				break;
+			case CHUNK_TOP:
+				if(cur_chunk != arena->heap_tail){
+					CHECK_FAIL("chunk %p is marked top but heap_tail is %p", cur_chunk, arena->heap_tail);
+				}
+				if(prev_chunk != NULL && !prev_chunk->used){
+					CHECK_FAIL("free chunk %p was not folded into the top chunk", prev_chunk);
+				}
+				break;
+			default:
+				CHECK_FAIL("chunk %p has bad used flag %d", cur_chunk, cur_chunk->used);
+		}
 
-	new_chunk_size = CALC_CHUNK_SIZE(size);
+		if(cur_chunk == arena->heap_tail){
+			break;
+		}
+		if(cur_chunk->used == CHUNK_TOP){
+			CHECK_FAIL("heap_tail %p is not the last chunk", arena->heap_tail);
+		}
 
-	if(new_chunk_size <= MIN_BRK_INCREASE){
-		brk_increase = MIN_BRK_INCREASE;
+		prev_size = cur_chunk->size;
+		prev_chunk = cur_chunk;
+	}
+	if(arena->heap_tail->used != CHUNK_TOP){
+		CHECK_FAIL("heap_tail %p is not the top chunk", arena->heap_tail);
 	}
-	else{
-		brk_increase = new_chunk_size;
+	if(arena->seg_base != NULL && (char *) arena->heap_tail + arena->heap_tail->size != arena->seg_top){
+		CHECK_FAIL("top chunk %p does not end at the arena break", arena->heap_tail);
 	}
 
-	// Increase heap size
-	if( (new_chunk_ptr = (malloc_chunk_t *) sbrk(brk_increase)) == (void *) -1){
-		return NULL;
+	// Every chunk on the free list is free and every free chunk is on it
+	for(pos = arena->free_list.next; pos != &arena->free_list; pos = pos->next){
+		if(pos->next->prev != pos){
+			CHECK_FAIL("free list is broken after %p", list_entry(pos, malloc_chunk_t, free_list));
+		}
+		cur_chunk = list_entry(pos, malloc_chunk_t, free_list);
+		if(cur_chunk->used != false){
+			CHECK_FAIL("chunk %p is on the free list but marked %d", cur_chunk, cur_chunk->used);
+		}
+		if(++nlisted > nfree){
+			break;
+		}
+	}
+	if(nlisted != nfree){
+		CHECK_FAIL("%lu free chunks in the heap but %lu on the free list", nfree, nlisted);
 	}
 
-	// Setup chunk metadata 
-	new_chunk_ptr->size = brk_increase;
-	new_chunk_ptr->used = false;
-	
-	// First call to malloc(), set heap_head and heap_tail for later calls
-	if(heap_head == NULL){
-		heap_head = new_chunk_ptr;
-		new_chunk_ptr->prev_size = 0;
-		heap_tail = new_chunk_ptr;
+	for(i = 0; i < NQUICK_BINS; i++){
+		for(cur_chunk = arena->quick_bins[i]; cur_chunk != NULL; cur_chunk = QUICK_NEXT(cur_chunk)){
+			if(cur_chunk->used != CHUNK_QUICK || QUICK_INDEX(CHUNK_USABLE(cur_chunk)) != (size_t) i){
+				CHECK_FAIL("chunk %p does not belong on quick list %d", cur_chunk, i);
+			}
+			if(nquick-- == 0){
+				CHECK_FAIL("more chunks on the quick lists than marked quick");
+			}
+		}
 	}
-	else {
-		new_chunk_ptr->prev_size = heap_tail->size;
-		heap_tail = new_chunk_ptr;
+	if(nquick != 0){
+		CHECK_FAIL("%lu quick chunks are not on a quick list", nquick);
+	}
+
+	if(quarantine_bytes != arena->quarantine_bytes){
+		CHECK_FAIL("quarantine counter %lu doesn't match the %lu bytes marked quarantined", arena->quarantine_bytes, quarantine_bytes);
+	}
+	for(cur_chunk = arena->quarantine_head; cur_chunk != NULL; cur_chunk = QUICK_NEXT(cur_chunk)){
+		if(cur_chunk->used != CHUNK_QUARANTINED){
+			CHECK_FAIL("chunk %p is in quarantine but marked %d", cur_chunk, cur_chunk->used);
+		}
+		if(cur_chunk->size > quarantine_bytes){
+			CHECK_FAIL("more chunks in quarantine than marked quarantined");
+		}
+		quarantine_bytes -= cur_chunk->size;
+		if(QUICK_NEXT(cur_chunk) == NULL && cur_chunk != arena->quarantine_tail){
+			CHECK_FAIL("quarantine ends at %p but its tail is %p", cur_chunk, arena->quarantine_tail);
+		}
+	}
+	if(quarantine_bytes != 0){
+		CHECK_FAIL("%lu bytes are marked quarantined but not in quarantine", quarantine_bytes);
+	}
+
+	if(quick_bytes != arena->quick_bytes || allocated_bytes != arena->allocated_bytes || heap_bytes != arena->heap_bytes){
+		CHECK_FAIL("counters (heap %lu, allocated %lu, quick %lu) don't match the heap (%lu, %lu, %lu)",
+		           arena->heap_bytes, arena->allocated_bytes, arena->quick_bytes, heap_bytes, allocated_bytes, quick_bytes);
 	}
 
-	return (void *) use_free_chunk(new_chunk_ptr, size);
+	return 0;
 }
 
 /**
- * get_worst_fit_chunk - Find the largest chunk that is at least large enough to fullfill @size request.
- * 						 If no chunk is found, return NULL.
- * @size: size of memmory request
+ * mm_check_heap - Verify the invariants of every arena: prev_size links, no adjacent free chunks,
+ *                 free and quick list membership matching the used flags, heap_tail being the top
+ *                 chunk and the arena counters. Returns 0 if the heap is consistent, otherwise reports
+ *                 the first problem on stderr and returns -1. Used for debugging only.
  */
-static malloc_chunk_t *get_worst_fit_chunk(size_t size){
-	size_t min_chunk_size = CALC_CHUNK_SIZE(size);
-	size_t worst_fit_size = 0;
-	malloc_chunk_t *worst_fit_chunk = NULL;
-	malloc_chunk_t *cur_chunk;
-	
-	// Find largest chunk that can service request, if it exists
-	list_for_each_entry(cur_chunk, &free_list, free_list){
-		if(cur_chunk->size >= min_chunk_size && cur_chunk->size > worst_fit_size){
-			worst_fit_size = cur_chunk->size;
-			worst_fit_chunk = cur_chunk;
-		}
+int mm_check_heap(void){
+	int ret;
+
+	pthread_mutex_lock(&main_arena.lock);
+	ret = check_arena(&main_arena);
+	pthread_mutex_unlock(&main_arena.lock);
+
+#ifdef MALLOC_NUMA
+	int i;
+	for(i = 0; i < numa_nodes && ret == 0; i++){
+		pthread_mutex_lock(&numa_arenas[i].lock);
+		ret = check_arena(&numa_arenas[i]);
+		pthread_mutex_unlock(&numa_arenas[i].lock);
 	}
-	
-	// If we found a suitable chunk, remove from free_list and return it
-	if(worst_fit_chunk != NULL){
-		__list_del_entry(&(worst_fit_chunk->free_list));
-		worst_fit_chunk->used = true;
+#endif
+
+	return ret;
+}
+#endif
+
+#ifdef MALLOC_NUMA
+/**
+ * read_sysfs - Read a small sysfs file into @buf without going through stdio (which would malloc()).
+ * Returns the number of bytes read or -1.
+ */
+static ssize_t read_sysfs(const char *path, char *buf, size_t len){
+	int fd;
+	ssize_t n;
+
+	if( (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0){
+		return -1;
+	}
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if(n >= 0){
+		buf[n] = '\0';
 	}
+	return n;
+}
 
-	return worst_fit_chunk;
+/**
+ * parse_cpulist - Call @fn for every id in a sysfs list such as "0-3,8,10-11", if @fn isn't NULL.
+ *                 Returns the highest id plus one, 0 for an empty list.
+ */
+static long parse_cpulist(const char *list, void (*fn)(long id, long arg), long arg){
+	const char *p = list;
+	char *end;
+	long lo, hi, count = 0;
+
+	while(*p >= '0' && *p <= '9'){
+		lo = hi = strtol(p, &end, 10);
+		p = end;
+		if(*p == '-'){
+			hi = strtol(p + 1, &end, 10);
+			p = end;
+		}
+		if(hi + 1 > count){
+			count = hi + 1;
+		}
+		for(; fn != NULL && lo <= hi; lo++){
+			fn(lo, arg);
+		}
+		if(*p == ','){
+			p++;
+		}
+	}
+	return count;
+}
+
+static void numa_map_cpu(long cpu, long node){
+	if(cpu < MAX_NUMA_CPUS){
+		numa_cpu_node[cpu] = node;
+	}
 }
 
 /**
- * merge_adjacent - Merge current free()'ed chunk with adjacent free chunks if any.
- * @target_chunk: free()'ed chunk with which to attempt merger
+ * numa_init - Discover the topology and reserve one arena per node. Runs once per process.
+ *             The numa_fake_nodes option pretends the machine has n nodes so the arena
+ *             routing can be exercised on a single node box.
  */
-static void merge_adjacent(malloc_chunk_t *target_chunk){
-	malloc_chunk_t *prev_chunk;
-	malloc_chunk_t *next_chunk;
-	malloc_chunk_t *next_next_chunk;
+static void numa_init(void){
+	char path[64];
+	char buf[512];
+	unsigned long nodemask;
+	int i;
 
-	if(target_chunk == NULL){
-		return;
+	if(mparams.numa_fake_nodes > 0){
+		numa_nodes = mparams.numa_fake_nodes;
+		numa_fake = true;
+	}
+	else if(read_sysfs("/sys/devices/system/node/possible", buf, sizeof(buf)) > 0){
+		numa_nodes = parse_cpulist(buf, NULL, 0);
 	}
 
-	// Target is the only free chunk - nothing to do
-	if( (target_chunk == heap_head) && (target_chunk == heap_tail)){
+	if(numa_nodes > MAX_NUMA_NODES){
+		numa_nodes = MAX_NUMA_NODES;
+	}
+	if(numa_nodes < 2){
+		numa_nodes = 0;
 		return;
 	}
-	
-	// Chunk is not at the end of heap space, so there is def. a chunk following it
-	if(target_chunk != heap_tail){
-		next_chunk = (malloc_chunk_t *)((char *)target_chunk + target_chunk->size);
-		
-		// If next chunk is free merge with target
-		if(!next_chunk->used){
-			__list_del_entry(&(next_chunk->free_list));
-			target_chunk->size += next_chunk->size;
-			if(next_chunk == heap_tail){
-				heap_tail = target_chunk;
-			}
-			else{
-				next_next_chunk = (malloc_chunk_t *)((char *)target_chunk + target_chunk->size);
-				next_next_chunk->prev_size = target_chunk->size;
+
+	if(!numa_fake){
+		for(i = 0; i < numa_nodes; i++){
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+			if(read_sysfs(path, buf, sizeof(buf)) > 0){
+				parse_cpulist(buf, numa_map_cpu, i);
 			}
 		}
 	}
-	// Chunk is not at the beginning of heap space, so there is def. a chunk preceeding it
-	if(target_chunk != heap_head){
-		prev_chunk = (malloc_chunk_t *)(((char *)target_chunk) - target_chunk->prev_size);
-		if(!prev_chunk->used){
-			__list_del_entry(&(target_chunk->free_list));
-			prev_chunk->size += target_chunk->size;
-			if(target_chunk == heap_tail){
-				heap_tail = prev_chunk;
-			}
-			else {
-				next_next_chunk = (malloc_chunk_t *)(((char *)prev_chunk) + prev_chunk->size);
-				next_next_chunk->prev_size = prev_chunk->size;
-			}
-		}
+
+	numa_base = mmap(NULL, NUMA_ARENA_RESERVE * numa_nodes, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(numa_base == MAP_FAILED){
+		numa_base = NULL;
+		numa_nodes = 0;
+		return;
 	}
 
-	return;
+	for(i = 0; i < numa_nodes; i++){
+		pthread_mutex_init(&numa_arenas[i].lock, NULL);
+		INIT_LIST_HEAD(&numa_arenas[i].free_list);
+		numa_arenas[i].seg_base = numa_base + NUMA_ARENA_RESERVE * i;
+		numa_arenas[i].seg_top = numa_arenas[i].seg_base;
+		numa_arenas[i].seg_end = numa_arenas[i].seg_base + NUMA_ARENA_RESERVE;
+#ifdef MALLOC_PAGEMAP
+		numa_spans[i].kind = true;
+		numa_spans[i].arena = &numa_arenas[i];
+#endif
+
+		// Pages are placed on first touch, so binding the whole reservation up front is enough
+		if(!numa_fake && i < (int) (sizeof(nodemask) * 8)){
+			nodemask = 1UL << i;
+			syscall(SYS_mbind, numa_arenas[i].seg_base, NUMA_ARENA_RESERVE, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+		}
+	}
 }
 
-/*
- * shrink_brk - Merge contiguous tail free chunks and if the resulting chunk is > MIN_BRK_DECREASE,
- *				delete the large free chunk and shrink the heap.
+/**
+ * numa_current_node - Node of the cpu the calling thread is running on.
  */
-static void shrink_brk(void){
-	malloc_chunk_t *prev_chunk = (malloc_chunk_t *) ((char *)heap_tail - heap_tail->prev_size);
-	size_t shrink_counter = 0;
+static int numa_current_node(void){
+	static int fake_next_node = 0;
+	int cpu;
 
-	if(heap_tail->used){
-		return;
-	}
-	
-	shrink_counter += heap_tail->size;
-
-	while(!prev_chunk->used){
-		shrink_counter += prev_chunk->size;
-		__list_del_entry(&(heap_tail->free_list));
-		prev_chunk->size += heap_tail->size;
-		heap_tail = prev_chunk;
-		if(heap_tail->prev_size == 0){
-			break;
+	if(numa_fake){
+		// A single node box has nowhere to migrate to, so spread threads round robin instead
+		if(numa_thread_node < 0){
+			numa_thread_node = __sync_fetch_and_add(&fake_next_node, 1) % numa_nodes;
 		}
-		prev_chunk = (malloc_chunk_t *) (((char *) heap_tail) - heap_tail->prev_size);
+		return numa_thread_node;
 	}
-	
-	if(shrink_counter >= MIN_BRK_DECREASE){
-		__list_del_entry(&(heap_tail->free_list));
-		
-		if(heap_tail == heap_head){
-			heap_tail = NULL;
-			heap_head = NULL;
+
+	cpu = sched_getcpu();
+	if(cpu < 0 || cpu >= MAX_NUMA_CPUS){
+		return 0;
+	}
+	return numa_cpu_node[cpu];
+}
+#endif
+
+/**
+ * set_param - Apply one tunable. Shared by mallopt() and the MYMALLOC_CONF parser.
+ *             Returns 1 on success and 0 if @param is unknown or @value is out of range.
+ * @param: M_* parameter from malloc.h (or a private CONF_* id)
+ * @value: new value
+ */
+static int set_param(int param, size_t value){
+	switch(param){
+		case M_ALIGNMENT:
+			// mem2chunk() depends on the alignment, so it can't change under existing chunks
+			if(value < sizeof(void *) || (value & (value - 1)) || value > mparams.page_size || mparams.layout_frozen){
+				return 0;
+			}
+			mparams.byte_alignment = value;
+			mparams.pad_size = value - (sizeof(malloc_chunk_t) % value);
+			mparams.align_shift = __builtin_ctzl(value);
+			if(QUICK_INDEX(mparams.quick_max) >= NQUICK_BINS){
+				mparams.quick_max = (NQUICK_BINS - 1) << mparams.align_shift;
+			}
+			return 1;
+		case M_MIN_SIZE:
+			if(value == 0 || value > MAX_REQUEST_SIZE){
+				return 0;
+			}
+			mparams.min_mal_size = value;
+			return 1;
+		case M_TOP_PAD:
+			mparams.min_brk_increase = value;
+			return 1;
+		case M_TRIM_THRESHOLD:
+			mparams.min_brk_decrease = value;
+			return 1;
+		case M_MMAP_THRESHOLD:
+			mparams.mmap_threshold = (value == 0) ? SIZE_MAX : value;
+			return 1;
+		case M_MXFAST:
+			if(QUICK_INDEX(value) >= NQUICK_BINS){
+				return 0;
+			}
+			mparams.quick_max = value;
+			return 1;
+		case M_QUICK_BUDGET:
+			mparams.quick_budget = value;
+			return 1;
+		case M_STREAM_THRESHOLD:
+			mparams.stream_threshold = (value == 0) ? SIZE_MAX : value;
+			return 1;
+		case M_PLACEMENT:
+			if(value > M_PLACEMENT_BEST_FIT){
+				return 0;
+			}
+			mparams.placement = value;
+			return 1;
+		case CONF_NUMA_FAKE_NODES:
+			mparams.numa_fake_nodes = value;
+			return 1;
+		case M_QUARANTINE:
+			mparams.quarantine_max = value;
+			return 1;
+		case M_GUARD_SAMPLE:
+#ifdef MALLOC_GUARD
+			if(value > UINT_MAX){
+				return 0;
+			}
+			mparams.guard_sample = value;
+			return 1;
+#else
+			return value == 0;
+#endif
+		case M_PURGE_DECAY:
+			if(value > UINT_MAX){
+				return 0;
+			}
+			// Ordered before purge_start() reads purge_running, see purge_thread()
+			__atomic_store_n(&mparams.purge_decay, value, __ATOMIC_SEQ_CST);
+			// Too early while MYMALLOC_CONF is parsed, purge_autostart() takes care of that case
+			if(value != 0 && mparams.initialized){
+				purge_start();
+			}
+			return 1;
+		case CONF_PERCPU:
+			// The caches are set up once in malloc_init()
+			if(value > PERCPU_MAX || mparams.initialized){
+				return 0;
+			}
+			mparams.percpu = value;
+			return 1;
+		case CONF_MESH:
+			mparams.mesh = (value != 0);
+			return 1;
+		case CONF_CGROUP:
+			mparams.budget_cgroup = (value != 0);
+			return 1;
+		case M_SOFT_LIMIT:
+			mparams.soft_limit = value;
+			return 1;
+		case M_HARD_LIMIT:
+			mparams.hard_limit = value;
+			return 1;
+		case CONF_PURGE_LAZY:
+#ifdef MADV_FREE
+			mparams.purge_advice = value ? MADV_FREE : MADV_DONTNEED;
+			return 1;
+#else
+			return value == 0;
+#endif
+		default:
+			return 0;
+	}
+}
+
+/**
+ * parse_conf - Parse a MYMALLOC_CONF string of comma separated "key:value" pairs, e.g.
+ *              "alignment:16,mmap_threshold:1m,placement:best". Sizes take k, m and g suffixes.
+ *              Bad entries are reported on stderr and skipped.
+ * @conf: configuration string
+ */
+static void parse_conf(const char *conf){
+	static const struct {
+		const char *name;
+		int param;
+	} keys[] = {
+		{ "alignment", M_ALIGNMENT },
+		{ "min_size", M_MIN_SIZE },
+		{ "brk_increase", M_TOP_PAD },
+		{ "trim_threshold", M_TRIM_THRESHOLD },
+		{ "mmap_threshold", M_MMAP_THRESHOLD },
+		{ "placement", M_PLACEMENT },
+		{ "quick_max", M_MXFAST },
+		{ "quick_budget", M_QUICK_BUDGET },
+		{ "stream_threshold", M_STREAM_THRESHOLD },
+		{ "numa_fake_nodes", CONF_NUMA_FAKE_NODES },
+		{ "guard_sample", M_GUARD_SAMPLE },
+		{ "quarantine", M_QUARANTINE },
+		{ "purge_decay", M_PURGE_DECAY },
+		{ "purge_lazy", CONF_PURGE_LAZY },
+		{ "percpu", CONF_PERCPU },
+		{ "mesh", CONF_MESH },
+		{ "soft_limit", M_SOFT_LIMIT },
+		{ "hard_limit", M_HARD_LIMIT },
+		{ "cgroup", CONF_CGROUP },
+	};
+	static const char *placements[] = { "worst", "first", "best" };
+	const char *key, *val;
+	size_t key_len, val_len, i;
+	unsigned long long value;
+	char *end;
+	int param;
+
+	while(*conf){
+		key = conf;
+		key_len = strcspn(key, ":=,");
+		val = key + key_len + (key[key_len] == ':' || key[key_len] == '=');
+		val_len = strcspn(val, ",");
+		conf = val + val_len + (val[val_len] == ',');
+
+		param = 0;
+		for(i = 0; i < sizeof(keys) / sizeof(keys[0]); i++){
+			if(strlen(keys[i].name) == key_len && !strncmp(keys[i].name, key, key_len)){
+				param = keys[i].param;
+				break;
+			}
 		}
-		else {
-			heap_tail = (malloc_chunk_t *) (((char *)heap_tail) - heap_tail->prev_size);
+
+		value = strtoull(val, &end, 0);
+		if(end == val && param == M_PLACEMENT){
+			for(i = 0; i < sizeof(placements) / sizeof(placements[0]); i++){
+				if(!strncmp(placements[i], val, strlen(placements[i]))){
+					value = i;
+					end = (char *) val + strlen(placements[i]);
+				}
+			}
+		}
+		switch(*end){
+			case 'g': case 'G': value <<= 10; // fall through
+			case 'm': case 'M': value <<= 10; // fall through
+			case 'k': case 'K': value <<= 10; end++;
+		}
+
+		if(param == 0 || end == val || end != val + val_len || !set_param(param, value)){
+			fprintf(stderr, CONF_ENV_VAR ": ignoring invalid option \"%.*s\"\n", (int) (conf - key - (conf[-1] == ',')), key);
 		}
-		
-		sbrk(-1*shrink_counter);
 	}
-	
-	return;
 }
 
 /**
- * malloc - Custom malloc() that implements the "worst fit" algo.
- * @size: size of requested memmory in bytes
- */ 
-void *malloc(size_t size){
-	malloc_chunk_t *worst_fit_chunk;
+ * malloc_init - One time setup: derive constants, read MYMALLOC_CONF and find the NUMA topology.
+ */
+static void malloc_init(void){
+	const char *conf;
 
-	// Check request in bounds
-	if(size < MIN_MAL_SIZE){
-		size = MIN_MAL_SIZE;
+	mparams.page_size = sysconf(_SC_PAGESIZE);
+	mparams.pad_size = mparams.byte_alignment - (sizeof(malloc_chunk_t) % mparams.byte_alignment);
+	mparams.align_shift = __builtin_ctzl(mparams.byte_alignment);
+
+#ifdef MALLOC_HARDENED
+	// The kernel hands every process 16 random bytes, no syscall needed this early
+	{
+		uintptr_t *random_bytes = (uintptr_t *) getauxval(AT_RANDOM);
+
+		malloc_secret = (random_bytes != NULL) ? random_bytes[0] ^ random_bytes[1] : 0;
+		malloc_secret ^= (uintptr_t) &conf ^ (uintptr_t) getpid() << 32;
 	}
-	
-	// Pad size to maintain byte alignment
-	size += (BYTE_ALIGNMENT - (size % BYTE_ALIGNMENT));
+#endif
 
-	// Try to find a free chunk to fullfill request
-	if( (worst_fit_chunk = get_worst_fit_chunk(size)) == NULL){
- 		// No free chunks work, increase brk, return ptr to new mem
- 		void *ret; 
-		pthread_mutex_lock(&master_lock);
-		ret = sys_malloc(size);
-		pthread_mutex_unlock(&master_lock);
-		return ret; 
+	if( (conf = getenv(CONF_ENV_VAR)) != NULL){
+		parse_conf(conf);
 	}
-	else {
- 		// Found a free chunk, use it to fullfill request, split if possible 	
-		void *ret;
-		pthread_mutex_lock(&master_lock);
-		ret = use_free_chunk(worst_fit_chunk, size);
-		pthread_mutex_unlock(&master_lock);
-		return ret;
+	if(mparams.budget_cgroup){
+		cgroup_init();
+	}
+
+#ifdef MALLOC_NUMA
+	numa_init();
+#endif
+#ifdef MALLOC_PERCPU_RSEQ
+	if(mparams.percpu != 0){
+		percpu_init();
 	}
+#endif
+
+	__atomic_store_n(&mparams.initialized, true, __ATOMIC_RELEASE);
 }
 
+/// Run malloc_init() if nobody has yet. Costs a single load once initialized.
+#define ensure_init() do { \
+	if(!__atomic_load_n(&mparams.initialized, __ATOMIC_ACQUIRE)) \
+		pthread_once(&mparams_once, malloc_init); \
+} while(0)
+
 /**
- * free -	Custom free() that works with the above custom malloc().
- *          Double free()s are detected but invalid pointers are not 
- *          and result in undefined (aka very bad) behavior.
- * @ptr: pointer to the memory block that was malloc()'ed.
+ * mallopt - Change a tunable at runtime. Returns 1 on success, 0 on error.
+ *           M_ALIGNMENT can only be changed before the first allocation.
+ * @param: M_* parameter
+ * @value: new value
  */
-void free(void *ptr){
-	malloc_chunk_t *target_chunk;
+int mallopt(int param, int value){
+	ensure_init();
 
-	if(ptr == NULL){
-		return;
+	if(value < 0){
+		return 0;
 	}
-	
-	pthread_mutex_lock(&master_lock);	
-	
-	target_chunk = mem2chunk(ptr);
+	return set_param(param, value);
+}
 
-#ifdef MALLOC_DETECT_DOUBLE_FREE
-	if(!target_chunk->used){
-			fprintf(stderr, "ERROR in free(): double-free detected\n");
-			exit(1);
-			return;
+#ifdef MALLOC_HARDENED
+/**
+ * chunk_cksum - Keyed hash of @chunk's address, prev_size and size. An overflow out of the previous
+ *               chunk runs into prev_size first, so it is covered too. The used flag is left out so
+ *               the malloc()/free() fast paths only have to check, not reseal.
+ */
+static inline unsigned int chunk_cksum(const malloc_chunk_t *chunk){
+	uint64_t h = (uintptr_t) chunk ^ malloc_secret ^ ((uint64_t) chunk->prev_size << 32 | (uint64_t) chunk->prev_size >> 32);
+
+	h = (h + chunk->size) * 0x9e3779b97f4a7c15ULL;
+	return (unsigned int) (h >> 32);
+}
+
+#endif
+
+/**
+ * check_heap_chunk - CHECK_CHUNK() of a heap chunk of @arena without holding the arena lock. A neighbour
+ *                    being split or merged meanwhile rewrites prev_size and reseals, so a mismatch is only
+ *                    reported once it is confirmed under the lock.
+ */
+static inline void check_heap_chunk(malloc_arena_t *arena, malloc_chunk_t *chunk, const char *func){
+#ifdef MALLOC_HARDENED
+	if(__builtin_expect(((uintptr_t) chunk & (BYTE_ALIGNMENT - 1)) || chunk->cksum != chunk_cksum(chunk), 0)){
+		arena_lock(arena);
+		CHECK_CHUNK(chunk, func);
+		pthread_mutex_unlock(&arena->lock);
 	}
+#else
+	(void) arena;
+	(void) chunk;
+	(void) func;
+#endif
+}
+
+#if defined(MALLOC_HARDENED) || defined(MALLOC_PAGEMAP)
+/**
+ * malloc_corruption - Report heap corruption found at @ptr and abort. The heap can't be trusted
+ *                     any more, so nothing is unwound.
+ */
+static void malloc_corruption(const char *func, const char *what, void *ptr){
+	fprintf(stderr, "ERROR in %s(): %s at %p\n", func, what, ptr);
+	abort();
+}
 #endif
-	target_chunk->used = false;
-	list_add(&(target_chunk->free_list), &free_list);	
 
-	merge_adjacent(target_chunk);
+#ifdef MALLOC_PROFILE
+/**
+ * read_cycles - Cheapest timestamp available, the TSC on x86.
+ */
+static inline uint64_t read_cycles(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
 
-	shrink_brk();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
-	pthread_mutex_unlock(&master_lock);
+/**
+ * profile_record - Count one pass through slow path @path that took @cycles.
+ */
+static inline void profile_record(int path, uint64_t cycles){
+	int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
 
-	return;
+	__atomic_add_fetch(&profile.count[path][bucket], 1, __ATOMIC_RELAXED);
 }
+#endif
 
-void *calloc(size_t nmemb, size_t size){
-	size_t tot_mem = nmemb * size;
-	void *mem;
-	
-	if(tot_mem < MIN_MAL_SIZE){
-		tot_mem = MIN_MAL_SIZE;
-	}
-	
-	if( (mem = malloc(tot_mem)) != NULL){
-		memset(mem, '\0', tot_mem);
-		return mem; 
+/**
+ * arena_lock - Lock @arena, firing the lock_contended probe (and timing the wait) if another thread holds it.
+ */
+static inline void arena_lock(malloc_arena_t *arena){
+	if(pthread_mutex_trylock(&arena->lock) == 0){
+		return;
 	}
-	else {
+
+	MALLOC_PROBE(lock_contended, arena);
+	PROFILE_START(start);
+	pthread_mutex_lock(&arena->lock);
+	PROFILE_END(MM_PROF_LOCK_WAIT, start);
+}
+
+#ifdef MALLOC_PAGEMAP
+/**
+ * pagemap_node - Map a zeroed page map node of @size bytes and install it at @slot, unless another
+ *                thread got there first. Returns the node now at @slot, NULL if out of memory.
+ */
+static void *pagemap_node(void **slot, size_t size){
+	void *node = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	void *expected = NULL;
+
+	if(node == MAP_FAILED){
 		return NULL;
 	}
+	if(!__atomic_compare_exchange_n(slot, &expected, node, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		munmap(node, size);
+		return expected;
+	}
+	return node;
 }
 
-void *realloc(void *ptr, size_t size){
-	malloc_chunk_t *target_chunk;
-	size_t new_chunk_size;
-	void *mem;
-	
-	if(ptr == NULL){
-		return malloc(size);
-	}
-	
-	if(size == 0){
-		free(ptr);
+/**
+ * pagemap_leaf - Leaf of the page map covering @ptr, NULL if none was mapped yet. Lock free.
+ * @create: map the missing levels instead of returning NULL (which then means out of memory)
+ */
+static inline pagemap_leaf_t *pagemap_leaf(const void *ptr, bool create){
+	uintptr_t page = (uintptr_t) ptr >> PAGEMAP_PAGE_SHIFT;
+	pagemap_leaf_t **mid;
+	pagemap_leaf_t *leaf;
+
+	if((uintptr_t) ptr >> PAGEMAP_BITS){
 		return NULL;
 	}
 
-	if(size < MIN_MAL_SIZE){
-		size = MIN_MAL_SIZE;
+	mid = __atomic_load_n(&pagemap_root[page >> (PAGEMAP_LEAF_BITS + PAGEMAP_MID_BITS)], __ATOMIC_ACQUIRE);
+	if(mid == NULL){
+		if(!create || (mid = pagemap_node((void **) &pagemap_root[page >> (PAGEMAP_LEAF_BITS + PAGEMAP_MID_BITS)],
+		                                  sizeof(*mid) << PAGEMAP_MID_BITS)) == NULL){
+			return NULL;
+		}
 	}
 
-	target_chunk = mem2chunk(ptr);
-	new_chunk_size = CALC_CHUNK_SIZE(size);
-
-	if(target_chunk->size >= (new_chunk_size + MIN_CHUNK_SIZE)){
-		// Shrink chunk and free extra space
-		void *ret;
-		pthread_mutex_lock(&master_lock);
-		resize_chunk(target_chunk, size);
-		ret =  chunk2mem(target_chunk);
-		pthread_mutex_unlock(&master_lock);
-		return ret;
+	leaf = __atomic_load_n(&mid[(page >> PAGEMAP_LEAF_BITS) & ((1 << PAGEMAP_MID_BITS) - 1)], __ATOMIC_ACQUIRE);
+	if(leaf == NULL && create){
+		leaf = pagemap_node((void **) &mid[(page >> PAGEMAP_LEAF_BITS) & ((1 << PAGEMAP_MID_BITS) - 1)], sizeof(*leaf));
 	}
-	else if(target_chunk->size > new_chunk_size && target_chunk->size < (new_chunk_size + MIN_CHUNK_SIZE)){
-		// Enough space in current chunk, do nothing
-		void *ret;
-		pthread_mutex_lock(&master_lock);
-		ret = chunk2mem(target_chunk);
-		pthread_mutex_unlock(&master_lock);
-		return ret;
+	return leaf;
+}
+
+/**
+ * pagemap_span - Span of the page @ptr lies on, NULL if malloc() never handed out memory there.
+ */
+static inline malloc_span_t *pagemap_span(const void *ptr){
+	pagemap_leaf_t *leaf = pagemap_leaf(ptr, false);
+
+	if(leaf == NULL){
+		return NULL;
 	}
-	else {
-		// Need a new larger chunk
-		void *new_mem = malloc(size);
-	
-		if(new_mem == NULL){
-			return NULL;
-		}
-			
-		pthread_mutex_lock(&master_lock);
-		memcpy(new_mem, ptr, target_chunk->size - sizeof(malloc_chunk_t) - PAD_SIZE);
-		pthread_mutex_unlock(&master_lock);
+	return __atomic_load_n(&leaf->spans[((uintptr_t) ptr >> PAGEMAP_PAGE_SHIFT) & ((1 << PAGEMAP_LEAF_BITS) - 1)], __ATOMIC_RELAXED);
+}
 
-		free(ptr);
+/**
+ * pagemap_set - Point every page overlapping [@start, @start + @len) at @span, or forget them if @span is NULL.
+ *               Returns false if a level of the map couldn't be mapped.
+ */
+static bool pagemap_set(void *start, size_t len, malloc_span_t *span){
+	uintptr_t addr = (uintptr_t) start & ~(((uintptr_t) 1 << PAGEMAP_PAGE_SHIFT) - 1);
+	uintptr_t end = (uintptr_t) start + len;
+	pagemap_leaf_t *leaf = NULL;
 
-		return new_mem;
+	for(; addr < end; addr += (uintptr_t) 1 << PAGEMAP_PAGE_SHIFT){
+		if(leaf == NULL || (addr & (PAGEMAP_LEAF_SPAN - 1)) == 0){
+			if( (leaf = pagemap_leaf((void *) addr, span != NULL)) == NULL){
+				if(span != NULL){
+					return false;
+				}
+				// Nothing was ever registered in this leaf
+				addr = (addr | (PAGEMAP_LEAF_SPAN - 1)) + 1 - ((uintptr_t) 1 << PAGEMAP_PAGE_SHIFT);
+				continue;
+			}
+		}
+		__atomic_store_n(&leaf->spans[(addr >> PAGEMAP_PAGE_SHIFT) & ((1 << PAGEMAP_LEAF_BITS) - 1)], span, __ATOMIC_RELAXED);
 	}
+	return true;
 }
 
+/**
+ * arena_span - Span describing the heap pages of @arena.
+ */
+static inline malloc_span_t *arena_span(malloc_arena_t *arena){
+#ifdef MALLOC_NUMA
+	if(arena != &main_arena){
+		return &numa_spans[arena - numa_arenas];
+	}
+#endif
+	return &main_span;
+}
+#endif
+
+/**
+ * unlink_chunk - Take @chunk off its arena's free list. Hardened builds first check that its
+ *                neighbours still point back at it, so a forged link can't redirect the writes.
+ */
+static void unlink_chunk(malloc_chunk_t *chunk){
+#ifdef MALLOC_HARDENED
+	if(chunk->free_list.next->prev != &chunk->free_list || chunk->free_list.prev->next != &chunk->free_list){
+		malloc_corruption("free", "corrupted free list", chunk);
+	}
+#endif
+	__list_del_entry(&(chunk->free_list));
+	CLEAR_CHUNK_FREE(chunk);
+}
+
+/**
+ * link_chunk - Put @chunk on @arena's free list, stamped with the current purge epoch.
+ */
+static inline void link_chunk(malloc_arena_t *arena, malloc_chunk_t *chunk){
+	FREE_STAMP(chunk) = __atomic_load_n(&purge_epoch, __ATOMIC_RELAXED);
+	list_add(&(chunk->free_list), &arena->free_list);
+	SET_CHUNK_FREE(chunk);
+}
+
+#ifdef MALLOC_PERCPU_RSEQ
+/**
+ * percpu_init - Map the per-CPU bins if glibc registered restartable sequences for us, otherwise
+ *               leave the per-CPU caches off.
+ */
+static void percpu_init(void){
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	void *bins;
+
+	if(__rseq_size == 0 || ncpus <= 0){
+		return;
+	}
+	_Static_assert(NQUICK_BINS * sizeof(percpu_bin_t) == 1UL << PERCPU_SHIFT, "PERCPU_SHIFT doesn't match the bins");
+
+	bins = mmap(NULL, (size_t) ncpus << PERCPU_SHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(bins == MAP_FAILED){
+		return;
+	}
+	percpu_ncpus = ncpus;
+	percpu_bins = bins;
+	percpu_fence = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+}
+
+/*
+ * The critical sections below follow the kernel's rseq ABI: the struct rseq_cs descriptor goes in
+ * its own section, the abort handler is preceded by RSEQ_SIG, and the only store anyone else can
+ * see is the final update of count. If the thread is preempted, migrated or signalled before that
+ * store, the kernel sends it to the abort handler, which gives up and lets the caller take the lock.
+ */
+#define PERCPU_RSEQ_CS(start, commit, abort) \
+	".pushsection __rseq_cs, \"aw\"\n\t" \
+	".balign 32\n\t" \
+	"1:\n\t" \
+	".long 0, 0\n\t" \
+	".quad " #start ", " #commit " - " #start ", " #abort "\n\t" \
+	".popsection\n\t" \
+	"leaq 1b(%%rip), %%rax\n\t" \
+	"movq %%rax, %%fs:8(%[rseq])\n\t"
+
+#define PERCPU_RSEQ_ABORT(abort, fail) \
+	".pushsection __rseq_failure, \"ax\"\n\t" \
+	".long %c[sig]\n\t" \
+	#abort ":\n\t" \
+	"jmp " #fail "\n\t" \
+	".popsection\n\t"
+
+/**
+ * percpu_pop - Take a chunk off the calling CPU's bin @idx without locking. Returns NULL if the
+ *              bin is empty or the critical section was interrupted.
+ */
+static inline malloc_chunk_t *percpu_pop(size_t idx){
+	malloc_chunk_t *chunk;
+
+	__asm__ __volatile__(
+		PERCPU_RSEQ_CS(3f, 4f, 6f)
+		"3:\n\t"
+		"movl %%fs:4(%[rseq]), %%eax\n\t"
+		"cmpl %[ncpus], %%eax\n\t"
+		"jae 5f\n\t"
+		"shlq %[shift], %%rax\n\t"
+		"addq %[bin], %%rax\n\t"
+		"movq (%%rax), %%rcx\n\t"
+		"testq %%rcx, %%rcx\n\t"
+		"jle 5f\n\t"
+		"movq (%%rax, %%rcx, 8), %[chunk]\n\t"
+		"decq %%rcx\n\t"
+		"movq %%rcx, (%%rax)\n\t"
+		"4:\n\t"
+		"jmp 7f\n\t"
+		"5:\n\t"
+		"xorl %k[chunk], %k[chunk]\n\t"
+		"jmp 7f\n\t"
+		PERCPU_RSEQ_ABORT(6, 5b)
+		"7:\n\t"
+		: [chunk] "=&r" (chunk)
+		: [rseq] "r" (__rseq_offset), [ncpus] "r" (percpu_ncpus), [shift] "i" (PERCPU_SHIFT),
+		  [bin] "r" (percpu_bins + idx), [sig] "i" (RSEQ_SIG)
+		: "rax", "rcx", "memory", "cc");
+
+	return chunk;
+}
+
+/**
+ * percpu_push - Put @chunk on the calling CPU's bin @idx without locking. Returns false if the bin
+ *               is full or the critical section was interrupted.
+ */
+static inline bool percpu_push(size_t idx, malloc_chunk_t *chunk){
+	unsigned long pushed;
+
+	__asm__ __volatile__(
+		PERCPU_RSEQ_CS(3f, 4f, 6f)
+		"3:\n\t"
+		"movl %%fs:4(%[rseq]), %%eax\n\t"
+		"cmpl %[ncpus], %%eax\n\t"
+		"jae 5f\n\t"
+		"shlq %[shift], %%rax\n\t"
+		"addq %[bin], %%rax\n\t"
+		"movq (%%rax), %%rcx\n\t"
+		"cmpq %[cap], %%rcx\n\t"
+		"jae 5f\n\t"
+		"movq %[chunk], 8(%%rax, %%rcx, 8)\n\t"
+		"incq %%rcx\n\t"
+		"movq %%rcx, (%%rax)\n\t"
+		"4:\n\t"
+		"movl $1, %k[pushed]\n\t"
+		"jmp 7f\n\t"
+		"5:\n\t"
+		"xorl %k[pushed], %k[pushed]\n\t"
+		"jmp 7f\n\t"
+		PERCPU_RSEQ_ABORT(6, 5b)
+		"7:\n\t"
+		: [pushed] "=&r" (pushed)
+		: [rseq] "r" (__rseq_offset), [ncpus] "r" (percpu_ncpus), [shift] "i" (PERCPU_SHIFT),
+		  [bin] "r" (percpu_bins + idx), [cap] "r" ((unsigned long) mparams.percpu),
+		  [chunk] "r" (chunk), [sig] "i" (RSEQ_SIG)
+		: "rax", "rcx", "memory", "cc");
+
+	return pushed;
+}
+
+/**
+ * percpu_drain_bin - Give the first @count chunks of @bin back to their arenas and empty it. @bin must
+ *                    be the calling CPU's or marked PERCPU_DRAINING.
+ */
+static void percpu_drain_bin(percpu_bin_t *bin, unsigned long count){
+	malloc_arena_t *arena;
+	malloc_chunk_t *chunk;
+	unsigned long i;
+
+	for(i = 0; i < count; i++){
+		chunk = bin->chunks[i];
+		chunk->used = true;
+		arena = chunk_arena(chunk);
+		arena_lock(arena);
+		free_chunk(arena, chunk);
+		pthread_mutex_unlock(&arena->lock);
+	}
+	__atomic_store_n(&bin->count, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * percpu_drain_cpu - Empty CPU @cpu's bins from any CPU. The bins are marked PERCPU_DRAINING, then
+ *                    membarrier() restarts any critical section still running on @cpu. One that
+ *                    read a count before it was marked may have stored over the mark first, so
+ *                    the bins are marked and fenced again until every mark survives. Returns false,
+ *                    leaving the bins alone, if @cpu can't be fenced.
+ */
+static bool percpu_drain_cpu(unsigned int cpu){
+	percpu_bin_t *bins = percpu_bins + (size_t) cpu * NQUICK_BINS;
+	bool marked;
+	size_t idx;
+
+	do {
+		for(idx = 0; idx < NQUICK_BINS; idx++){
+			__atomic_fetch_or(&bins[idx].count, PERCPU_DRAINING, __ATOMIC_SEQ_CST);
+		}
+		if(syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, MEMBARRIER_CMD_FLAG_CPU, cpu) != 0){
+			for(idx = 0; idx < NQUICK_BINS; idx++){
+				__atomic_fetch_and(&bins[idx].count, ~PERCPU_DRAINING, __ATOMIC_SEQ_CST);
+			}
+			return false;
+		}
+		marked = true;
+		for(idx = 0; idx < NQUICK_BINS; idx++){
+			marked &= (__atomic_load_n(&bins[idx].count, __ATOMIC_ACQUIRE) & PERCPU_DRAINING) != 0;
+		}
+	} while(!marked);
+
+	for(idx = 0; idx < NQUICK_BINS; idx++){
+		percpu_drain_bin(&bins[idx], bins[idx].count & ~PERCPU_DRAINING);
+	}
+	return true;
+}
+
+/**
+ * percpu_drain - Give every chunk in the per-CPU bins back to its arena. Without membarrier() only the
+ *                calling CPU's bins can be touched, the others are left as they are.
+ */
+static void percpu_drain(void){
+	malloc_arena_t *arena;
+	malloc_chunk_t *chunk;
+	unsigned int cpu;
+	size_t idx;
+
+	if(percpu_fence){
+		for(cpu = 0; cpu < percpu_ncpus; cpu++){
+			percpu_drain_cpu(cpu);
+		}
+		return;
+	}
+
+	for(idx = 0; idx < NQUICK_BINS; idx++){
+		while( (chunk = percpu_pop(idx)) != NULL){
+			chunk->used = true;
+			arena = chunk_arena(chunk);
+			arena_lock(arena);
+			free_chunk(arena, chunk);
+			pthread_mutex_unlock(&arena->lock);
+		}
+	}
+}
+#endif
+
+/**
+ * mmap_chunk - Fullfill a large request with a private mapping so it goes back to the kernel on free().
+ * @size: size of requested memmory in bytes
+ */
+static void *mmap_chunk(size_t size){
+	size_t map_size = ALIGN_UP(CALC_CHUNK_SIZE(size), mparams.page_size);
+	malloc_chunk_t *chunk;
+
+	if(!budget_allow(map_size)){
+		return NULL;
+	}
+
+	MALLOC_PROBE(mmap, size, map_size);
+	PROFILE_START(start);
+	chunk = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	PROFILE_END(MM_PROF_MMAP, start);
+	if(chunk == MAP_FAILED){
+		return NULL;
+	}
+#ifdef MALLOC_PAGEMAP
+	if(!pagemap_set(chunk, map_size, &mmap_span)){
+		munmap(chunk, map_size);
+		return NULL;
+	}
+#endif
+
+	if(!mparams.layout_frozen){
+		mparams.layout_frozen = true;
+	}
+
+	chunk->prev_size = 0;
+	chunk->size = map_size;
+	chunk->used = CHUNK_MMAPPED;
+	SEAL_CHUNK(chunk);
+	__atomic_add_fetch(&mmapped_bytes, map_size, __ATOMIC_RELAXED);
+	return chunk2mem(chunk);
+}
+
+/**
+ * munmap_chunk - Release a chunk created by mmap_chunk().
+ */
+static void munmap_chunk(malloc_chunk_t *chunk){
+	__atomic_sub_fetch(&mmapped_bytes, chunk->prev_size + chunk->size, __ATOMIC_RELAXED);
+#ifdef MALLOC_PAGEMAP
+	// Before the range can be mapped again and registered by another thread
+	pagemap_set((char *) chunk - chunk->prev_size, chunk->prev_size + chunk->size, NULL);
+#endif
+	munmap((char *) chunk - chunk->prev_size, chunk->prev_size + chunk->size);
+}
+
+/**
+ * mremap_chunk - Grow the mapping of @chunk, created by mmap_chunk(), to hold @size bytes. The kernel
+ *                extends it in place or moves its pages, nothing is copied. Returns the chunk's memory,
+ *                which may have moved, or NULL with @chunk untouched if the mapping can't grow.
+ * @chunk: mmap()ed chunk
+ * @size: new size in bytes
+ */
+static void *mremap_chunk(malloc_chunk_t *chunk, size_t size){
+	size_t offset = chunk->prev_size;
+	size_t old_size = offset + chunk->size;
+	size_t map_size = ALIGN_UP(offset + CALC_CHUNK_SIZE(size), mparams.page_size);
+	char *old_map = (char *) chunk - offset;
+	unsigned int tag = chunk->tag;
+	char *map;
+
+	if(!budget_allow(map_size - old_size)){
+		return NULL;
+	}
+	if(tag != 0 && !tag_charge(tag, map_size - old_size)){
+		return NULL;
+	}
+
+#ifdef MALLOC_PAGEMAP
+	// In place if the pages after the mapping are free, then only those need registering
+	map = mremap(old_map, old_size, map_size, 0);
+	if(map != MAP_FAILED && !pagemap_set(old_map + old_size, map_size - old_size, &mmap_span)){
+		mremap(old_map, map_size, old_size, 0);
+		map = NULL;
+	}
+	else if(map == MAP_FAILED){
+		// Moving: register a reservation, then move the pages onto it. The old range is unregistered
+		// before the move releases it, another thread may map and register it right after.
+		map = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(map == MAP_FAILED){
+			map = NULL;
+		}
+		else if(!pagemap_set(map, map_size, &mmap_span)){
+			munmap(map, map_size);
+			map = NULL;
+		}
+		else {
+			pagemap_set(old_map, old_size, NULL);
+			if(mremap(old_map, old_size, map_size, MREMAP_MAYMOVE | MREMAP_FIXED, map) == MAP_FAILED){
+				pagemap_set(old_map, old_size, &mmap_span);
+				pagemap_set(map, map_size, NULL);
+				munmap(map, map_size);
+				map = NULL;
+			}
+		}
+	}
+#else
+	if( (map = mremap(old_map, old_size, map_size, MREMAP_MAYMOVE)) == MAP_FAILED){
+		map = NULL;
+	}
+#endif
+
+	if(map == NULL){
+		if(tag != 0){
+			tag_charge(tag, -(long) (map_size - old_size));
+		}
+		return NULL;
+	}
+
+	chunk = (malloc_chunk_t *) (map + offset);
+	chunk->size = map_size - offset;
+	SEAL_CHUNK(chunk);
+	__atomic_add_fetch(&mmapped_bytes, map_size - old_size, __ATOMIC_RELAXED);
+	if(tag != 0){
+		tag_count(tag, map_size - old_size, 0);
+	}
+	return chunk2mem(chunk);
+}
+
+/**
+ * copy_large - memcpy() that, from stream_threshold bytes on, writes with non-temporal stores. A large
+ *              realloc() then doesn't evict the working set for data nobody reads right away.
+ */
+static void copy_large(void *dst, const void *src, size_t n){
+#ifdef __SSE2__
+	// Below a cache line there's nothing to stream, and @head may be more than @n
+	if(n >= mparams.stream_threshold && n >= 64){
+		size_t head = -(uintptr_t) dst & 15;
+		const char *s = (const char *) src + head;
+		char *d = (char *) dst + head;
+
+		memcpy(dst, src, head);
+		n -= head;
+		for(; n >= 64; n -= 64, s += 64, d += 64){
+			__m128i a = _mm_loadu_si128((const __m128i *) s);
+			__m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *) (s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *) (s + 48));
+			_mm_stream_si128((__m128i *) d, a);
+			_mm_stream_si128((__m128i *) (d + 16), b);
+			_mm_stream_si128((__m128i *) (d + 32), c);
+			_mm_stream_si128((__m128i *) (d + 48), e);
+		}
+		// Streaming stores are weakly ordered, they must land before the memory is handed out
+		_mm_sfence();
+		memcpy(d, s, n);
+		return;
+	}
+#endif
+	memcpy(dst, src, n);
+}
+
+/**
+ * clear_large - memset() to 0 with non-temporal stores from stream_threshold bytes on, for calloc().
+ */
+static void clear_large(void *dst, size_t n){
+#ifdef __SSE2__
+	// Below a cache line there's nothing to stream, and @head may be more than @n
+	if(n >= mparams.stream_threshold && n >= 64){
+		size_t head = -(uintptr_t) dst & 15;
+		__m128i zero = _mm_setzero_si128();
+		char *d = (char *) dst + head;
+
+		memset(dst, 0, head);
+		n -= head;
+		for(; n >= 64; n -= 64, d += 64){
+			_mm_stream_si128((__m128i *) d, zero);
+			_mm_stream_si128((__m128i *) (d + 16), zero);
+			_mm_stream_si128((__m128i *) (d + 32), zero);
+			_mm_stream_si128((__m128i *) (d + 48), zero);
+		}
+		_mm_sfence();
+		memset(d, 0, n);
+		return;
+	}
+#endif
+	memset(dst, 0, n);
+}
+
+#ifdef MALLOC_GUARD
+/**
+ * guard_sampled - True if the calling thread's next request should get guard pages.
+ */
+static inline bool guard_sampled(void){
+	if(mparams.guard_sample == 0){
+		return false;
+	}
+	if(guard_countdown == 0){
+		guard_countdown = mparams.guard_sample;
+	}
+	return --guard_countdown == 0;
+}
+
+/**
+ * guard_chunk - Map a request on its own so it ends right at a PROT_NONE page. Reading or writing
+ *               past the end faults at the offending instruction.
+ * @size: size of requested memmory in bytes (already aligned)
+ */
+static void *guard_chunk(size_t size){
+	size_t page_size = mparams.page_size;
+	size_t map_size = ALIGN_UP(CALC_CHUNK_SIZE(size), page_size) + page_size;
+	malloc_chunk_t *chunk;
+	char *map, *guard;
+
+	if(!budget_allow(map_size)){
+		return NULL;
+	}
+	if( (map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+		return NULL;
+	}
+	guard = map + map_size - page_size;
+	if(mprotect(guard, page_size, PROT_NONE) != 0){
+		munmap(map, map_size);
+		return NULL;
+	}
+#ifdef MALLOC_PAGEMAP
+	if(!pagemap_set(map, map_size, &guard_span)){
+		munmap(map, map_size);
+		return NULL;
+	}
+#endif
+
+	if(!mparams.layout_frozen){
+		mparams.layout_frozen = true;
+	}
+
+	chunk = mem2chunk(guard - size);
+	chunk->prev_size = (char *) chunk - map;
+	chunk->size = guard - (char *) chunk;
+	chunk->used = CHUNK_GUARDED;
+	SEAL_CHUNK(chunk);
+	__atomic_add_fetch(&mmapped_bytes, map_size, __ATOMIC_RELAXED);
+	return chunk2mem(chunk);
+}
+
+/**
+ * guard_free - Make a guarded chunk's whole mapping inaccessible and quarantine it, so a stale pointer
+ *              faults instead of reaching new data. The oldest quarantined mapping is unmapped to make room.
+ */
+static void guard_free(malloc_chunk_t *chunk){
+	size_t map_size = chunk->prev_size + chunk->size + mparams.page_size;
+	char *map = (char *) chunk - chunk->prev_size;
+	char *old_addr;
+	size_t old_len;
+
+	__atomic_sub_fetch(&mmapped_bytes, map_size, __ATOMIC_RELAXED);
+#ifdef MALLOC_PAGEMAP
+	// A second free() of it is now caught as an invalid pointer
+	pagemap_set(map, map_size, NULL);
+#endif
+
+	// Drop the pages so the quarantine only costs address space
+	madvise(map, map_size, MADV_DONTNEED);
+	mprotect(map, map_size, PROT_NONE);
+
+	pthread_mutex_lock(&guard_lock);
+	old_addr = guard_quarantine[guard_next].addr;
+	old_len = guard_quarantine[guard_next].len;
+	guard_quarantine[guard_next].addr = map;
+	guard_quarantine[guard_next].len = map_size;
+	guard_next = (guard_next + 1) % GUARD_QUARANTINE;
+	pthread_mutex_unlock(&guard_lock);
+
+	if(old_addr != NULL){
+		munmap(old_addr, old_len);
+	}
+}
+#endif
+
+/**
+ * arena_morecore - sbrk() for an arena. The main arena moves the real brk, node arenas
+ *                  move a private break inside their reservation and give shrunk pages back with madvise().
+ *                  With MALLOC_PAGEMAP the pages are also registered to the arena in the page map.
+ * @arena: arena to grow or shrink
+ * @increment: bytes to add (or remove when negative)
+ */
+static void *arena_morecore(malloc_arena_t *arena, intptr_t increment){
+	char *old_top;
+
+	if(increment > 0 && !budget_allow(increment)){
+		return (void *) -1;
+	}
+
+#ifdef MALLOC_PAGEMAP
+	if(increment < 0){
+		// Forget the pages given back before anyone else can map them, the page the heap now ends in stays
+		uintptr_t end = (uintptr_t) arena_morecore(arena, 0);
+		uintptr_t start = ALIGN_UP(end + increment, (uintptr_t) 1 << PAGEMAP_PAGE_SHIFT);
+
+		if(start < end){
+			pagemap_set((void *) start, end - start, NULL);
+		}
+	}
+#endif
+
+	if(arena->seg_base == NULL){
+		old_top = sbrk(increment);
+	}
+	else {
+		old_top = arena->seg_top;
+
+		if(increment > 0 && (size_t) increment > (size_t) (arena->seg_end - old_top)){
+			return (void *) -1;
+		}
+
+#ifdef MALLOC_NUMA
+		if(increment < 0){
+			size_t page_size = mparams.page_size;
+			uintptr_t start = ((uintptr_t) (old_top + increment) + page_size - 1) & ~(page_size - 1);
+
+			if(start < (uintptr_t) old_top){
+				madvise((void *) start, (uintptr_t) old_top - start, MADV_DONTNEED);
+			}
+		}
+#endif
+
+		arena->seg_top = old_top + increment;
+	}
+
+	if(increment != 0 && old_top != (void *) -1){
+		__atomic_add_fetch(&heap_footprint, increment, __ATOMIC_RELAXED);
+	}
+
+#ifdef MALLOC_PAGEMAP
+	if(increment > 0 && old_top != (void *) -1 && !pagemap_set(old_top, increment, arena_span(arena))){
+		arena_morecore(arena, -increment);
+		return (void *) -1;
+	}
+#endif
+	return old_top;
+}
+
+/**
+ * get_arena - Arena the calling thread should allocate from.
+ */
+static malloc_arena_t *get_arena(void){
+#ifdef MALLOC_NUMA
+	if(numa_nodes > 1){
+		return &numa_arenas[numa_current_node()];
+	}
+#endif
+	return &main_arena;
+}
+
+/**
+ * chunk_arena - Arena that owns @chunk, so frees go back to the heap the chunk was carved from.
+ */
+static malloc_arena_t *chunk_arena(malloc_chunk_t *chunk){
+#ifdef MALLOC_NUMA
+	if(numa_base != NULL && (char *) chunk >= numa_base && (char *) chunk < numa_base + NUMA_ARENA_RESERVE * numa_nodes){
+		return &numa_arenas[((char *) chunk - numa_base) / NUMA_ARENA_RESERVE];
+	}
+#endif
+	return &main_arena;
+}
+
+/**
+ * chunk_kind - How @chunk is freed: CHUNK_MMAPPED, CHUNK_GUARDED or anything else for a heap chunk,
+ *              whose arena is stored in @arena. With MALLOC_PAGEMAP this is looked up in the page map
+ *              rather than trusted from the header, and a pointer malloc() never returned is reported.
+ * @chunk: header of the chunk
+ * @arena: set to the chunk's arena
+ * @func: caller, named in the report
+ */
+static inline int chunk_kind(malloc_chunk_t *chunk, malloc_arena_t **arena, const char *func){
+#ifdef MALLOC_PAGEMAP
+	malloc_span_t *span = pagemap_span(chunk2mem(chunk));
+
+	if(span == NULL){
+		malloc_corruption(func, "invalid pointer", chunk2mem(chunk));
+	}
+	// A mapped chunk's header must agree, otherwise the pointer is not the start of the chunk
+	if(span->kind != true && span->kind != chunk->used){
+		malloc_corruption(func, "invalid pointer", chunk2mem(chunk));
+	}
+	*arena = span->arena;
+	return span->kind;
+#else
+	(void) func;
+	*arena = chunk_arena(chunk);
+	return chunk->used;
+#endif
+}
+
+/**
+ * resize_chunk - shrink @target_chunk to minimal size to fullfill @size memory request
+ *                and create new free chunk in the remaining space and add it to free list
+ *                (or fold it into the top chunk if that is what follows).
+ * @arena - arena owning @target_chunk
+ * @target_chunk - chunk to split
+ * @size - memory request to fullfill (target_chunk's new size will be CALC_CHUNK_SIZE(size))
+ */
+static void resize_chunk(malloc_arena_t *arena, malloc_chunk_t *target_chunk, size_t size){
+		size_t new_free_chunk_size;
+		malloc_chunk_t *after_new_free_chunk;
+		malloc_chunk_t *new_free_chunk;
+
+		new_free_chunk_size = target_chunk->size - CALC_CHUNK_SIZE(size);
+		target_chunk->size = CALC_CHUNK_SIZE(size);
+		new_free_chunk = (malloc_chunk_t *) (((char *)target_chunk) + target_chunk->size);
+		arena->allocated_bytes -= new_free_chunk_size;
+
+		new_free_chunk->prev_size = target_chunk->size;
+		new_free_chunk->size = new_free_chunk_size;
+		new_free_chunk->used = false;   
+		SEAL_CHUNK(target_chunk);
+		SEAL_CHUNK(new_free_chunk);
+		link_chunk(arena, new_free_chunk);
+		
+		// The top chunk always follows, so there is def. a chunk after the new one
+		after_new_free_chunk = (malloc_chunk_t *)((char *)new_free_chunk + new_free_chunk->size);
+		after_new_free_chunk->prev_size = new_free_chunk->size;
+		SEAL_CHUNK(after_new_free_chunk);
+
+		merge_adjacent(arena, new_free_chunk);
+		return;
+}
+
+/**
+ * use_free_chunk - Given a free_chunk of adequate size, fullfill the size request with that chunk.
+ * 					Split the chunk and put the unused portion back in the free_list if possible.
+ * @arena: arena owning @target_chunk
+ * @free_chunk: adequate sized free chunk from free list
+ * @size: size of request
+ */
+static void *use_free_chunk(malloc_arena_t *arena, malloc_chunk_t *target_chunk, size_t size){
+	size_t new_free_chunk_size;
+
+	if(target_chunk == NULL){
+		return NULL;
+	}
+
+	if(target_chunk->size < (CALC_CHUNK_SIZE(size))){
+		return NULL;
+	}
+
+	new_free_chunk_size = target_chunk->size - CALC_CHUNK_SIZE(size);
+
+	// If chunk is big enough split it and add unused portion back to free_list
+	if(new_free_chunk_size >= MIN_CHUNK_SIZE){
+		resize_chunk(arena, target_chunk, size);
+	}
+
+	target_chunk->used = true;
+	return chunk2mem(target_chunk);
+}
+
+/**
+ * grow_top - Extend the heap so the top chunk holds at least @need bytes. The heap grows
+ *            geometrically (doubling up to MAX_TOP_GROW per call) so allocation bursts only
+ *            hit the kernel every so often. Returns false if the heap can't grow.
+ * @arena: arena whose heap is grown
+ * @need: bytes the top chunk must hold afterwards
+ */
+static bool grow_top(malloc_arena_t *arena, size_t need){
+	malloc_chunk_t *top = arena->heap_tail;
+	size_t top_size = (top != NULL) ? top->size : 0;
+	size_t brk_increase;
+	char *old_brk;
+
+	if(arena->top_grow < MIN_BRK_INCREASE){
+		arena->top_grow = MIN_BRK_INCREASE;
+	}
+
+	brk_increase = ALIGN_UP(need - top_size, mparams.page_size);
+	if(brk_increase < arena->top_grow){
+		brk_increase = ALIGN_UP(arena->top_grow, BYTE_ALIGNMENT);
+	}
+
+	if(top == NULL){
+		// Someone else may have left the break unaligned, line the first chunk up
+		uintptr_t cur_brk = (uintptr_t) arena_morecore(arena, 0);
+
+		if(cur_brk != ALIGN_UP(cur_brk, BYTE_ALIGNMENT) && arena_morecore(arena, ALIGN_UP(cur_brk, BYTE_ALIGNMENT) - cur_brk) == (void *) -1){
+			return false;
+		}
+		if(!mparams.layout_frozen){
+			mparams.layout_frozen = true;
+		}
+	}
+
+	MALLOC_PROBE(grow_top, arena, brk_increase);
+	PROFILE_START(start);
+
+	// Increase heap size, settle for exactly what is needed if the geometric step doesn't fit
+	if( (old_brk = arena_morecore(arena, brk_increase)) == (void *) -1){
+		brk_increase = ALIGN_UP(need - top_size, BYTE_ALIGNMENT);
+		if( (old_brk = arena_morecore(arena, brk_increase)) == (void *) -1){
+			return false;
+		}
+	}
+	PROFILE_END(MM_PROF_GROW, start);
+
+	arena->last_grow = brk_increase;
+	if(arena->top_grow < MAX_TOP_GROW){
+		arena->top_grow *= 2;
+	}
+	arena->heap_bytes += brk_increase;
+
+	// First growth, the whole increase becomes the top chunk
+	if(top == NULL){
+		top = (malloc_chunk_t *) old_brk;
+		top->prev_size = 0;
+		top->size = brk_increase;
+		top->used = CHUNK_TOP;
+		SEAL_CHUNK(top);
+		arena->heap_head = arena->heap_tail = top;
+		return true;
+	}
+
+	if(old_brk == (char *) top + top->size){
+		top->size += brk_increase;
+		SEAL_CHUNK(top);
+		return true;
+	}
+
+	// Someone else moved the break. Fence off the old top and the gap as a chunk that is never freed.
+	if(old_brk < (char *) top + top->size || brk_increase < need){
+		return false;
+	}
+	top->size = old_brk - (char *) top;
+	top->used = true;
+	SEAL_CHUNK(top);
+	arena->allocated_bytes += top->size;
+	arena->heap_bytes += top->size - top_size;
+
+	((malloc_chunk_t *) old_brk)->prev_size = top->size;
+	top = (malloc_chunk_t *) old_brk;
+	top->size = brk_increase;
+	top->used = CHUNK_TOP;
+	SEAL_CHUNK(top);
+	arena->heap_tail = top;
+	return true;
+}
+
+/**
+ * sys_malloc - Carve a chunk for the request off the front of the top chunk, growing the heap first if
+ *              the top chunk is too small. The top chunk always keeps room for its own header.
+ * @arena: arena whose top chunk is used
+ * @size: size of requested memmory in bytes
+ */
+static void *sys_malloc(malloc_arena_t *arena, size_t size){
+	size_t new_chunk_size;
+	malloc_chunk_t *new_chunk_ptr;
+	malloc_chunk_t *top;
+
+	new_chunk_size = CALC_CHUNK_SIZE(size);
+	MALLOC_PROBE(sys_malloc, arena, size);
+
+	top = arena->heap_tail;
+	if(top == NULL || top->size < new_chunk_size + MIN_CHUNK_SIZE){
+		if(!grow_top(arena, new_chunk_size + MIN_CHUNK_SIZE)){
+			return NULL;
+		}
+	}
+
+	// Bump: the old top becomes the new chunk and the top starts right after it
+	new_chunk_ptr = arena->heap_tail;
+	top = (malloc_chunk_t *) ((char *) new_chunk_ptr + new_chunk_size);
+	top->prev_size = new_chunk_size;
+	top->size = new_chunk_ptr->size - new_chunk_size;
+	top->used = CHUNK_TOP;
+	SEAL_CHUNK(top);
+	arena->heap_tail = top;
+
+	new_chunk_ptr->size = new_chunk_size;
+	new_chunk_ptr->used = true;
+	SEAL_CHUNK(new_chunk_ptr);
+	arena->allocated_bytes += new_chunk_size;
+	return chunk2mem(new_chunk_ptr);
+}
+
+/**
+ * get_worst_fit_chunk - Find the largest chunk that is at least large enough to fullfill @size request.
+ * 						 If no chunk is found, return NULL.
+ * @arena: arena to search
+ * @size: size of memmory request
+ */
+static malloc_chunk_t *get_worst_fit_chunk(malloc_arena_t *arena, size_t size){
+	// Anything larger than this is both big enough and the largest seen so far
+	size_t worst_fit_size = CALC_CHUNK_SIZE(size) - 1;
+	malloc_chunk_t *worst_fit_chunk = NULL;
+	malloc_chunk_t *cur_chunk;
+	
+	// Find largest chunk that can service request, if it exists
+	list_for_each_entry(cur_chunk, &arena->free_list, free_list){
+		if(cur_chunk->size > worst_fit_size){
+			worst_fit_size = cur_chunk->size;
+			worst_fit_chunk = cur_chunk;
+		}
+	}
+
+	return worst_fit_chunk;
+}
+
+/**
+ * get_first_fit_chunk - Find the first chunk in the free list large enough to fullfill @size request.
+ * 						 If no chunk is found, return NULL.
+ * @arena: arena to search
+ * @size: size of memmory request
+ */
+static malloc_chunk_t *get_first_fit_chunk(malloc_arena_t *arena, size_t size){
+	size_t min_chunk_size = CALC_CHUNK_SIZE(size);
+	malloc_chunk_t *cur_chunk;
+
+	list_for_each_entry(cur_chunk, &arena->free_list, free_list){
+		if(cur_chunk->size >= min_chunk_size){
+			return cur_chunk;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * get_best_fit_chunk - Find the smallest chunk that is at least large enough to fullfill @size request.
+ * 						If no chunk is found, return NULL.
+ * @arena: arena to search
+ * @size: size of memmory request
+ */
+static malloc_chunk_t *get_best_fit_chunk(malloc_arena_t *arena, size_t size){
+	size_t min_chunk_size = CALC_CHUNK_SIZE(size);
+	malloc_chunk_t *best_fit_chunk = NULL;
+	malloc_chunk_t *cur_chunk;
+
+	list_for_each_entry(cur_chunk, &arena->free_list, free_list){
+		if(cur_chunk->size >= min_chunk_size && (best_fit_chunk == NULL || cur_chunk->size < best_fit_chunk->size)){
+			best_fit_chunk = cur_chunk;
+			// Can't do better than an exact fit
+			if(cur_chunk->size == min_chunk_size){
+				break;
+			}
+		}
+	}
+
+	return best_fit_chunk;
+}
+
+/**
+ * get_fit_chunk - Pick a free chunk for @size request with the configured placement policy
+ *                 and take it off the free list. If no chunk is found, return NULL.
+ * @arena: arena to search
+ * @size: size of memmory request
+ */
+static malloc_chunk_t *get_fit_chunk(malloc_arena_t *arena, size_t size){
+	malloc_chunk_t *fit_chunk;
+
+	switch(mparams.placement){
+		case M_PLACEMENT_FIRST_FIT:
+			fit_chunk = get_first_fit_chunk(arena, size);
+			break;
+		case M_PLACEMENT_BEST_FIT:
+			fit_chunk = get_best_fit_chunk(arena, size);
+			break;
+		default:
+			fit_chunk = get_worst_fit_chunk(arena, size);
+			break;
+	}
+
+	// If we found a suitable chunk, remove from free_list and return it
+	if(fit_chunk != NULL){
+		CHECK_CHUNK(fit_chunk, "malloc");
+		unlink_chunk(fit_chunk);
+		fit_chunk->used = true;
+		arena->allocated_bytes += fit_chunk->size;
+	}
+
+	return fit_chunk;
+}
+
+/**
+ * merge_adjacent - Merge current free()'ed chunk with adjacent free chunks if any.
+ *                  A chunk next to the top chunk is folded into it instead.
+ * @arena: arena owning @target_chunk
+ * @target_chunk: free()'ed chunk with which to attempt merger
+ */
+static void merge_adjacent(malloc_arena_t *arena, malloc_chunk_t *target_chunk){
+	malloc_chunk_t *prev_chunk;
+	malloc_chunk_t *next_chunk;
+	malloc_chunk_t *next_next_chunk;
+	bool into_top = false;
+
+	if(target_chunk == NULL){
+		return;
+	}
+	MALLOC_PROBE(merge, arena, target_chunk, target_chunk->size);
+
+	// The top chunk is always last, so there is def. a chunk following the target
+	next_chunk = (malloc_chunk_t *)((char *)target_chunk + target_chunk->size);
+
+	// Neighbours' headers are only read once we know they will be merged
+	if(next_chunk == arena->heap_tail){
+		// Fold target into the top chunk
+		CHECK_CHUNK(next_chunk, "free");
+		unlink_chunk(target_chunk);
+		target_chunk->size += next_chunk->size;
+		target_chunk->used = CHUNK_TOP;
+		SEAL_CHUNK(target_chunk);
+		arena->heap_tail = target_chunk;
+		into_top = true;
+	}
+	else if(CHUNK_IS_FREE(next_chunk)){
+		// If next chunk is free merge with target, the merged chunk is as dirty as the newer of the two
+		CHECK_CHUNK(next_chunk, "free");
+		unlink_chunk(next_chunk);
+		if(FREE_STAMP(next_chunk) > FREE_STAMP(target_chunk)){
+			FREE_STAMP(target_chunk) = FREE_STAMP(next_chunk);
+		}
+		target_chunk->size += next_chunk->size;
+		SEAL_CHUNK(target_chunk);
+		next_next_chunk = (malloc_chunk_t *)((char *)target_chunk + target_chunk->size);
+		next_next_chunk->prev_size = target_chunk->size;
+		SEAL_CHUNK(next_next_chunk);
+	}
+
+	// Chunk is not at the beginning of heap space, so there is def. a chunk preceeding it
+	if(target_chunk != arena->heap_head){
+		prev_chunk = (malloc_chunk_t *)(((char *)target_chunk) - target_chunk->prev_size);
+		if(CHUNK_IS_FREE(prev_chunk)){
+			CHECK_CHUNK(prev_chunk, "free");
+			prev_chunk->size += target_chunk->size;
+			if(target_chunk == arena->heap_tail){
+				// Target became the top chunk above, prev takes its place
+				unlink_chunk(prev_chunk);
+				prev_chunk->used = CHUNK_TOP;
+				arena->heap_tail = prev_chunk;
+			}
+			else {
+				unlink_chunk(target_chunk);
+				if(FREE_STAMP(target_chunk) > FREE_STAMP(prev_chunk)){
+					FREE_STAMP(prev_chunk) = FREE_STAMP(target_chunk);
+				}
+				next_next_chunk = (malloc_chunk_t *)(((char *)prev_chunk) + prev_chunk->size);
+				next_next_chunk->prev_size = prev_chunk->size;
+				SEAL_CHUNK(next_next_chunk);
+			}
+			SEAL_CHUNK(prev_chunk);
+		}
+	}
+
+	if(into_top){
+		// Freed memory went into the top chunk, its decay starts over
+		arena->top_dirty_epoch = __atomic_load_n(&purge_epoch, __ATOMIC_RELAXED);
+		arena->top_dirty_size = arena->heap_tail->size;
+	}
+
+	return;
+}
+
+/**
+ * trim_heap - Give everything past @keep bytes of the top chunk back, if that is at least @threshold
+ *             bytes. An empty heap is released entirely. Returns the number of bytes released.
+ * @arena: arena whose heap is trimmed
+ * @keep: bytes of the top chunk to keep as padding
+ * @threshold: smallest trim worth a system call
+ */
+static size_t trim_heap(malloc_arena_t *arena, size_t keep, size_t threshold){
+	malloc_chunk_t *top = arena->heap_tail;
+	size_t shrink_counter;
+
+	if(top == NULL){
+		return 0;
+	}
+
+	if(top == arena->heap_head){
+		// Nothing left in use, release the whole heap
+		if(top->size < threshold){
+			return 0;
+		}
+		shrink_counter = top->size;
+		arena->heap_head = NULL;
+		arena->heap_tail = NULL;
+		arena->top_grow = 0;
+		arena->last_grow = 0;
+		arena->heap_bytes -= shrink_counter;
+		MALLOC_PROBE(shrink_brk, arena, shrink_counter);
+		PROFILE_START(start);
+		arena_morecore(arena, -1*shrink_counter);
+		PROFILE_END(MM_PROF_TRIM, start);
+		return shrink_counter;
+	}
+
+	if(keep < MIN_CHUNK_SIZE){
+		keep = MIN_CHUNK_SIZE;
+	}
+	if(top->size <= keep || top->size - keep < threshold){
+		return 0;
+	}
+
+	shrink_counter = top->size - keep;
+	top->size = keep;
+	SEAL_CHUNK(top);
+	arena->top_grow = 0;
+	arena->heap_bytes -= shrink_counter;
+	MALLOC_PROBE(shrink_brk, arena, shrink_counter);
+	PROFILE_START(start);
+	arena_morecore(arena, -1*shrink_counter);
+	PROFILE_END(MM_PROF_TRIM, start);
+
+	return shrink_counter;
+}
+
+/*
+ * shrink_brk - If the top chunk has grown past MIN_BRK_DECREASE on top of the padding it keeps, give
+ *				the excess back. The padding is MIN_BRK_INCREASE or the last growth step, whichever is
+ *				larger, so a malloc()/free() pair at the top doesn't grow and trim the heap every time.
+ *				An empty heap is released entirely. Left to the purge thread when it runs, so free()
+ *				makes no system calls.
+ * @arena: arena whose heap is trimmed
+ */
+static void shrink_brk(malloc_arena_t *arena){
+	size_t keep = MIN_BRK_INCREASE;
+
+	if(__atomic_load_n(&purge_running, __ATOMIC_RELAXED)){
+		return;
+	}
+	if(arena->last_grow > keep){
+		keep = arena->last_grow;
+	}
+	trim_heap(arena, ALIGN_UP(keep, BYTE_ALIGNMENT), MIN_BRK_DECREASE);
+}
+
+/**
+ * purge_chunk - Tell the kernel it can take back the whole pages inside free @chunk (they read back
+ *               as zeros, or unchanged with purge_lazy, next time they're touched) and mark the chunk
+ *               purged. Returns the number of bytes purged.
+ */
+static size_t purge_chunk(malloc_chunk_t *chunk){
+	// The header, list links and stamp stay in use while the chunk is free
+	uintptr_t start = ALIGN_UP((uintptr_t) chunk2mem(chunk) + sizeof(unsigned long), mparams.page_size);
+	uintptr_t end = ((uintptr_t) chunk + chunk->size) & ~(mparams.page_size - 1);
+
+	FREE_STAMP(chunk) = 0;
+	if(end <= start || madvise((void *) start, end - start, mparams.purge_advice) != 0){
+		return 0;
+	}
+	return end - start;
+}
+
+/**
+ * release_arena - Empty @arena's quick lists, trim its top chunk down to the minimum and purge every
+ *                 free chunk. The quarantine is left alone. Returns the number of bytes released.
+ * @arena: arena to release
+ */
+static size_t release_arena(malloc_arena_t *arena){
+	malloc_chunk_t *cur_chunk;
+	size_t released;
+
+	arena_lock(arena);
+	consolidate_quick(arena);
+	released = trim_heap(arena, 0, 0);
+
+	list_for_each_entry(cur_chunk, &arena->free_list, free_list){
+		if(FREE_STAMP(cur_chunk) != 0){
+			released += purge_chunk(cur_chunk);
+		}
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	__atomic_add_fetch(&purged_bytes, released, __ATOMIC_RELAXED);
+	return released;
+}
+
+/**
+ * purge_arena - One tick of the purge thread. Memory freed into the top chunk decays linearly: after
+ *               n of the PURGE_STEPS ticks, the top chunk is trimmed down to n/PURGE_STEPS of the way
+ *               from its size then to the MIN_BRK_INCREASE padding. Free chunks are purged whole once
+ *               they've been dirty for PURGE_STEPS ticks. At most PURGE_BATCH chunks are looked at, oldest
+ *               first, and the arena is skipped when another thread holds its lock.
+ * @arena: arena to purge
+ * @epoch: current purge_epoch
+ */
+static void purge_arena(malloc_arena_t *arena, unsigned long epoch){
+	malloc_chunk_t *top;
+	malloc_chunk_t *cur_chunk;
+	malloc_chunk_t *first_moved = NULL;
+	unsigned long age;
+	size_t keep, limit;
+	size_t released = 0;
+	int i;
+
+	if(pthread_mutex_trylock(&arena->lock) != 0){
+		return;
+	}
+
+	if( (top = arena->heap_tail) != NULL){
+		keep = ALIGN_UP(MIN_BRK_INCREASE, BYTE_ALIGNMENT);
+		age = epoch - arena->top_dirty_epoch;
+		limit = keep;
+		if(age < PURGE_STEPS && arena->top_dirty_size > keep){
+			limit += ALIGN_UP((arena->top_dirty_size - keep) / PURGE_STEPS * (PURGE_STEPS - age), BYTE_ALIGNMENT);
+		}
+		// An empty heap goes all at once, so only when it has fully decayed
+		if(top != arena->heap_head || limit == keep){
+			released += trim_heap(arena, limit, mparams.page_size);
+		}
+	}
+
+	// Chunks are freed onto the head of the list, so the oldest are at the tail. Purged and still
+	// young chunks are moved to the head, until the batch is done or the list went round once.
+	for(i = 0; i < PURGE_BATCH && !list_empty(&arena->free_list); i++){
+		cur_chunk = list_entry(arena->free_list.prev, malloc_chunk_t, free_list);
+		if(cur_chunk == first_moved){
+			break;
+		}
+		if(FREE_STAMP(cur_chunk) != 0 && epoch - FREE_STAMP(cur_chunk) >= PURGE_STEPS){
+			released += purge_chunk(cur_chunk);
+		}
+		list_move(&cur_chunk->free_list, &arena->free_list);
+		if(first_moved == NULL){
+			first_moved = cur_chunk;
+		}
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	if(released > 0){
+		MALLOC_PROBE(purge, arena, released);
+		__atomic_add_fetch(&purged_bytes, released, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * purge_thread - Background thread started by purge_start(). Wakes every purge_decay / PURGE_STEPS ms
+ *                and purges each arena, until purge_decay is set back to 0.
+ */
+static void *purge_thread(void *arg){
+	unsigned int decay;
+	unsigned long epoch;
+	struct timespec tick;
+	bool expected;
+
+	(void) arg;
+	do {
+		while( (decay = __atomic_load_n(&mparams.purge_decay, __ATOMIC_RELAXED)) != 0){
+			decay = (decay + PURGE_STEPS - 1) / PURGE_STEPS;
+			tick.tv_sec = decay / 1000;
+			tick.tv_nsec = (long) (decay % 1000) * 1000000;
+			nanosleep(&tick, NULL);
+
+			epoch = __atomic_add_fetch(&purge_epoch, 1, __ATOMIC_RELAXED);
+			purge_arena(&main_arena, epoch);
+#ifdef MALLOC_NUMA
+			int i;
+			for(i = 0; i < numa_nodes; i++){
+				purge_arena(&numa_arenas[i], epoch);
+			}
+#endif
+		}
+
+		__atomic_store_n(&purge_running, false, __ATOMIC_SEQ_CST);
+		// purge_decay may have been set again while purge_running still said a thread was running, so
+		// mallopt()'s purge_start() didn't start one. Either it sees false now or this sees the new value.
+		expected = false;
+	} while(__atomic_load_n(&mparams.purge_decay, __ATOMIC_SEQ_CST) != 0 &&
+	        __atomic_compare_exchange_n(&purge_running, &expected, true, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	return NULL;
+}
+
+/**
+ * purge_atfork_child - The purge thread doesn't survive fork(), the child trims inline again.
+ */
+static void purge_atfork_child(void){
+	purge_running = false;
+}
+
+static void purge_atfork_init(void){
+	pthread_atfork(NULL, NULL, purge_atfork_child);
+}
+
+/**
+ * purge_start - Start the purge thread unless it is already running. If it can't be started,
+ *               free() just keeps trimming the heap itself.
+ */
+static void purge_start(void){
+	static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	bool expected = false;
+
+	if(!__atomic_compare_exchange_n(&purge_running, &expected, true, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+		return;
+	}
+	pthread_once(&atfork_once, purge_atfork_init);
+
+	// Signals are for the application's threads
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, purge_thread, NULL) != 0){
+		__atomic_store_n(&purge_running, false, __ATOMIC_RELAXED);
+	}
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * purge_autostart - Start the purge thread at load time if MYMALLOC_CONF asks for it. malloc_init()
+ *                   itself may run inside the first malloc(), too early to create a thread.
+ */
+__attribute__((constructor))
+static void purge_autostart(void){
+	ensure_init();
+	if(mparams.purge_decay != 0){
+		purge_start();
+	}
+}
+
+/**
+ * consolidate_quick - Empty every quick list of @arena back into the free list, merging as free() would,
+ *                     then trim the heap. Called when the quick lists go over budget or a request can't
+ *                     be satisfied from the free list.
+ * @arena: arena to consolidate
+ */
+static void consolidate_quick(malloc_arena_t *arena){
+	malloc_chunk_t *cur_chunk;
+	malloc_chunk_t *next_chunk;
+	int i;
+
+	if(arena->quick_bytes == 0){
+		return;
+	}
+	MALLOC_PROBE(consolidate, arena, arena->quick_bytes);
+	PROFILE_START(start);
+
+	for(i = 0; i < NQUICK_BINS; i++){
+		cur_chunk = arena->quick_bins[i];
+		arena->quick_bins[i] = NULL;
+
+		while(cur_chunk != NULL){
+			CHECK_CHUNK(cur_chunk, "free");
+			next_chunk = QUICK_NEXT(cur_chunk);
+			cur_chunk->used = false;
+			link_chunk(arena, cur_chunk);
+			merge_adjacent(arena, cur_chunk);
+			cur_chunk = next_chunk;
+		}
+	}
+	arena->quick_bytes = 0;
+	PROFILE_END(MM_PROF_CONSOLIDATE, start);
+
+	shrink_brk(arena);
+}
+
+/**
+ * malloc - Custom malloc() that implements the "worst fit" algo (or first/best fit, see M_PLACEMENT).
+ * @size: size of requested memmory in bytes
+ */ 
+void *malloc(size_t size){
+	void *mem;
+
+	ensure_init();
+	MALLOC_PROBE(malloc, size);
+
+	// Check request in bounds
+	if(size > MAX_REQUEST_SIZE){
+		errno = ENOMEM;
+		return NULL;
+	}
+	if(size < MIN_MAL_SIZE){
+		size = MIN_MAL_SIZE;
+	}
+	
+	// Pad size to maintain byte alignment
+	size = ALIGN_UP(size, BYTE_ALIGNMENT);
+
+	if(__builtin_expect(thread_tag != 0, 0)){
+		return malloc_tagged(size, thread_tag);
+	}
+	// A header carved out of old user data may hold anything, free() must see untagged
+	if( (mem = malloc_sized(size, QUICK_INDEX(size))) != NULL){
+		(mem2chunk(mem))->tag = 0;
+	}
+	return mem;
+}
+
+/**
+ * mm_alloc_class - malloc() of size class @cls, i.e. @cls * MM_CLASS_ALIGN bytes, with the class worked out
+ *                  by the caller. Called by mm_alloc_fixed() (malloc_inline.h), which does that at compile time.
+ *                  A class that doesn't match the runtime layout (a different alignment or min_size) is
+ *                  handed to malloc().
+ */
+void *mm_alloc_class(size_t cls){
+	size_t size = cls * MM_CLASS_ALIGN;
+	void *mem;
+
+	ensure_init();
+	if(BYTE_ALIGNMENT != MM_CLASS_ALIGN || size < MIN_MAL_SIZE || size > MAX_REQUEST_SIZE || thread_tag != 0){
+		return malloc(size);
+	}
+	MALLOC_PROBE(malloc, size);
+	if( (mem = malloc_sized(size, cls)) != NULL){
+		(mem2chunk(mem))->tag = 0;
+	}
+	return mem;
+}
+
+/**
+ * malloc_sized - malloc() once @size is in bounds and aligned. @idx is its quick list, QUICK_INDEX(@size).
+ */
+static inline void *malloc_sized(size_t size, size_t idx){
+	malloc_arena_t *arena;
+	malloc_chunk_t *fit_chunk;
+	void *ret;
+
+#ifdef MALLOC_GUARD
+	if(guard_sampled() && (ret = guard_chunk(size)) != NULL){
+		return ret;
+	}
+#endif
+
+	if(size >= mparams.mmap_threshold){
+		return malloc_done(mmap_chunk(size), size, idx);
+	}
+
+#ifdef MALLOC_PERCPU_RSEQ
+	// Exact size chunk freed on this CPU, no lock needed
+	if(percpu_bins != NULL && size <= mparams.quick_max && (fit_chunk = percpu_pop(idx)) != NULL){
+		CHECK_QUICK_LINK(fit_chunk, "malloc");
+		fit_chunk->used = true;
+		return chunk2mem(fit_chunk);
+	}
+#endif
+
+	arena = get_arena();
+	arena_lock(arena);
+
+	// Exact size chunk freed recently, reuse it as is
+	if(size <= mparams.quick_max && (fit_chunk = arena->quick_bins[idx]) != NULL){
+		CHECK_QUICK_LINK(fit_chunk, "malloc");
+		arena->quick_bins[idx] = QUICK_NEXT(fit_chunk);
+		arena->quick_bytes -= fit_chunk->size;
+		arena->allocated_bytes += fit_chunk->size;
+		fit_chunk->used = true;
+		pthread_mutex_unlock(&arena->lock);
+		return chunk2mem(fit_chunk);
+	}
+
+	fit_chunk = get_fit_chunk(arena, size);
+
+	// Small chunks parked on the quick lists may merge into something large enough, worth a try before growing the heap
+	if(fit_chunk == NULL && arena->quick_bytes > 0 && (arena->heap_tail == NULL || arena->heap_tail->size < CALC_CHUNK_SIZE(size) + MIN_CHUNK_SIZE)){
+		consolidate_quick(arena);
+		fit_chunk = get_fit_chunk(arena, size);
+	}
+
+	// Try to find a free chunk to fullfill request
+	if(fit_chunk == NULL){
+ 		// No free chunks work, carve from the top chunk (increasing brk if needed)
+		PROFILE_START(start);
+		ret = sys_malloc(arena, size);
+		PROFILE_END(MM_PROF_SYS_MALLOC, start);
+	}
+	else {
+ 		// Found a free chunk, use it to fullfill request, split if possible 	
+		ret = use_free_chunk(arena, fit_chunk, size);
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+
+	// A node arena ran out of reserved space, fall back to the brk heap
+	if(ret == NULL && arena != &main_arena){
+		arena_lock(&main_arena);
+		ret = sys_malloc(&main_arena, size);
+		pthread_mutex_unlock(&main_arena.lock);
+	}
+
+	// The heap can't grow any further (brk ran into a mapping), try a mapping of its own
+	if(ret == NULL){
+		ret = mmap_chunk(size);
+	}
+
+	return malloc_done(ret, size, idx);
+}
+
+/**
+ * malloc_done - Last step of malloc_sized() once the heap or a mapping had to be used: give memory back
+ *               if the allocation crossed the soft limit, or try harder if it failed.
+ */
+static inline void *malloc_done(void *ret, size_t size, size_t idx){
+	if(__builtin_expect(ret == NULL, 0)){
+		return malloc_failed(size, idx);
+	}
+	if(__builtin_expect(__atomic_load_n(&budget_pending, __ATOMIC_RELAXED), 0) && budget_hold == 0){
+		budget_relieve(MM_PRESSURE_SOFT);
+	}
+	return ret;
+}
+
+/**
+ * malloc_failed - Out of memory for @size. With a budget set, release what can be released, run the pressure
+ *                 callbacks and try once more. Sets errno to ENOMEM if that fails too.
+ */
+static void *malloc_failed(size_t size, size_t idx){
+	static __thread bool retrying = false;
+	void *ret = NULL;
+
+	if((mparams.soft_limit != 0 || mparams.hard_limit != 0) && budget_hold == 0 && !retrying){
+		retrying = true;
+		budget_relieve(MM_PRESSURE_HARD);
+		ret = malloc_sized(size, idx);
+		retrying = false;
+	}
+	if(ret == NULL){
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+/**
+ * free -	Custom free() that works with the above custom malloc().
+ *          Double free()s are detected but invalid pointers are not 
+ *          and result in undefined (aka very bad) behavior, unless the
+ *          page map (MALLOC_PAGEMAP) is compiled in.
+ *          The chunk is always returned to the arena it was allocated from.
+ * @ptr: pointer to the memory block that was malloc()'ed.
+ */
+void free(void *ptr){
+	malloc_arena_t *arena;
+	malloc_chunk_t *target_chunk;
+	int kind;
+
+	MALLOC_PROBE(free, ptr);
+	if(ptr == NULL){
+		return;
+	}
+	
+	target_chunk = mem2chunk(ptr);
+	kind = chunk_kind(target_chunk, &arena, "free");
+
+	if(__builtin_expect(target_chunk->tag != 0, 0)){
+		tag_release(target_chunk);
+	}
+
+	if(kind == CHUNK_MMAPPED){
+		CHECK_CHUNK(target_chunk, "free");
+		munmap_chunk(target_chunk);
+		return;
+	}
+
+#ifdef MALLOC_GUARD
+	if(kind == CHUNK_GUARDED){
+		CHECK_CHUNK(target_chunk, "free");
+		guard_free(target_chunk);
+		return;
+	}
+#endif
+
+#ifdef MALLOC_PERCPU_RSEQ
+	// Small chunks go to this CPU's cache without locking. Headers can only be checked reliably under the
+	// lock, so anything that doesn't look right right now takes the locked path below and is checked there.
+	if(percpu_bins != NULL && target_chunk->used == true && CHUNK_USABLE(target_chunk) <= mparams.quick_max && mparams.quarantine_max == 0){
+#ifdef MALLOC_HARDENED
+		if(target_chunk->cksum == chunk_cksum(target_chunk) && !((uintptr_t) target_chunk & (BYTE_ALIGNMENT - 1)))
+#endif
+		{
+			target_chunk->used = CHUNK_PERCPU;
+			if(percpu_push(QUICK_INDEX(CHUNK_USABLE(target_chunk)), target_chunk)){
+				return;
+			}
+			target_chunk->used = true;
+		}
+	}
+#endif
+
+	arena_lock(arena);	
+
+	// Only under the lock, a neighbour being split or merged rewrites prev_size and reseals
+	CHECK_CHUNK(target_chunk, "free");
+
+#ifdef MALLOC_DETECT_DOUBLE_FREE
+	if(!target_chunk->used || target_chunk->used == CHUNK_QUICK || target_chunk->used == CHUNK_QUARANTINED || target_chunk->used == CHUNK_PERCPU){
+			fprintf(stderr, "ERROR in free(): double-free detected\n");
+			exit(1);
+			return;
+	}
+#endif
+
+	// Leftovers are still drained if the quarantine was switched off
+	if(mparams.quarantine_max > 0 || arena->quarantine_head != NULL){
+		quarantine_chunk(arena, target_chunk);
+	}
+	else {
+		free_chunk(arena, target_chunk);
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+
+	return;
+}
+
+/**
+ * free_chunk - Give a chunk of @arena back: park it on its quick list or put it on the free list,
+ *              merge it and trim the heap. Called with the arena lock held.
+ * @arena: arena owning @target_chunk
+ * @target_chunk: chunk being freed
+ */
+static void free_chunk(malloc_arena_t *arena, malloc_chunk_t *target_chunk){
+	// Small chunks are parked unmerged so the next request of the same size can take them straight back
+	if(CHUNK_USABLE(target_chunk) <= mparams.quick_max){
+		size_t idx = QUICK_INDEX(CHUNK_USABLE(target_chunk));
+
+		target_chunk->used = CHUNK_QUICK;
+		SET_QUICK_NEXT(target_chunk, arena->quick_bins[idx]);
+		arena->quick_bins[idx] = target_chunk;
+		arena->quick_bytes += target_chunk->size;
+		arena->allocated_bytes -= target_chunk->size;
+
+		if(arena->quick_bytes > mparams.quick_budget){
+			consolidate_quick(arena);
+		}
+		return;
+	}
+
+	target_chunk->used = false;
+	arena->allocated_bytes -= target_chunk->size;
+	link_chunk(arena, target_chunk);
+
+	merge_adjacent(arena, target_chunk);
+
+	shrink_brk(arena);
+}
+
+/**
+ * quarantine_chunk - Poison @target_chunk and queue it behind the chunks freed before it. The oldest
+ *                    chunks are released once the quarantine holds more than quarantine_max bytes,
+ *                    after checking that nothing wrote to them in the meantime. Called with the arena lock held.
+ * @arena: arena owning @target_chunk
+ * @target_chunk: chunk being freed
+ */
+static void quarantine_chunk(malloc_arena_t *arena, malloc_chunk_t *target_chunk){
+	malloc_chunk_t *old_chunk;
+	unsigned char *mem;
+	size_t usable, i;
+
+	memset(chunk2mem(target_chunk), QUARANTINE_POISON, CHUNK_USABLE(target_chunk));
+	target_chunk->used = CHUNK_QUARANTINED;
+	SET_QUICK_NEXT(target_chunk, NULL);
+	if(arena->quarantine_tail != NULL){
+		SET_QUICK_NEXT(arena->quarantine_tail, target_chunk);
+	}
+	else {
+		arena->quarantine_head = target_chunk;
+	}
+	arena->quarantine_tail = target_chunk;
+	arena->quarantine_bytes += target_chunk->size;
+	arena->allocated_bytes -= target_chunk->size;
+
+	while(arena->quarantine_bytes > mparams.quarantine_max){
+		old_chunk = arena->quarantine_head;
+		CHECK_CHUNK(old_chunk, "free");
+		arena->quarantine_head = QUICK_NEXT(old_chunk);
+		if(arena->quarantine_head == NULL){
+			arena->quarantine_tail = NULL;
+		}
+		arena->quarantine_bytes -= old_chunk->size;
+
+		mem = chunk2mem(old_chunk);
+		usable = CHUNK_USABLE(old_chunk);
+		for(i = 0; i < usable; i++){
+			if(mem[i] != QUARANTINE_POISON){
+				fprintf(stderr, "ERROR in free(): use after free detected, chunk %p (%lu bytes) was written at offset %lu\n",
+				        mem, (unsigned long) usable, (unsigned long) i);
+				abort();
+			}
+		}
+
+		// free_chunk() expects a chunk that is still accounted as handed out
+		old_chunk->used = true;
+		arena->allocated_bytes += old_chunk->size;
+		free_chunk(arena, old_chunk);
+	}
+}
+
+/**
+ * aligned_malloc - malloc() whose result is aligned to @alignment (a power of 2). Over allocates,
+ *                  then gives the unused space before and after the aligned chunk back.
+ * @alignment: required alignment of the returned memory
+ * @size: size of requested memmory in bytes
+ */
+static void *aligned_malloc(size_t alignment, size_t size){
+	malloc_arena_t *arena;
+	malloc_chunk_t *chunk;
+	malloc_chunk_t *aligned_chunk;
+	size_t lead, old_size;
+	char *mem;
+
+	if(alignment <= BYTE_ALIGNMENT){
+		return malloc(size);
+	}
+	if(size > MAX_REQUEST_SIZE || alignment > MAX_REQUEST_SIZE - size){
+		errno = ENOMEM;
+		return NULL;
+	}
+	if(size < MIN_MAL_SIZE){
+		size = MIN_MAL_SIZE;
+	}
+
+	// Room for a free chunk in front of the aligned one
+	if( (mem = malloc(size + alignment + MIN_CHUNK_SIZE)) == NULL){
+		return NULL;
+	}
+
+	chunk = mem2chunk(mem);
+	old_size = chunk->size;
+
+	if(chunk->used == CHUNK_MMAPPED || chunk->used == CHUNK_GUARDED){
+		if(chunk->used == CHUNK_GUARDED){
+			// The last aligned address that still ends at the guard page, the over allocation leaves room
+			mem = (char *) (((uintptr_t) chunk + chunk->size - ALIGN_UP(size, BYTE_ALIGNMENT)) & ~(alignment - 1));
+		}
+		else if(((uintptr_t) mem & (alignment - 1)) == 0){
+			return mem;
+		}
+		else {
+			mem = (char *) ALIGN_UP((uintptr_t) mem + MIN_CHUNK_SIZE, alignment);
+		}
+		// Just slide the header, the offset in the mapping records the lead
+		aligned_chunk = mem2chunk(mem);
+		lead = (char *) aligned_chunk - (char *) chunk;
+		aligned_chunk->prev_size = chunk->prev_size + lead;
+		aligned_chunk->size = chunk->size - lead;
+		aligned_chunk->used = chunk->used;
+		aligned_chunk->tag = chunk->tag;
+		SEAL_CHUNK(aligned_chunk);
+		tag_resize(aligned_chunk, old_size);
+		return mem;
+	}
+
+	arena = chunk_arena(chunk);
+	arena_lock(arena);
+
+	aligned_chunk = chunk;
+	if(((uintptr_t) mem & (alignment - 1)) != 0){
+		mem = (char *) ALIGN_UP((uintptr_t) mem + MIN_CHUNK_SIZE, alignment);
+		aligned_chunk = mem2chunk(mem);
+		lead = (char *) aligned_chunk - (char *) chunk;
+
+		aligned_chunk->prev_size = lead;
+		aligned_chunk->size = chunk->size - lead;
+		aligned_chunk->used = true;
+		aligned_chunk->tag = chunk->tag;
+		SEAL_CHUNK(aligned_chunk);
+		((malloc_chunk_t *) ((char *) aligned_chunk + aligned_chunk->size))->prev_size = aligned_chunk->size;
+		SEAL_CHUNK((malloc_chunk_t *) ((char *) aligned_chunk + aligned_chunk->size));
+
+		// The lead becomes a free chunk of its own
+		chunk->size = lead;
+		chunk->used = false;
+		SEAL_CHUNK(chunk);
+		arena->allocated_bytes -= lead;
+		link_chunk(arena, chunk);
+		merge_adjacent(arena, chunk);
+	}
+
+	// Aligned from the start or not, the tail past size is spare
+	if(aligned_chunk->size >= CALC_CHUNK_SIZE(size) + MIN_CHUNK_SIZE){
+		resize_chunk(arena, aligned_chunk, size);
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+	tag_resize(aligned_chunk, old_size);
+	return mem;
+}
+
+/**
+ * aligned_alloc - malloc() aligned to @alignment, which must be a power of 2. Unlike C11 @size
+ *                 doesn't have to be a multiple of @alignment. Also backs aligned operator new.
+ */
+void *aligned_alloc(size_t alignment, size_t size){
+	ensure_init();
+
+	if(alignment == 0 || (alignment & (alignment - 1))){
+		errno = EINVAL;
+		return NULL;
+	}
+	return aligned_malloc(alignment, size);
+}
+
+/**
+ * memalign - Like aligned_alloc() but, as in glibc, an @alignment that is not a power of 2 is rounded up to one.
+ */
+void *memalign(size_t alignment, size_t size){
+	ensure_init();
+
+	if(alignment > MAX_REQUEST_SIZE){
+		errno = EINVAL;
+		return NULL;
+	}
+	if(alignment & (alignment - 1)){
+		alignment = (size_t) 1 << (sizeof(size_t) * CHAR_BIT - __builtin_clzl(alignment));
+	}
+	return aligned_malloc(alignment, size);
+}
+
+/**
+ * posix_memalign - Store a pointer to @size bytes aligned to @alignment in @memptr. Returns EINVAL if
+ *                  @alignment is not a power of 2 multiple of sizeof(void *), ENOMEM if out of memory.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size){
+	void *mem;
+
+	ensure_init();
+
+	if(alignment < sizeof(void *) || (alignment & (alignment - 1))){
+		return EINVAL;
+	}
+	if( (mem = aligned_malloc(alignment, size)) == NULL){
+		return ENOMEM;
+	}
+	*memptr = mem;
+	return 0;
+}
+
+/**
+ * valloc - malloc() aligned to the page size.
+ */
+void *valloc(size_t size){
+	ensure_init();
+	return aligned_malloc(mparams.page_size, size);
+}
+
+/**
+ * pvalloc - valloc() of @size rounded up to whole pages.
+ */
+void *pvalloc(size_t size){
+	ensure_init();
+
+	if(size > MAX_REQUEST_SIZE){
+		errno = ENOMEM;
+		return NULL;
+	}
+	return aligned_malloc(mparams.page_size, ALIGN_UP(size, mparams.page_size));
+}
+
+/**
+ * malloc_usable_size - Bytes that can be used at @ptr, at least as many as were requested.
+ */
+size_t malloc_usable_size(void *ptr){
+#ifdef MALLOC_PAGEMAP
+	malloc_arena_t *arena;
+#endif
+
+	if(ptr == NULL){
+		return 0;
+	}
+#ifdef MALLOC_PAGEMAP
+	// Reports a pointer malloc() never returned instead of reading a header that isn't there
+	chunk_kind(mem2chunk(ptr), &arena, "malloc_usable_size");
+#endif
+	return CHUNK_USABLE(mem2chunk(ptr));
+}
+
+void *calloc(size_t nmemb, size_t size){
+	size_t tot_mem;
+	void *mem;
+	
+	if(__builtin_mul_overflow(nmemb, size, &tot_mem)){
+		errno = ENOMEM;
+		return NULL;
+	}
+	if(tot_mem < MIN_MAL_SIZE){
+		tot_mem = MIN_MAL_SIZE;
+	}
+	
+	if( (mem = malloc(tot_mem)) != NULL){
+		// A fresh anonymous mapping is already zero, clearing it would only fault every page in
+		if((mem2chunk(mem))->used != CHUNK_MMAPPED){
+			clear_large(mem, tot_mem);
+		}
+		return mem; 
+	}
+	else {
+		return NULL;
+	}
+}
+
+void *realloc(void *ptr, size_t size){
+	malloc_arena_t *arena;
+	malloc_chunk_t *target_chunk;
+	size_t new_chunk_size;
+	int kind;
+	
+	MALLOC_PROBE(realloc, ptr, size);
+	if(ptr == NULL){
+		return malloc(size);
+	}
+	
+	if(size == 0){
+		free(ptr);
+		return NULL;
+	}
+
+	if(size < MIN_MAL_SIZE){
+		size = MIN_MAL_SIZE;
+	}
+
+	if(size > MAX_REQUEST_SIZE){
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	target_chunk = mem2chunk(ptr);
+	kind = chunk_kind(target_chunk, &arena, "realloc");
+	new_chunk_size = CALC_CHUNK_SIZE(size);
+
+	// Every path below trusts size, as free() does only after checking it
+	if(kind == CHUNK_MMAPPED || kind == CHUNK_GUARDED){
+		CHECK_CHUNK(target_chunk, "realloc");
+	}
+	else {
+		check_heap_chunk(arena, target_chunk, "realloc");
+	}
+
+	if(kind == CHUNK_MMAPPED){
+		// Keep the mapping while the request still fits in it
+		if(target_chunk->size >= new_chunk_size){
+			return ptr;
+		}
+		// Grow it with mremap(), the pages move instead of being copied
+		void *new_mem = mremap_chunk(target_chunk, size);
+		if(new_mem != NULL){
+			return new_mem;
+		}
+	}
+#ifdef MALLOC_GUARD
+	else if(kind == CHUNK_GUARDED){
+		// Always move, the block has to end right at its guard page. Sample the replacement so it is guarded too.
+		guard_countdown = 1;
+	}
+#endif
+	else if(target_chunk->size >= (new_chunk_size + MIN_CHUNK_SIZE)){
+		// Shrink chunk and free extra space
+		size_t old_size = target_chunk->size;
+		void *ret;
+		arena_lock(arena);
+		CHECK_CHUNK(target_chunk, "realloc");
+		resize_chunk(arena, target_chunk, size);
+		ret =  chunk2mem(target_chunk);
+		pthread_mutex_unlock(&arena->lock);
+		tag_resize(target_chunk, old_size);
+		return ret;
+	}
+	else if(target_chunk->size >= new_chunk_size){
+		// Enough space in current chunk, do nothing
+		return chunk2mem(target_chunk);
+	}
+
+	// Need a new larger chunk, the block keeps its tag (or lack of one) whatever the thread's tag is
+	void *new_mem = mm_malloc_tagged(size, target_chunk->tag);
+
+	if(new_mem == NULL){
+		return NULL;
+	}
+		
+	// Only what the new block holds, a guarded chunk may be moved to a smaller one
+	copy_large(new_mem, ptr, (CHUNK_USABLE(target_chunk) < size) ? CHUNK_USABLE(target_chunk) : size);
+
+	free(ptr);
+
+	return new_mem;
+}
+
+/**
+ * tag_thread_exit - pthread key destructor, folds an exiting thread's tag counters into tag_exited
+ *                   and keeps them for the next thread.
+ */
+static void tag_thread_exit(void *arg){
+	tag_counters_t *counters = arg;
+	int tag;
+
+	pthread_mutex_lock(&tags_lock);
+	for(tag = 0; tag < MM_MAX_TAGS; tag++){
+		__atomic_add_fetch(&tag_exited.bytes[tag], counters->bytes[tag], __ATOMIC_RELAXED);
+		__atomic_add_fetch(&tag_exited.count[tag], counters->count[tag], __ATOMIC_RELAXED);
+		__atomic_add_fetch(&tag_exited.allocs[tag], counters->allocs[tag], __ATOMIC_RELAXED);
+	}
+	list_del(&counters->list);
+	list_add(&counters->list, &tag_spare);
+	pthread_mutex_unlock(&tags_lock);
+
+	thread_tag_counters = NULL;
+}
+
+static void tag_key_create(void){
+	pthread_key_create(&tag_key, tag_thread_exit);
+}
+
+/**
+ * tag_thread_init - Give the calling thread tag counters, spare ones if a thread left some behind.
+ *                   They are mapped rather than malloc()ed, this runs in the middle of malloc() and free().
+ *                   Returns NULL if out of memory.
+ */
+static tag_counters_t *tag_thread_init(void){
+	tag_counters_t *counters = NULL;
+
+	pthread_once(&tag_key_once, tag_key_create);
+
+	pthread_mutex_lock(&tags_lock);
+	if(!list_empty(&tag_spare)){
+		counters = list_entry(tag_spare.next, tag_counters_t, list);
+		list_del(&counters->list);
+	}
+	pthread_mutex_unlock(&tags_lock);
+
+	if(counters == NULL){
+		counters = mmap(NULL, sizeof(*counters), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(counters == MAP_FAILED){
+			return NULL;
+		}
+	}
+	memset(counters, 0, sizeof(*counters));
+
+	pthread_mutex_lock(&tags_lock);
+	list_add(&counters->list, &tag_threads);
+	pthread_mutex_unlock(&tags_lock);
+
+	thread_tag_counters = counters;
+	pthread_setspecific(tag_key, counters);
+	return counters;
+}
+
+/**
+ * tag_count - Add @bytes and @count (negative when freeing) to @tag's counters. Allocations
+ *             (@count > 0) also count towards the total. Plain stores to the calling thread's
+ *             own counters, readers only need them not to tear.
+ */
+static void tag_count(unsigned int tag, long bytes, long count){
+	tag_counters_t *counters = thread_tag_counters;
+
+	if(counters == NULL && (counters = tag_thread_init()) == NULL){
+		__atomic_add_fetch(&tag_exited.bytes[tag], bytes, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&tag_exited.count[tag], count, __ATOMIC_RELAXED);
+		if(count > 0){
+			__atomic_add_fetch(&tag_exited.allocs[tag], count, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+
+	__atomic_store_n(&counters->bytes[tag], counters->bytes[tag] + bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&counters->count[tag], counters->count[tag] + count, __ATOMIC_RELAXED);
+	if(count > 0){
+		__atomic_store_n(&counters->allocs[tag], counters->allocs[tag] + count, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * tag_charge - Charge @bytes to @tag's cap, if it has one. Returns false, charging nothing, if that would
+ *              take it over the cap. Uncapped tags cost a single load.
+ */
+static inline bool tag_charge(unsigned int tag, long bytes){
+	size_t limit = __atomic_load_n(&tag_limit[tag], __ATOMIC_RELAXED);
+
+	if(limit == 0){
+		return true;
+	}
+	if(__atomic_add_fetch(&tag_charged[tag], bytes, __ATOMIC_RELAXED) > (long) limit && bytes > 0){
+		__atomic_sub_fetch(&tag_charged[tag], bytes, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&tag_failed[tag], 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * malloc_tagged - malloc() of @size, already in bounds and aligned, on behalf of @tag (not 0).
+ *                 Returns NULL if out of memory or if @tag would go over its cap.
+ */
+static void *malloc_tagged(size_t size, unsigned int tag){
+	long charge = CALC_CHUNK_SIZE(size);
+	malloc_chunk_t *chunk;
+	void *mem;
+
+	if(!tag_charge(tag, charge)){
+		errno = ENOMEM;
+		return NULL;
+	}
+	if( (mem = malloc_sized(size, QUICK_INDEX(size))) == NULL){
+		tag_charge(tag, -charge);
+		return NULL;
+	}
+
+	// The chunk may be larger than asked for, mmap()ed ones always are
+	chunk = mem2chunk(mem);
+	chunk->tag = tag;
+	tag_charge(tag, (long) chunk->size - charge);
+	tag_count(tag, chunk->size, 1);
+	return mem;
+}
+
+/**
+ * tag_resize - Account for @chunk, if tagged, having changed size from @old_size. Shrinking
+ *              never fails and an aligned chunk is only a little off, so the cap isn't checked.
+ */
+static inline void tag_resize(malloc_chunk_t *chunk, size_t old_size){
+	unsigned int tag = chunk->tag;
+
+	if(tag != 0 && chunk->size != old_size){
+		tag_charge(tag, (long) chunk->size - (long) old_size);
+		tag_count(tag, (long) chunk->size - (long) old_size, 0);
+	}
+}
+
+/**
+ * tag_release - Uncount a tagged chunk that is being freed and clear its tag, a double free then
+ *               can't uncount it twice.
+ */
+static void tag_release(malloc_chunk_t *chunk){
+	unsigned int tag = chunk->tag;
+
+	chunk->tag = 0;
+	if(tag >= MM_MAX_TAGS){
+		return;
+	}
+	tag_charge(tag, -(long) chunk->size);
+	tag_count(tag, -(long) chunk->size, -1);
+}
+
+/**
+ * mm_malloc_tagged - malloc() on behalf of @tag, whatever the calling thread's tag is. The bytes count
+ *                    towards @tag until the block is freed, by any thread. Returns NULL if out of memory,
+ *                    if @tag is not below MM_MAX_TAGS or if it would take @tag over its cap.
+ * @size: size of requested memmory in bytes
+ * @tag: owner of the block, 0 for none
+ */
+void *mm_malloc_tagged(size_t size, unsigned int tag){
+	void *mem;
+
+	ensure_init();
+	MALLOC_PROBE(malloc, size);
+
+	if(size > MAX_REQUEST_SIZE || tag >= MM_MAX_TAGS){
+		errno = (tag >= MM_MAX_TAGS) ? EINVAL : ENOMEM;
+		return NULL;
+	}
+	if(size < MIN_MAL_SIZE){
+		size = MIN_MAL_SIZE;
+	}
+	size = ALIGN_UP(size, BYTE_ALIGNMENT);
+
+	if(tag != 0){
+		return malloc_tagged(size, tag);
+	}
+	if( (mem = malloc_sized(size, QUICK_INDEX(size))) != NULL){
+		(mem2chunk(mem))->tag = 0;
+	}
+	return mem;
+}
+
+/**
+ * mm_set_tag - Make @tag the calling thread's tag: every block it allocates from now on with malloc(),
+ *              calloc(), new or aligned allocations counts towards @tag. Regions and pools are charged
+ *              by the block or slab, to the tag of the thread that grows them, and slabs of meshable
+ *              pools not at all. realloc() keeps a block's own tag. Returns the previous tag, to be
+ *              restored when the scope ends. A tag not below MM_MAX_TAGS is ignored.
+ * @tag: new tag, 0 for none
+ */
+unsigned int mm_set_tag(unsigned int tag){
+	unsigned int prev = thread_tag;
+
+	if(tag < MM_MAX_TAGS){
+		thread_tag = tag;
+	}
+	return prev;
+}
+
+/**
+ * tag_sum - Add up @tag's counters over every thread. Called with tags_lock held.
+ */
+static void tag_sum(unsigned int tag, long *bytes, long *count, unsigned long *allocs){
+	tag_counters_t *counters;
+
+	*bytes = __atomic_load_n(&tag_exited.bytes[tag], __ATOMIC_RELAXED);
+	*count = __atomic_load_n(&tag_exited.count[tag], __ATOMIC_RELAXED);
+	*allocs = __atomic_load_n(&tag_exited.allocs[tag], __ATOMIC_RELAXED);
+	list_for_each_entry(counters, &tag_threads, list){
+		*bytes += __atomic_load_n(&counters->bytes[tag], __ATOMIC_RELAXED);
+		*count += __atomic_load_n(&counters->count[tag], __ATOMIC_RELAXED);
+		*allocs += __atomic_load_n(&counters->allocs[tag], __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * mm_set_tag_limit - Cap @tag at @bytes of live chunks (headers included), 0 removes the cap. Allocations
+ *                    that would go over it return NULL. The cap starts from the bytes @tag has now.
+ *                    Returns 0, or -1 if @tag is 0 or not below MM_MAX_TAGS.
+ * @tag: tag to cap
+ * @bytes: cap in bytes
+ */
+int mm_set_tag_limit(unsigned int tag, size_t bytes){
+	unsigned long allocs;
+	long live, count;
+
+	if(tag == 0 || tag >= MM_MAX_TAGS){
+		return -1;
+	}
+
+	pthread_mutex_lock(&tags_lock);
+	tag_sum(tag, &live, &count, &allocs);
+	__atomic_store_n(&tag_charged[tag], live, __ATOMIC_RELAXED);
+	__atomic_store_n(&tag_limit[tag], bytes, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&tags_lock);
+	return 0;
+}
+
+/**
+ * mm_get_tag_stats - Fill @stats with a snapshot of @tag's counters, added up over all threads.
+ *                    Returns 0, or -1 if @tag is not below MM_MAX_TAGS.
+ * @tag: tag to report
+ * @stats: filled in on return
+ */
+int mm_get_tag_stats(unsigned int tag, struct mm_tag_stats *stats){
+	unsigned long allocs;
+	long bytes, count;
+
+	if(tag >= MM_MAX_TAGS){
+		return -1;
+	}
+
+	pthread_mutex_lock(&tags_lock);
+	tag_sum(tag, &bytes, &count, &allocs);
+	pthread_mutex_unlock(&tags_lock);
+
+	// A reader can catch a free() counted before the malloc() on another thread is
+	stats->live_bytes = (bytes > 0) ? bytes : 0;
+	stats->live_count = (count > 0) ? count : 0;
+	stats->total_count = allocs;
+	stats->limit = __atomic_load_n(&tag_limit[tag], __ATOMIC_RELAXED);
+	stats->failed = __atomic_load_n(&tag_failed[tag], __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * mm_region_create - Create an empty region. Memory is taken from the heap in blocks of
+ *                    @block_size bytes (REGION_BLOCK_SIZE if 0) as the region fills up.
+ *                    Returns NULL if out of memory.
+ * @block_size: size of the blocks the region allocates from
+ */
+mm_region_t *mm_region_create(size_t block_size){
+	mm_region_t *region;
+
+	if( (region = malloc(sizeof(*region))) == NULL){
+		return NULL;
+	}
+
+	region->blocks = NULL;
+	region->large = NULL;
+	region->cur = NULL;
+	region->end = NULL;
+	region->block_size = (block_size != 0) ? block_size : REGION_BLOCK_SIZE;
+	region->allocated_bytes = 0;
+	__atomic_add_fetch(&region_count, 1, __ATOMIC_RELAXED);
+
+	return region;
+}
+
+/**
+ * mm_region_alloc - Bump allocate @size bytes from @region. The memory stays valid until the region
+ *                   is reset or destroyed, it must not be passed to free(). Returns NULL if out of memory.
+ *                   Like malloc(), a request for 0 bytes returns a unique pointer.
+ * @region: region to allocate from
+ * @size: size of requested memmory in bytes
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size){
+	mm_region_block_t *block;
+	size_t block_size;
+	void *mem;
+
+	if(size > MAX_REQUEST_SIZE){
+		return NULL;
+	}
+	size = ALIGN_UP((size != 0) ? size : 1, BYTE_ALIGNMENT);
+
+	if(size > (size_t) (region->end - region->cur)){
+		block_size = REGION_BLOCK_HDR + size;
+		if(block_size < region->block_size){
+			block_size = region->block_size;
+		}
+
+		if( (block = malloc(block_size)) == NULL){
+			return NULL;
+		}
+		block->size = block_size;
+		__atomic_add_fetch(&region_bytes, block_size, __ATOMIC_RELAXED);
+
+		if(block_size > region->block_size){
+			// Oversized request, give it a block of its own that the next reset frees
+			block->next = region->large;
+			region->large = block;
+			region->allocated_bytes += size;
+			__atomic_add_fetch(&region_allocated_bytes, size, __ATOMIC_RELAXED);
+			return (char *) block + REGION_BLOCK_HDR;
+		}
+
+		block->next = region->blocks;
+		region->blocks = block;
+		region->cur = (char *) block + REGION_BLOCK_HDR;
+		region->end = (char *) block + block_size;
+	}
+
+	mem = region->cur;
+	region->cur += size;
+	region->allocated_bytes += size;
+	__atomic_add_fetch(&region_allocated_bytes, size, __ATOMIC_RELAXED);
+
+	return mem;
+}
+
+/**
+ * region_free_blocks - Give the blocks on the list starting at @block back to the heap.
+ */
+static void region_free_blocks(mm_region_block_t *block){
+	mm_region_block_t *next_block;
+
+	for(; block != NULL; block = next_block){
+		next_block = block->next;
+		__atomic_sub_fetch(&region_bytes, block->size, __ATOMIC_RELAXED);
+		free(block);
+	}
+}
+
+/**
+ * mm_region_reset - Release everything allocated from @region at once. The newest regular block is
+ *                   kept so a region reused per request doesn't go back to the heap every time.
+ * @region: region to reset
+ */
+void mm_region_reset(mm_region_t *region){
+	mm_region_block_t *block;
+
+	region_free_blocks(region->large);
+	region->large = NULL;
+	__atomic_sub_fetch(&region_allocated_bytes, region->allocated_bytes, __ATOMIC_RELAXED);
+	region->allocated_bytes = 0;
+
+	if(region->blocks == NULL){
+		return;
+	}
+
+	region_free_blocks(region->blocks->next);
+	block = region->blocks;
+	block->next = NULL;
+	region->cur = (char *) block + REGION_BLOCK_HDR;
+	region->end = (char *) block + block->size;
+}
+
+/**
+ * mm_region_destroy - Release everything allocated from @region and the region itself.
+ * @region: region to destroy
+ */
+void mm_region_destroy(mm_region_t *region){
+	if(region == NULL){
+		return;
+	}
+
+	mm_region_reset(region);
+	if(region->blocks != NULL){
+		__atomic_sub_fetch(&region_bytes, region->blocks->size, __ATOMIC_RELAXED);
+		free(region->blocks);
+	}
+	__atomic_sub_fetch(&region_count, 1, __ATOMIC_RELAXED);
+	free(region);
+}
+
+/**
+ * arena_stats - Add @arena's counters to @stats.
+ */
+static void arena_stats(malloc_arena_t *arena, struct mm_stats *stats){
+	pthread_mutex_lock(&arena->lock);
+	stats->heap_bytes += arena->heap_bytes;
+	stats->allocated_bytes += arena->allocated_bytes;
+	stats->quick_bytes += arena->quick_bytes;
+	stats->quarantine_bytes += arena->quarantine_bytes;
+	stats->free_bytes += arena->heap_bytes - arena->allocated_bytes - arena->quick_bytes - arena->quarantine_bytes;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+#ifdef MALLOC_PROFILE
+/**
+ * mm_get_profile - Copy the slow path cycle histograms into @prof.
+ * @prof: filled in on return
+ */
+void mm_get_profile(struct mm_profile *prof){
+	int path, bucket;
+
+	for(path = 0; path < MM_PROF_NPATHS; path++){
+		for(bucket = 0; bucket < MM_PROF_BUCKETS; bucket++){
+			prof->count[path][bucket] = __atomic_load_n(&profile.count[path][bucket], __ATOMIC_RELAXED);
+		}
+	}
+}
+#endif
+
+/**
+ * mm_get_stats - Fill @stats with a snapshot of the allocator's counters.
+ * @stats: filled in on return
+ */
+void mm_get_stats(struct mm_stats *stats){
+	memset(stats, 0, sizeof(*stats));
+
+	arena_stats(&main_arena, stats);
+#ifdef MALLOC_NUMA
+	int i;
+	for(i = 0; i < numa_nodes; i++){
+		arena_stats(&numa_arenas[i], stats);
+	}
+#endif
+
+	stats->mmapped_bytes = __atomic_load_n(&mmapped_bytes, __ATOMIC_RELAXED);
+	stats->region_count = __atomic_load_n(&region_count, __ATOMIC_RELAXED);
+	stats->region_bytes = __atomic_load_n(&region_bytes, __ATOMIC_RELAXED);
+	stats->region_allocated_bytes = __atomic_load_n(&region_allocated_bytes, __ATOMIC_RELAXED);
+	stats->pool_count = __atomic_load_n(&pool_count, __ATOMIC_RELAXED);
+	stats->pool_bytes = __atomic_load_n(&pool_bytes, __ATOMIC_RELAXED);
+	stats->purged_bytes = __atomic_load_n(&purged_bytes, __ATOMIC_RELAXED);
+	stats->meshed_bytes = __atomic_load_n(&meshed_bytes, __ATOMIC_RELAXED);
+	stats->footprint_bytes = __atomic_load_n(&heap_footprint, __ATOMIC_RELAXED) + stats->mmapped_bytes;
+	stats->pressure_count = __atomic_load_n(&pressure_count, __ATOMIC_RELAXED);
+
+#ifdef MALLOC_PERCPU_RSEQ
+	if(percpu_bins != NULL){
+		size_t cpu, idx;
+
+		// Every chunk in bin idx has the same size
+		for(cpu = 0; cpu < percpu_ncpus; cpu++){
+			for(idx = 0; idx < NQUICK_BINS; idx++){
+				stats->percpu_bytes += (__atomic_load_n(&percpu_bins[cpu * NQUICK_BINS + idx].count, __ATOMIC_RELAXED) & ~PERCPU_DRAINING) * CALC_CHUNK_SIZE(idx << mparams.align_shift);
+			}
+		}
+	}
+#endif
+}
+
+/**
+ * mesh_segv - SIGSEGV handler installed by mesh_init(). A write to a slab that is being meshed waits
+ *             for the remap and is then retried, anything else goes to the handler that was there before.
+ */
+static void mesh_segv(int sig, siginfo_t *info, void *ctx){
+	char *addr = info->si_addr;
+
+	if(addr >= __atomic_load_n(&mesh_fault_lo, __ATOMIC_ACQUIRE) && addr < __atomic_load_n(&mesh_fault_hi, __ATOMIC_ACQUIRE)){
+		while(__atomic_load_n(&mesh_busy, __ATOMIC_ACQUIRE)){
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#endif
+		}
+		return;
+	}
+
+	if(mesh.old_segv.sa_flags & SA_SIGINFO){
+		mesh.old_segv.sa_sigaction(sig, info, ctx);
+	}
+	else if(mesh.old_segv.sa_handler == SIG_DFL || mesh.old_segv.sa_handler == SIG_IGN){
+		// Returning re-runs the faulting access, which now gets the default action
+		signal(SIGSEGV, SIG_DFL);
+	}
+	else {
+		mesh.old_segv.sa_handler(sig);
+	}
+}
+
+/**
+ * mesh_init - Set up the mesh region and the SIGSEGV handler on first use. Returns false if that failed,
+ *             pools then just take their slabs from the heap.
+ */
+static bool mesh_init(void){
+	struct sigaction sa;
+	bool ok;
+
+	pthread_mutex_lock(&mesh.lock);
+	if(mesh.fd < 0 && (mesh.fd = memfd_create("mymalloc-mesh", MFD_CLOEXEC)) >= 0){
+		mesh.base = mmap(NULL, MESH_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(mesh.base == MAP_FAILED || ftruncate(mesh.fd, MESH_RESERVE) != 0){
+			if(mesh.base != MAP_FAILED){
+				munmap(mesh.base, MESH_RESERVE);
+			}
+			close(mesh.fd);
+			mesh.fd = -1;
+		}
+		else {
+			mesh.brk = mesh.base;
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_sigaction = mesh_segv;
+			sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+			sigemptyset(&sa.sa_mask);
+			sigaction(SIGSEGV, &sa, &mesh.old_segv);
+		}
+	}
+	ok = (mesh.fd >= 0);
+	pthread_mutex_unlock(&mesh.lock);
+
+	return ok;
+}
+
+/**
+ * mesh_alloc_span - Map @size bytes (a power of 2) of the mesh region, aligned to @size, onto their own
+ *                   part of the memfd. Returns NULL if the region is exhausted.
+ */
+static void *mesh_alloc_span(size_t size){
+	struct mesh_hole **pos;
+	struct mesh_hole *hole;
+	char *addr = NULL;
+
+	pthread_mutex_lock(&mesh.lock);
+	for(pos = &mesh.holes; *pos != NULL; pos = &(*pos)->next){
+		if((*pos)->size == size){
+			hole = *pos;
+			*pos = hole->next;
+			addr = hole->addr;
+			free(hole);
+			break;
+		}
+	}
+	if(addr == NULL){
+		addr = (char *) ALIGN_UP((uintptr_t) mesh.brk, size);
+		if(addr + size > mesh.base + MESH_RESERVE){
+			pthread_mutex_unlock(&mesh.lock);
+			return NULL;
+		}
+		mesh.brk = addr + size;
+	}
+	if(mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mesh.fd, addr - mesh.base) == MAP_FAILED){
+		addr = NULL;
+	}
+	pthread_mutex_unlock(&mesh.lock);
+
+	return addr;
+}
+
+/**
+ * mesh_free_span - Give the memory behind a span of the mesh region back and keep the address range
+ *                  for reuse. Called with mesh.lock held.
+ */
+static void mesh_free_span(void *addr, size_t size){
+	struct mesh_hole *hole;
+
+	mmap(addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+	fallocate(mesh.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (char *) addr - mesh.base, size);
+	if((char *) addr == mesh_fault_lo){
+		mesh_fault_lo = mesh_fault_hi = NULL;
+	}
+	// Out of memory just leaks the address range
+	budget_hold++;
+	hole = malloc(sizeof(*hole));
+	budget_hold--;
+	if(hole != NULL){
+		hole->addr = addr;
+		hole->size = size;
+		hole->next = mesh.holes;
+		mesh.holes = hole;
+	}
+}
+
+/**
+ * pool_new_slab - Take a slab for @pool from the heap and construct every object in it.
+ *                 Called with the pool locked. Returns NULL if out of memory.
+ */
+static mm_pool_slab_t *pool_new_slab(mm_pool_t *pool){
+	mm_pool_slab_t *slab;
+	unsigned int i;
+
+	budget_hold++;
+	slab = pool->meshable ? mesh_alloc_span(pool->slab_size) : aligned_malloc(pool->slab_size, pool->slab_size);
+	budget_hold--;
+	if(slab == NULL){
+		return NULL;
+	}
+	__atomic_add_fetch(&pool_bytes, pool->slab_size, __ATOMIC_RELAXED);
+
+	slab->pool = pool;
+	slab->self = slab;
+	slab->naliases = 0;
+	slab->nfree = pool->objs_per_slab;
+	for(i = 0; i < pool->objs_per_slab; i++){
+		// Highest index on the bottom so objects are handed out in address order
+		slab->free_idx[i] = pool->objs_per_slab - 1 - i;
+		if(pool->ctor != NULL){
+			pool->ctor((char *) slab + pool->obj_offset + i * pool->obj_size);
+		}
+	}
+
+	return slab;
+}
+
+/**
+ * pool_release_slab - Destruct every object of an empty @slab and give it back to the heap.
+ *                     Called with the pool locked and @slab off all lists.
+ */
+static void pool_release_slab(mm_pool_t *pool, mm_pool_slab_t *slab){
+	unsigned int i;
+
+	if(pool->dtor != NULL){
+		for(i = 0; i < slab->nfree; i++){
+			pool->dtor((char *) slab + pool->obj_offset + slab->free_idx[i] * pool->obj_size);
+		}
+	}
+	__atomic_sub_fetch(&pool_bytes, pool->slab_size, __ATOMIC_RELAXED);
+
+	if(!pool->meshable){
+		free(slab);
+		return;
+	}
+	pthread_mutex_lock(&mesh.lock);
+	for(i = 0; i < slab->naliases; i++){
+		mesh_free_span(slab->aliases[i], pool->slab_size);
+	}
+	mesh_free_span(slab, pool->slab_size);
+	pthread_mutex_unlock(&mesh.lock);
+}
+
+/**
+ * pool_get_obj - Take one constructed object from @pool's slabs. Called with the pool locked.
+ */
+static void *pool_get_obj(mm_pool_t *pool){
+	mm_pool_slab_t *slab;
+
+	if(!list_empty(&pool->partial)){
+		slab = list_first_entry(&pool->partial, mm_pool_slab_t, list);
+	}
+	else if(!list_empty(&pool->empty)){
+		slab = list_first_entry(&pool->empty, mm_pool_slab_t, list);
+		pool->nempty--;
+		list_move(&slab->list, &pool->partial);
+	}
+	else if( (slab = pool_new_slab(pool)) != NULL){
+		list_add(&slab->list, &pool->partial);
+	}
+	else {
+		return NULL;
+	}
+
+	if(--slab->nfree == 0){
+		list_move(&slab->list, &pool->full);
+	}
+	return (char *) slab + pool->obj_offset + slab->free_idx[slab->nfree] * pool->obj_size;
+}
+
+/**
+ * pool_put_obj - Return @obj to its slab. Empty slabs past POOL_KEEP_EMPTY go back to the heap.
+ *                Called with the pool locked.
+ */
+static void pool_put_obj(mm_pool_t *pool, void *obj){
+	char *view = (char *) ((uintptr_t) obj & ~(pool->slab_size - 1));
+	mm_pool_slab_t *slab = ((mm_pool_slab_t *) view)->self;
+
+	// Meshed slabs share one header, which only knows the address of the slab it was created for
+	slab->free_idx[slab->nfree++] = ((char *) obj - view - pool->obj_offset) / pool->obj_size;
+
+	if(slab->nfree == pool->objs_per_slab){
+		if(pool->nempty >= POOL_KEEP_EMPTY){
+			list_del(&slab->list);
+			pool_release_slab(pool, slab);
+			return;
+		}
+		list_move(&slab->list, &pool->empty);
+		pool->nempty++;
+	}
+	else if(slab->nfree == 1){
+		list_move(&slab->list, &pool->partial);
+	}
+}
+
+/**
+ * pool_flush_mag - Move @count objects from the top of @mag back to the slabs. Called with the pool locked.
+ */
+static void pool_flush_mag(mm_pool_t *pool, mm_pool_mag_t *mag, unsigned int count){
+	while(count-- > 0 && mag->count > 0){
+		pool_put_obj(pool, mag->objs[--mag->count]);
+	}
+	if(mag->low_water > mag->count){
+		mag->low_water = mag->count;
+	}
+}
+
+/**
+ * pool_scavenge_mag - Every POOL_SCAVENGE_TICKS operations, give half of the objects that sat unused
+ *                     in @mag since the last scavenge (its low water mark) back to the slabs, so a thread
+ *                     that stops using a pool doesn't hoard its objects. Everything goes back after a
+ *                     mm_release_free_memory(). Only called by @mag's own thread.
+ */
+static void pool_scavenge_mag(mm_pool_t *pool, mm_pool_mag_t *mag){
+	unsigned int gen = __atomic_load_n(&release_gen, __ATOMIC_RELAXED);
+	unsigned int count;
+	unsigned int i;
+
+	if(gen != mag->release_gen){
+		mag->release_gen = gen;
+		count = mag->count;
+	}
+	else {
+		count = (mag->low_water + 1) / 2;
+	}
+
+	if(count > 0){
+		// The bottom of the magazine is what went unused, keep the recently freed (cache hot) top
+		pthread_mutex_lock(&pool->lock);
+		for(i = 0; i < count; i++){
+			pool_put_obj(pool, mag->objs[i]);
+		}
+		pthread_mutex_unlock(&pool->lock);
+		mag->count -= count;
+		memmove(mag->objs, mag->objs + count, mag->count * sizeof(mag->objs[0]));
+	}
+	mag->low_water = mag->count;
+	mag->ticks = 0;
+}
+
+/**
+ * pool_thread_exit - pthread key destructor, hands an exiting thread's cached objects back.
+ */
+static void pool_thread_exit(void *arg){
+	mm_pool_mag_t **mags = arg;
+	mm_pool_mag_t *mag;
+	int i;
+
+	for(i = 0; i < MAX_POOLS; i++){
+		if( (mag = mags[i]) == NULL){
+			continue;
+		}
+		if(mag->pool != NULL){
+			pthread_mutex_lock(&mag->pool->lock);
+			pool_flush_mag(mag->pool, mag, mag->count);
+			list_del(&mag->list);
+			pthread_mutex_unlock(&mag->pool->lock);
+		}
+		free(mag);
+	}
+	free(mags);
+	thread_mags = NULL;
+}
+
+/**
+ * pool_thread_mag - Calling thread's magazine for @pool, created on first use. NULL if out of memory.
+ */
+static mm_pool_mag_t *pool_thread_mag(mm_pool_t *pool){
+	mm_pool_mag_t *mag;
+
+	if(thread_mags == NULL){
+		if( (thread_mags = calloc(MAX_POOLS, sizeof(*thread_mags))) == NULL){
+			return NULL;
+		}
+		pthread_setspecific(pool_key, thread_mags);
+	}
+
+	mag = thread_mags[pool->id];
+	if(mag != NULL && mag->pool == pool){
+		return mag;
+	}
+
+	// First use, or the magazine was left behind by a destroyed pool with the same id
+	if(mag == NULL && (mag = malloc(sizeof(*mag))) == NULL){
+		return NULL;
+	}
+	thread_mags[pool->id] = mag;
+	mag->count = 0;
+	mag->low_water = 0;
+	mag->ticks = 0;
+	mag->release_gen = __atomic_load_n(&release_gen, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&pool->lock);
+	mag->pool = pool;
+	list_add(&mag->list, &pool->mags);
+	pthread_mutex_unlock(&pool->lock);
+
+	return mag;
+}
+
+/**
+ * mm_pool_create - Create a pool of @obj_size byte objects aligned to @align (0 for the default).
+ *                  @ctor runs once when an object's slab is created and @dtor once when the slab is
+ *                  given back, not on every alloc/free, so objects must be freed in their constructed
+ *                  state. Either may be NULL. Returns NULL if out of memory or out of pool ids.
+ * @obj_size: size of an object
+ * @align: alignment of an object (a power of 2)
+ * @ctor: object constructor
+ * @dtor: object destructor
+ */
+mm_pool_t *mm_pool_create(size_t obj_size, size_t align, void (*ctor)(void *), void (*dtor)(void *)){
+	mm_pool_t *pool;
+	size_t slab_size;
+	unsigned int i;
+
+	ensure_init();
+
+	if(align == 0){
+		align = BYTE_ALIGNMENT;
+	}
+	if((align & (align - 1)) || obj_size == 0 || obj_size > MAX_REQUEST_SIZE / 16){
+		return NULL;
+	}
+
+	if( (pool = malloc(sizeof(*pool))) == NULL){
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pools_lock);
+	if(!pool_key_created){
+		if(pthread_key_create(&pool_key, pool_thread_exit) != 0){
+			pthread_mutex_unlock(&pools_lock);
+			free(pool);
+			return NULL;
+		}
+		pool_key_created = true;
+	}
+	for(i = 0; i < MAX_POOLS && pool_table[i] != NULL; i++);
+	if(i == MAX_POOLS){
+		pthread_mutex_unlock(&pools_lock);
+		free(pool);
+		return NULL;
+	}
+	pool_table[i] = pool;
+	pool->id = i;
+	pthread_mutex_unlock(&pools_lock);
+
+	pool->obj_size = ALIGN_UP(obj_size, align);
+
+	// At least 8 objects per slab
+	for(slab_size = POOL_MIN_SLAB_SIZE; slab_size < 8 * (pool->obj_size + sizeof(unsigned short)) + sizeof(mm_pool_slab_t) + align; slab_size *= 2);
+
+	pool->slab_size = slab_size;
+	pool->objs_per_slab = (slab_size - sizeof(mm_pool_slab_t) - align) / (pool->obj_size + sizeof(unsigned short));
+	if(pool->objs_per_slab > USHRT_MAX){
+		pool->objs_per_slab = USHRT_MAX;
+	}
+	pool->obj_offset = ALIGN_UP(sizeof(mm_pool_slab_t) + pool->objs_per_slab * sizeof(unsigned short), align);
+	pool->ctor = ctor;
+	pool->dtor = dtor;
+	pthread_mutex_init(&pool->lock, NULL);
+	INIT_LIST_HEAD(&pool->partial);
+	INIT_LIST_HEAD(&pool->full);
+	INIT_LIST_HEAD(&pool->empty);
+	INIT_LIST_HEAD(&pool->mags);
+	pool->nempty = 0;
+	pool->meshable = mparams.mesh && mesh_init();
+	__atomic_add_fetch(&pool_count, 1, __ATOMIC_RELAXED);
+
+	return pool;
+}
+
+/**
+ * mm_pool_alloc - Get a constructed object from @pool. Served from the calling thread's magazine
+ *                 without locking when possible. Returns NULL if out of memory.
+ * @pool: pool to allocate from
+ */
+void *mm_pool_alloc(mm_pool_t *pool){
+	mm_pool_mag_t *mag = pool_thread_mag(pool);
+	void *obj;
+
+	if(mag != NULL && mag->count > 0){
+		obj = mag->objs[--mag->count];
+		if(mag->count < mag->low_water){
+			mag->low_water = mag->count;
+		}
+		if(++mag->ticks >= POOL_SCAVENGE_TICKS){
+			pool_scavenge_mag(pool, mag);
+		}
+		return obj;
+	}
+
+	// Refill half a magazine at once so the next allocations stay lock free
+	pthread_mutex_lock(&pool->lock);
+	obj = pool_get_obj(pool);
+	while(mag != NULL && obj != NULL && mag->count < POOL_MAG_SIZE / 2){
+		void *extra = pool_get_obj(pool);
+		if(extra == NULL){
+			break;
+		}
+		mag->objs[mag->count++] = extra;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return obj;
+}
+
+/**
+ * mm_pool_free - Give @obj back to @pool, in its constructed state.
+ * @pool: pool @obj was allocated from
+ * @obj: object to free
+ */
+void mm_pool_free(mm_pool_t *pool, void *obj){
+	mm_pool_mag_t *mag;
+
+	if(obj == NULL){
+		return;
+	}
+
+	mag = pool_thread_mag(pool);
+	if(mag != NULL && mag->count < POOL_MAG_SIZE){
+		mag->objs[mag->count++] = obj;
+		if(++mag->ticks >= POOL_SCAVENGE_TICKS){
+			pool_scavenge_mag(pool, mag);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if(mag != NULL){
+		pool_flush_mag(pool, mag, POOL_MAG_SIZE / 2);
+		mag->objs[mag->count++] = obj;
+	}
+	else {
+		pool_put_obj(pool, obj);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * mm_pool_shrink - Hand the calling thread's cached objects back and release every empty slab.
+ *                  Use when the pool goes idle.
+ * @pool: pool to shrink
+ */
+void mm_pool_shrink(mm_pool_t *pool){
+	mm_pool_mag_t *mag = pool_thread_mag(pool);
+	mm_pool_slab_t *slab;
+	mm_pool_slab_t *next_slab;
+
+	pthread_mutex_lock(&pool->lock);
+	if(mag != NULL){
+		pool_flush_mag(pool, mag, mag->count);
+	}
+	list_for_each_entry_safe(slab, next_slab, &pool->empty, list){
+		list_del(&slab->list);
+		pool_release_slab(pool, slab);
+	}
+	pool->nempty = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * mesh_segv_installed - True if mesh_segv() is still the SIGSEGV handler. The application may have
+ *                       replaced it since mesh_init(), and without it a write during a remap would crash.
+ */
+static bool mesh_segv_installed(void){
+	struct sigaction cur;
+
+	return sigaction(SIGSEGV, NULL, &cur) == 0 && (cur.sa_flags & SA_SIGINFO) && cur.sa_sigaction == mesh_segv;
+}
+
+/**
+ * mesh_slabs - Move the live objects of slab @b into the same slots of slab @a and point @b's addresses
+ *              at @a's memory, so @b's memory can be given back. Objects keep their addresses. Called
+ *              with the pool and mesh.lock held. Returns false if @b couldn't be remapped, or mesh_segv()
+ *              isn't there to hold up its writers.
+ * @live_a: bitmap of @a's live slots, @b's are added on success
+ * @live_b: bitmap of @b's live slots, disjoint from @live_a
+ */
+static bool mesh_slabs(mm_pool_t *pool, mm_pool_slab_t *a, mm_pool_slab_t *b, uint64_t *live_a, const uint64_t *live_b){
+	size_t words = (pool->objs_per_slab + 63) / 64;
+	unsigned int k;
+
+#define SLOT(slab, k) ((char *) (slab) + pool->obj_offset + (size_t) (k) * pool->obj_size)
+#define LIVE(map, k) ((map)[(k) / 64] & (1ULL << ((k) % 64)))
+
+	if(!mesh_segv_installed()){
+		return false;
+	}
+
+	// @b's free objects go away with its memory and @a's free ones are overwritten where @b's live ones land.
+	// Both are only reachable through the slab free lists, which nobody else can touch right now.
+	if(pool->dtor != NULL){
+		for(k = 0; k < pool->objs_per_slab; k++){
+			pool->dtor(LIVE(live_b, k) ? SLOT(a, k) : SLOT(b, k));
+		}
+	}
+
+	// @b's header is about to become @a's
+	list_del(&b->list);
+
+	// Writers of @b's live objects fault and wait in mesh_segv() until @b maps @a's memory
+	__atomic_store_n(&mesh_fault_lo, (char *) b, __ATOMIC_RELEASE);
+	__atomic_store_n(&mesh_fault_hi, (char *) b + pool->slab_size, __ATOMIC_RELEASE);
+	__atomic_store_n(&mesh_busy, true, __ATOMIC_RELEASE);
+
+	if(mprotect(b, pool->slab_size, PROT_READ) == 0){
+		for(k = 0; k < pool->objs_per_slab; k++){
+			if(LIVE(live_b, k)){
+				memcpy(SLOT(a, k), SLOT(b, k), pool->obj_size);
+			}
+		}
+		if(mmap(b, pool->slab_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mesh.fd, (char *) a - mesh.base) != MAP_FAILED){
+			__atomic_store_n(&mesh_busy, false, __ATOMIC_RELEASE);
+			fallocate(mesh.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (char *) b - mesh.base, pool->slab_size);
+
+			a->aliases[a->naliases++] = b;
+			for(k = 0; k < words; k++){
+				live_a[k] |= live_b[k];
+			}
+			// Rebuild @a's free stack so low slots are handed out first, like a new slab
+			a->nfree = 0;
+			for(k = pool->objs_per_slab; k-- > 0; ){
+				if(!LIVE(live_a, k)){
+					a->free_idx[a->nfree++] = k;
+				}
+			}
+			if(a->nfree == 0){
+				list_move(&a->list, &pool->full);
+			}
+			return true;
+		}
+		mprotect(b, pool->slab_size, PROT_READ | PROT_WRITE);
+	}
+	__atomic_store_n(&mesh_busy, false, __ATOMIC_RELEASE);
+	list_add(&b->list, &pool->partial);
+
+	// Put back what the destructors took apart
+	if(pool->ctor != NULL){
+		for(k = 0; k < pool->objs_per_slab; k++){
+			pool->ctor(LIVE(live_b, k) ? SLOT(a, k) : SLOT(b, k));
+		}
+	}
+	return false;
+
+#undef SLOT
+#undef LIVE
+}
+
+/**
+ * mm_pool_mesh - Compact a pool created with MYMALLOC_CONF mesh:1. Partial slabs whose live objects
+ *                sit in different slots are merged onto the memory of one of them and the other's memory
+ *                is given back, without moving any object. Threads writing to a slab while it is merged
+ *                are held up until it is done, but a system call writing into it (read() into a pool
+ *                object, say) isn't and fails with EFAULT. Nothing is merged once the application has
+ *                replaced the SIGSEGV handler. Returns the number of bytes given back.
+ * @pool: pool to compact
+ */
+size_t mm_pool_mesh(mm_pool_t *pool){
+	mm_pool_slab_t *cand[MESH_MAX_CANDIDATES];
+	mm_pool_slab_t *slab;
+	uint64_t *live;
+	size_t words = (pool->objs_per_slab + 63) / 64;
+	size_t released = 0;
+	unsigned int n = 0, i, j, k;
+
+	if(!pool->meshable){
+		return 0;
+	}
+
+	// Before the pool lock and held, relieving the budget would take it, and mm_release_free_memory()'s pools_lock
+	budget_hold++;
+	live = calloc(MESH_MAX_CANDIDATES * words, sizeof(*live));
+	budget_hold--;
+	if(live == NULL){
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	list_for_each_entry(slab, &pool->partial, list){
+		if(n == MESH_MAX_CANDIDATES){
+			break;
+		}
+		cand[n++] = slab;
+	}
+	if(n < 2){
+		pthread_mutex_unlock(&pool->lock);
+		free(live);
+		return 0;
+	}
+
+	// Everything not on a slab's free stack is live, objects in the magazines included
+	for(i = 0; i < n; i++){
+		for(k = 0; k < pool->objs_per_slab; k++){
+			live[i * words + k / 64] |= 1ULL << (k % 64);
+		}
+		for(k = 0; k < cand[i]->nfree; k++){
+			live[i * words + cand[i]->free_idx[k] / 64] &= ~(1ULL << (cand[i]->free_idx[k] % 64));
+		}
+	}
+
+	// Greedy pairing: merge every later slab that fits into the first one it doesn't collide with
+	pthread_mutex_lock(&mesh.lock);
+	for(i = 0; i < n; i++){
+		for(j = i + 1; j < n && cand[i] != NULL && cand[i]->naliases < MESH_MAX_ALIASES; j++){
+			if(cand[j] == NULL || cand[j]->naliases != 0){
+				continue;
+			}
+			for(k = 0; k < words && !(live[i * words + k] & live[j * words + k]); k++);
+			if(k == words && mesh_slabs(pool, cand[i], cand[j], &live[i * words], &live[j * words])){
+				cand[j] = NULL;
+				released += pool->slab_size;
+			}
+		}
+	}
+	pthread_mutex_unlock(&mesh.lock);
+	pthread_mutex_unlock(&pool->lock);
+	free(live);
+
+	__atomic_sub_fetch(&pool_bytes, released, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&meshed_bytes, released, __ATOMIC_RELAXED);
+	return released;
+}
+
+/**
+ * mm_pool_destroy - Destruct every free object and release @pool. Objects still allocated are
+ *                   released without being destructed. No other thread may use the pool concurrently.
+ * @pool: pool to destroy
+ */
+void mm_pool_destroy(mm_pool_t *pool){
+	struct list_head *lists[] = { &pool->partial, &pool->full, &pool->empty };
+	mm_pool_mag_t *mag;
+	mm_pool_mag_t *next_mag;
+	mm_pool_slab_t *slab;
+	mm_pool_slab_t *next_slab;
+	int i;
+
+	if(pool == NULL){
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	// Magazines belong to their threads, empty them and leave them to be reused or freed at thread exit
+	list_for_each_entry_safe(mag, next_mag, &pool->mags, list){
+		pool_flush_mag(pool, mag, mag->count);
+		list_del(&mag->list);
+		mag->pool = NULL;
+	}
+	for(i = 0; i < 3; i++){
+		list_for_each_entry_safe(slab, next_slab, lists[i], list){
+			list_del(&slab->list);
+			pool_release_slab(pool, slab);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_lock(&pools_lock);
+	pool_table[pool->id] = NULL;
+	pthread_mutex_unlock(&pools_lock);
+
+	__atomic_sub_fetch(&pool_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/**
+ * mm_release_free_memory - Give as much free memory back to the system as possible: the calling thread's
+ *                          pool magazines and every empty pool slab go back to the heap, the quick lists
+ *                          are consolidated, the heap is trimmed to its last chunk and whole pages inside
+ *                          free chunks are released with madvise(). Other threads hand their magazines
+ *                          back at their next scavenge, or when they exit. Returns the number of bytes released.
+ */
+size_t mm_release_free_memory(void){
+	mm_pool_t *pool;
+	mm_pool_mag_t *mag;
+	mm_pool_slab_t *slab;
+	mm_pool_slab_t *next_slab;
+	size_t released = 0;
+	int i;
+
+	ensure_init();
+	__atomic_add_fetch(&release_gen, 1, __ATOMIC_RELAXED);
+#ifdef MALLOC_PERCPU_RSEQ
+	if(percpu_bins != NULL){
+		percpu_drain();
+	}
+#endif
+
+	pthread_mutex_lock(&pools_lock);
+	for(i = 0; i < MAX_POOLS; i++){
+		if( (pool = pool_table[i]) == NULL){
+			continue;
+		}
+		released += mm_pool_mesh(pool);
+		pthread_mutex_lock(&pool->lock);
+		if(thread_mags != NULL && (mag = thread_mags[i]) != NULL && mag->pool == pool){
+			pool_flush_mag(pool, mag, mag->count);
+		}
+		list_for_each_entry_safe(slab, next_slab, &pool->empty, list){
+			list_del(&slab->list);
+			pool_release_slab(pool, slab);
+		}
+		pool->nempty = 0;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	released += release_arena(&main_arena);
+#ifdef MALLOC_NUMA
+	for(i = 0; i < numa_nodes; i++){
+		released += release_arena(&numa_arenas[i]);
+	}
+#endif
+
+	return released;
+}
+
+/**
+ * budget_footprint - Bytes the budget counts: heap taken from the kernel and chunks with their own mapping.
+ */
+static inline size_t budget_footprint(void){
+	return __atomic_load_n(&heap_footprint, __ATOMIC_RELAXED) + __atomic_load_n(&mmapped_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * budget_allow - May the heap or the mappings grow by @bytes? Past the hard limit they may not. Past the
+ *                soft limit they may, but the malloc() doing it runs budget_relieve() before it returns.
+ *                Called wherever memory is taken from the kernel, often with an arena locked.
+ */
+static bool budget_allow(size_t bytes){
+	size_t soft = mparams.soft_limit;
+	size_t hard = mparams.hard_limit;
+	size_t total;
+
+	if(soft == 0 && hard == 0){
+		return true;
+	}
+
+	total = budget_footprint() + bytes;
+	if(hard != 0 && total > hard){
+		return false;
+	}
+	if(soft != 0 && total > soft && total >= __atomic_load_n(&budget_rearm, __ATOMIC_RELAXED)){
+		__atomic_store_n(&budget_pending, true, __ATOMIC_RELAXED);
+	}
+	return true;
+}
+
+/**
+ * budget_relieve - The footprint crossed the soft limit (@level MM_PRESSURE_SOFT) or an allocation failed
+ *                  against the hard limit (MM_PRESSURE_HARD). Give back all the memory mm_release_free_memory()
+ *                  can. If that isn't enough, or on a hard failure, run the pressure callbacks and release what
+ *                  they freed. Called without allocator locks held. One thread at a time, the others go on.
+ */
+static void budget_relieve(int level){
+	mm_pressure_fn fns[MAX_PRESSURE_CALLBACKS];
+	void *args[MAX_PRESSURE_CALLBACKS];
+	size_t soft = mparams.soft_limit;
+	size_t footprint;
+	bool expected = false;
+	int i, n = 0;
+
+	if(!__atomic_compare_exchange_n(&budget_running, &expected, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+		return;
+	}
+	__atomic_store_n(&budget_pending, false, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pressure_count, 1, __ATOMIC_RELAXED);
+
+	mm_release_free_memory();
+	footprint = budget_footprint();
+
+	if(level == MM_PRESSURE_HARD || (soft != 0 && footprint > soft)){
+		// Copied out, a callback may register or remove callbacks
+		pthread_mutex_lock(&pressure_lock);
+		for(i = 0; i < MAX_PRESSURE_CALLBACKS; i++){
+			if(pressure_callbacks[i].fn != NULL){
+				fns[n] = pressure_callbacks[i].fn;
+				args[n++] = pressure_callbacks[i].arg;
+			}
+		}
+		pthread_mutex_unlock(&pressure_lock);
+
+		for(i = 0; i < n; i++){
+			fns[i](level, args[i]);
+		}
+		if(n > 0){
+			mm_release_free_memory();
+			footprint = budget_footprint();
+		}
+	}
+
+	// Still over: stay quiet till the footprint grows by another 1/16 of the soft limit
+	__atomic_store_n(&budget_rearm, (soft != 0 && footprint > soft) ? footprint + soft / 16 : 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&budget_running, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * mm_add_pressure_callback - Have @fn(level, @arg) called when the allocator crosses its soft limit and
+ *                            releasing free memory didn't bring it back under (level MM_PRESSURE_SOFT), or
+ *                            before an allocation fails against the hard limit (MM_PRESSURE_HARD). @fn should
+ *                            drop caches. It runs in the thread whose malloc() crossed the limit, with no
+ *                            allocator locks held, and may free and allocate. Returns 0, or -1 if the table is full.
+ * @fn: callback
+ * @arg: passed to @fn
+ */
+int mm_add_pressure_callback(mm_pressure_fn fn, void *arg){
+	int i;
+
+	pthread_mutex_lock(&pressure_lock);
+	for(i = 0; i < MAX_PRESSURE_CALLBACKS; i++){
+		if(pressure_callbacks[i].fn == NULL){
+			pressure_callbacks[i].fn = fn;
+			pressure_callbacks[i].arg = arg;
+			pthread_mutex_unlock(&pressure_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&pressure_lock);
+	return -1;
+}
+
+/**
+ * mm_remove_pressure_callback - Unregister @fn with @arg. It may still be running, or about to run, in
+ *                               another thread when this returns. Returns 0, or -1 if it wasn't registered.
+ */
+int mm_remove_pressure_callback(mm_pressure_fn fn, void *arg){
+	int i;
+
+	pthread_mutex_lock(&pressure_lock);
+	for(i = 0; i < MAX_PRESSURE_CALLBACKS; i++){
+		if(pressure_callbacks[i].fn == fn && pressure_callbacks[i].arg == arg){
+			pressure_callbacks[i].fn = NULL;
+			pthread_mutex_unlock(&pressure_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&pressure_lock);
+	return -1;
+}
+
+/**
+ * cgroup_read - Number in the file @mount@cgroup/@file, e.g. /sys/fs/cgroup/<cgroup>/memory.max. 0 if there is
+ *               none or it means no limit ("max" in cgroup v2, close to 2^63 in v1). Plain system calls,
+ *               this runs in malloc_init().
+ */
+static size_t cgroup_read(const char *mount, const char *cgroup, size_t cgroup_len, const char *file){
+	size_t mount_len = strlen(mount), file_len = strlen(file);
+	unsigned long long value;
+	char path[4096], buf[32], *end;
+	ssize_t n;
+	int fd;
+
+	if(mount_len + cgroup_len + file_len + 2 > sizeof(path)){
+		return 0;
+	}
+	memcpy(path, mount, mount_len);
+	memcpy(path + mount_len, cgroup, cgroup_len);
+	path[mount_len + cgroup_len] = '/';
+	memcpy(path + mount_len + cgroup_len + 1, file, file_len + 1);
+
+	if( (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0){
+		return 0;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0){
+		return 0;
+	}
+	buf[n] = '\0';
+
+	value = strtoull(buf, &end, 10);
+	if(end == buf || value > MAX_REQUEST_SIZE){
+		return 0;
+	}
+	return value;
+}
+
+/**
+ * cgroup_limit - Limit @file of the cgroup the process is in, or failing that (a container sees its own
+ *                cgroup at the root of the mount) of the cgroup at @mount itself.
+ */
+static size_t cgroup_limit(const char *mount, const char *cgroup, size_t cgroup_len, const char *file){
+	size_t value = 0;
+
+	if(cgroup != NULL){
+		value = cgroup_read(mount, cgroup, cgroup_len, file);
+	}
+	return value ? value : cgroup_read(mount, "", 0, file);
+}
+
+/**
+ * cgroup_init - Fill in the budget limits that weren't set from the memory limits of the process' cgroup
+ *               (MYMALLOC_CONF cgroup:1). The hard limit leaves 1/8 of memory.max for everything that isn't
+ *               heap (stacks, code, the kernel's own), the soft limit is memory.high or 3/4 of the hard one.
+ *               cgroup v1's memory.limit_in_bytes and memory.soft_limit_in_bytes stand in when there is no v2.
+ */
+static void cgroup_init(void){
+	const char *v1 = NULL, *v2 = NULL;
+	size_t v1_len = 0, v2_len = 0;
+	size_t max, high, hard;
+	char buf[4096], *line, *next;
+	ssize_t n;
+	int fd;
+
+	// Lines of /proc/self/cgroup are "id:controllers:path", v2 is "0::path"
+	if( (fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC)) >= 0){
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		buf[(n > 0) ? n : 0] = '\0';
+		for(line = buf; *line; line = next){
+			char *controllers = strchr(line, ':');
+			char *path = (controllers != NULL) ? strchr(controllers + 1, ':') : NULL;
+
+			next = line + strcspn(line, "\n");
+			next += (*next == '\n');
+			if(path == NULL || path > next){
+				continue;
+			}
+			if(controllers == path - 1 && !strncmp(line, "0:", 2)){
+				v2 = path + 1;
+				v2_len = next - v2 - (next[-1] == '\n');
+			}
+			else if(path - controllers - 1 == 6 && !strncmp(controllers + 1, "memory", 6)){
+				v1 = path + 1;
+				v1_len = next - v1 - (next[-1] == '\n');
+			}
+		}
+	}
+
+	max = cgroup_limit("/sys/fs/cgroup/", v2, v2_len, "memory.max");
+	high = cgroup_limit("/sys/fs/cgroup/", v2, v2_len, "memory.high");
+	if(max == 0 && high == 0){
+		max = cgroup_limit("/sys/fs/cgroup/memory/", v1, v1_len, "memory.limit_in_bytes");
+		high = cgroup_limit("/sys/fs/cgroup/memory/", v1, v1_len, "memory.soft_limit_in_bytes");
+	}
+
+	hard = (max != 0) ? max - max / 8 : 0;
+	if(mparams.hard_limit == 0){
+		mparams.hard_limit = hard;
+	}
+	if(mparams.soft_limit == 0){
+		mparams.soft_limit = (high != 0 && (hard == 0 || high < hard)) ? high : hard / 4 * 3;
+	}
+}
+
+/**
+ * sheap_bin - Size class of a free shared heap chunk of @size bytes.
+ */
+static inline unsigned int sheap_bin(uint64_t size){
+	if(size < SHEAP_SMALL_LIMIT){
+		return size / SHEAP_ALIGN;
+	}
+	return SHEAP_SMALL_LIMIT / SHEAP_ALIGN + (63 - __builtin_clzll(size)) - __builtin_ctz(SHEAP_SMALL_LIMIT);
+}
+
+/**
+ * sheap_link - Put the free @chunk at the head of its bin.
+ */
+static void sheap_link(sheap_hdr_t *hdr, sheap_chunk_t *chunk){
+	unsigned int bin = sheap_bin(chunk->size);
+
+	chunk->prev = 0;
+	chunk->next = hdr->bins[bin];
+	if(chunk->next != 0){
+		SHEAP_AT(hdr, chunk->next)->prev = SHEAP_OFF(hdr, chunk);
+	}
+	hdr->bins[bin] = SHEAP_OFF(hdr, chunk);
+	hdr->binmap[bin / 64] |= 1ULL << (bin % 64);
+}
+
+/**
+ * sheap_unlink - Take the free @chunk out of its bin.
+ */
+static void sheap_unlink(sheap_hdr_t *hdr, sheap_chunk_t *chunk){
+	unsigned int bin = sheap_bin(chunk->size);
+
+	if(chunk->prev != 0){
+		SHEAP_AT(hdr, chunk->prev)->next = chunk->next;
+	}
+	else {
+		hdr->bins[bin] = chunk->next;
+	}
+	if(chunk->next != 0){
+		SHEAP_AT(hdr, chunk->next)->prev = chunk->prev;
+	}
+	if(hdr->bins[bin] == 0){
+		hdr->binmap[bin / 64] &= ~(1ULL << (bin % 64));
+	}
+}
+
+/**
+ * sheap_find - Free chunk of at least @size bytes, NULL if only the top chunk is left. An exact bin is
+ *              taken as is, a power of 2 bin is searched first fit and every later bin fits anyway.
+ */
+static sheap_chunk_t *sheap_find(sheap_hdr_t *hdr, uint64_t size){
+	unsigned int bin = sheap_bin(size);
+	uint64_t off, bits;
+	unsigned int word;
+
+	for(off = hdr->bins[bin]; off != 0; off = SHEAP_AT(hdr, off)->next){
+		if(SHEAP_AT(hdr, off)->size >= size){
+			return SHEAP_AT(hdr, off);
+		}
+	}
+
+	for(word = (bin + 1) / 64; word < SHEAP_NBINS / 64; word++){
+		bits = hdr->binmap[word];
+		if(word == (bin + 1) / 64){
+			bits &= ~0ULL << ((bin + 1) % 64);
+		}
+		if(bits != 0){
+			return SHEAP_AT(hdr, hdr->bins[word * 64 + __builtin_ctzll(bits)]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * sheap_lock - Lock a shared heap. If the process holding the lock died, its operation may be half done
+ *              and there is nothing to roll back to, so the lock is just made usable again.
+ */
+static void sheap_lock(sheap_hdr_t *hdr){
+	if(pthread_mutex_lock(&hdr->lock) == EOWNERDEAD){
+		pthread_mutex_consistent(&hdr->lock);
+	}
+}
+
+/**
+ * sheap_checksum - Checksum of the metadata of a shared heap (FNV-1a of the header from root on). Stored when
+ *                  the last process detaches, so the next one can tell the heap was left as it was.
+ */
+static uint64_t sheap_checksum(const sheap_hdr_t *hdr){
+	const unsigned char *byte = (const unsigned char *) &hdr->root;
+	const unsigned char *end = (const unsigned char *) (hdr + 1);
+	uint64_t hash = 0xcbf29ce484222325ULL ^ hdr->size ^ hdr->base;
+
+	for(; byte < end; byte++){
+		hash = (hash ^ *byte) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * sheap_recover - Rebuild a shared heap's metadata from its chunks after a process died with it attached.
+ *                 The sizes of the chunks are trusted, everything else (prev_size, bins, top chunk, counter)
+ *                 is derived from them and free chunks left side by side are merged.
+ *                 Returns false if the chunks don't add up to the heap.
+ */
+static bool sheap_recover(sheap_hdr_t *hdr){
+	sheap_chunk_t *chunk;
+	sheap_chunk_t *last = NULL;
+	uint64_t off, size;
+
+	if(hdr->first != ALIGN_UP(sizeof(sheap_hdr_t), SHEAP_ALIGN)){
+		return false;
+	}
+	hdr->allocated_bytes = 0;
+
+	for(off = hdr->first; off < hdr->size; off += size){
+		chunk = SHEAP_AT(hdr, off);
+		size = SHEAP_SIZE(chunk);
+		if(size < SHEAP_MIN_CHUNK || size % SHEAP_ALIGN || size > hdr->size - off){
+			return false;
+		}
+		if(last != NULL && !(last->size & SHEAP_INUSE) && !(chunk->size & SHEAP_INUSE)){
+			last->size += size;
+			continue;
+		}
+		chunk->prev_size = (last != NULL) ? SHEAP_SIZE(last) : 0;
+		if(chunk->size & SHEAP_INUSE){
+			hdr->allocated_bytes += size;
+		}
+		last = chunk;
+	}
+	if(last == NULL || (last->size & SHEAP_INUSE)){
+		return false;
+	}
+	hdr->top = SHEAP_OFF(hdr, last);
+	if(hdr->root != 0 && (hdr->root < hdr->first + SHEAP_HDR || hdr->root >= hdr->top)){
+		return false;
+	}
+
+	memset(hdr->binmap, 0, sizeof(hdr->binmap));
+	memset(hdr->bins, 0, sizeof(hdr->bins));
+	for(off = hdr->first; off != hdr->top; off += SHEAP_SIZE(chunk)){
+		chunk = SHEAP_AT(hdr, off);
+		if(!(chunk->size & SHEAP_INUSE)){
+			sheap_link(hdr, chunk);
+		}
+	}
+	return true;
+}
+
+/**
+ * sheap_gate - Take (F_WRLCK) or drop (F_UNLCK) the attach gate of the shared heap file open at @fd: an
+ *              OFD lock on SHEAP_GATE_BYTE, which doesn't interact with flock(). Held from an attach's
+ *              first flock() till it holds its shared lock, and by a detach while it checks whether it is
+ *              the last, since flock() can't turn an exclusive lock into a shared one atomically.
+ *              Returns 0 or -1 with errno set.
+ */
+static int sheap_gate(int fd, short type){
+	struct flock lock = { .l_type = type, .l_whence = SEEK_SET, .l_start = SHEAP_GATE_BYTE, .l_len = 1 };
+	int ret;
+
+	while( (ret = fcntl(fd, (type == F_UNLCK) ? F_OFD_SETLK : F_OFD_SETLKW, &lock)) != 0 && errno == EINTR);
+	return ret;
+}
+
+/**
+ * sheap_attach - mm_heap_attach() and mm_heap_open(). The first process to attach holds the file's flock()
+ *                exclusively while it formats the heap, or checks it and repairs it if the last user didn't
+ *                detach cleanly. Everyone then keeps a shared lock till they detach, which is how the last
+ *                one finds out it is the last. The locks need an open file description of our own: @fd if
+ *                @own, else a reopen of /proc/self/fd/@fd, else a dup() of @fd that shares the caller's.
+ */
+static mm_heap_t *sheap_attach(int fd, size_t size, int flags, bool own){
+	pthread_mutexattr_t attr;
+	sheap_hdr_t *hdr = MAP_FAILED;
+	sheap_hdr_t old;
+	mm_heap_t *heap;
+	struct stat st;
+	char path[64];
+	bool fresh, exclusive;
+	int err;
+
+	ensure_init();
+
+	if( (heap = malloc(sizeof(*heap))) == NULL){
+		return NULL;
+	}
+
+	// A description of our own, so our lock is not the caller's or another handle's
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if( (heap->fd = own ? fd : open(path, O_RDWR | O_CLOEXEC)) < 0 && (heap->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0){
+		free(heap);
+		return NULL;
+	}
+
+	// Whoever holds the flock() exclusively is inside the gate too, so the shared lock can't block for long
+	if(sheap_gate(heap->fd, F_WRLCK) != 0){
+		goto fail;
+	}
+	if( (exclusive = (flock(heap->fd, LOCK_EX | LOCK_NB) == 0)) == false && flock(heap->fd, LOCK_SH) != 0){
+		goto fail;
+	}
+	if(fstat(heap->fd, &st) != 0){
+		goto fail;
+	}
+
+	if( (fresh = (st.st_size == 0)) ){
+		size = ALIGN_UP(size, mparams.page_size);
+		if(!exclusive || size < ALIGN_UP(sizeof(sheap_hdr_t), SHEAP_ALIGN) + 2 * SHEAP_MIN_CHUNK){
+			errno = EINVAL;
+			goto fail;
+		}
+		if(ftruncate(heap->fd, size) != 0){
+			goto fail;
+		}
+		old.base = 0;
+	}
+	else if(size != 0 && size != (size_t) st.st_size){
+		errno = EINVAL;
+		goto fail;
+	}
+	else {
+		size = st.st_size;
+		if(pread(heap->fd, &old, sizeof(old), 0) != sizeof(old) || old.magic != SHEAP_MAGIC || old.size != size){
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+
+	// Back where it was the last time if that is free, so pointers stored in the heap stay valid
+	if(old.base != 0){
+		hdr = mmap((void *) old.base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, heap->fd, 0);
+		if(hdr != MAP_FAILED && hdr != (sheap_hdr_t *) old.base){
+			munmap(hdr, size);
+			hdr = MAP_FAILED;
+		}
+	}
+	if(hdr == MAP_FAILED){
+		if(flags & MM_HEAP_FIXED && old.base != 0){
+			errno = EEXIST;
+			goto fail;
+		}
+		if( (hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, heap->fd, 0)) == MAP_FAILED){
+			goto fail;
+		}
+	}
+
+	if(exclusive){
+		// Nobody else has it mapped, so the lock can't be held. Reinitialized in case a crash left it taken.
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&hdr->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+
+	if(fresh){
+		// The file was empty, so everything else starts out zero
+		hdr->size = size;
+		hdr->base = (uintptr_t) hdr;
+		hdr->first = ALIGN_UP(sizeof(sheap_hdr_t), SHEAP_ALIGN);
+		hdr->top = hdr->first;
+		SHEAP_AT(hdr, hdr->top)->size = size - hdr->first;
+		hdr->magic = SHEAP_MAGIC;
+	}
+	else if(exclusive && (!hdr->clean || hdr->checksum != sheap_checksum(hdr))){
+		// Whoever had it last died, or the file was changed since
+		if(!sheap_recover(hdr)){
+			munmap(hdr, size);
+			errno = EUCLEAN;
+			goto fail;
+		}
+	}
+	__atomic_store_n(&hdr->clean, 0, __ATOMIC_RELAXED);
+
+	if(exclusive){
+		flock(heap->fd, LOCK_SH);
+	}
+	sheap_gate(heap->fd, F_UNLCK);
+	heap->hdr = hdr;
+	heap->size = size;
+	return heap;
+
+fail:
+	// Closing our description drops its locks, the gate included
+	err = errno;
+	close(heap->fd);
+	free(heap);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * mm_heap_attach - Map the shared heap in @fd, a file, shm_open() object or memfd opened read/write.
+ *                  An empty file is grown to @size bytes and formatted, otherwise the heap already in it is
+ *                  attached and @size must be 0 or its size. The heap is mapped where it was mapped before
+ *                  if that address is free. Returns NULL with errno set on failure: EINVAL if the file holds
+ *                  no heap, EUCLEAN if a process died with the heap attached and it couldn't be repaired.
+ *                  The heap gets an open file description of its own through /proc/self/fd. Without /proc
+ *                  it shares @fd's, so then no two attaches in or across processes may share one.
+ * @fd: file backing the heap, may be closed once attached
+ * @size: size of a new heap
+ */
+mm_heap_t *mm_heap_attach(int fd, size_t size){
+	return sheap_attach(fd, size, 0, false);
+}
+
+/**
+ * mm_heap_open - Open or create the heap file at @path and attach it like mm_heap_attach(). For heaps that
+ *                outlive the process: everything allocated in it is there again when it is reopened, found
+ *                through mm_heap_root(). With MM_HEAP_FIXED in @flags the heap must go back to the address
+ *                it was created at, so raw pointers stored in it stay valid, and EEXIST is returned if that
+ *                address is taken.
+ * @path: heap file
+ * @size: size of a new heap
+ * @flags: 0 or MM_HEAP_FIXED
+ */
+mm_heap_t *mm_heap_open(const char *path, size_t size, int flags){
+	int fd;
+
+	if( (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0){
+		return NULL;
+	}
+	// The heap keeps @fd, or closes it on failure
+	return sheap_attach(fd, size, flags, true);
+}
+
+/**
+ * mm_heap_alloc - Allocate @size bytes from a shared heap. Returns NULL if the heap is full.
+ *                 Every process that attached the heap sees the memory, at mm_heap_ptr() of its offset.
+ * @heap: heap to allocate from
+ * @size: size of requested memmory in bytes
+ */
+void *mm_heap_alloc(mm_heap_t *heap, size_t size){
+	sheap_hdr_t *hdr = heap->hdr;
+	sheap_chunk_t *chunk;
+	sheap_chunk_t *rest;
+	uint64_t need;
+
+	if(size > heap->size){
+		return NULL;
+	}
+	need = ALIGN_UP(size + SHEAP_HDR, SHEAP_ALIGN);
+	if(need < SHEAP_MIN_CHUNK){
+		need = SHEAP_MIN_CHUNK;
+	}
+
+	sheap_lock(hdr);
+
+	if( (chunk = sheap_find(hdr, need)) != NULL){
+		sheap_unlink(hdr, chunk);
+		// Split off the rest if it makes a chunk, the top chunk always follows
+		if(chunk->size - need >= SHEAP_MIN_CHUNK){
+			rest = SHEAP_AT(hdr, SHEAP_OFF(hdr, chunk) + need);
+			rest->prev_size = need;
+			rest->size = chunk->size - need;
+			SHEAP_AT(hdr, SHEAP_OFF(hdr, rest) + rest->size)->prev_size = rest->size;
+			chunk->size = need;
+			sheap_link(hdr, rest);
+		}
+	}
+	else {
+		// Carve it off the top chunk, which must stay big enough to be a chunk
+		chunk = SHEAP_AT(hdr, hdr->top);
+		if(chunk->size < need + SHEAP_MIN_CHUNK){
+			pthread_mutex_unlock(&hdr->lock);
+			return NULL;
+		}
+		rest = SHEAP_AT(hdr, hdr->top + need);
+		rest->prev_size = need;
+		rest->size = chunk->size - need;
+		chunk->size = need;
+		hdr->top += need;
+	}
+
+	hdr->allocated_bytes += chunk->size;
+	chunk->size |= SHEAP_INUSE;
+
+	pthread_mutex_unlock(&hdr->lock);
+	return (char *) chunk + SHEAP_HDR;
+}
+
+/**
+ * mm_heap_free - Give memory from mm_heap_alloc() back to its shared heap. Any process that attached the
+ *                heap may free it. A pointer that isn't an allocated chunk of the heap is reported and aborts.
+ * @heap: heap @ptr was allocated from
+ * @ptr: memory to free, or NULL
+ */
+void mm_heap_free(mm_heap_t *heap, void *ptr){
+	sheap_hdr_t *hdr = heap->hdr;
+	sheap_chunk_t *chunk;
+	sheap_chunk_t *next;
+	sheap_chunk_t *prev;
+	uint64_t off;
+
+	if(ptr == NULL){
+		return;
+	}
+	off = (uint64_t) ((char *) ptr - (char *) hdr) - SHEAP_HDR;
+	chunk = SHEAP_AT(hdr, off);
+
+	sheap_lock(hdr);
+
+	if((char *) ptr < (char *) hdr || off < hdr->first || off >= hdr->top || off % SHEAP_ALIGN || !(chunk->size & SHEAP_INUSE)){
+		pthread_mutex_unlock(&hdr->lock);
+		fprintf(stderr, "ERROR in mm_heap_free(): invalid pointer or double free at %p\n", ptr);
+		abort();
+	}
+
+	chunk->size &= ~(uint64_t) SHEAP_INUSE;
+	hdr->allocated_bytes -= chunk->size;
+
+	next = SHEAP_AT(hdr, off + chunk->size);
+	if(SHEAP_OFF(hdr, next) == hdr->top){
+		chunk->size += next->size;
+		hdr->top = off;
+	}
+	else if(!(next->size & SHEAP_INUSE)){
+		sheap_unlink(hdr, next);
+		chunk->size += next->size;
+		SHEAP_AT(hdr, off + chunk->size)->prev_size = chunk->size;
+	}
+
+	if(off != hdr->first){
+		prev = SHEAP_AT(hdr, off - chunk->prev_size);
+		if(!(prev->size & SHEAP_INUSE)){
+			sheap_unlink(hdr, prev);
+			prev->size += chunk->size;
+			if(hdr->top == off){
+				hdr->top = SHEAP_OFF(hdr, prev);
+			}
+			else {
+				SHEAP_AT(hdr, SHEAP_OFF(hdr, prev) + prev->size)->prev_size = prev->size;
+			}
+			chunk = prev;
+		}
+	}
+
+	if(SHEAP_OFF(hdr, chunk) != hdr->top){
+		sheap_link(hdr, chunk);
+	}
+
+	pthread_mutex_unlock(&hdr->lock);
+}
+
+/**
+ * mm_heap_offset - Offset of @ptr in its shared heap, the same in every process. This is what gets handed over.
+ */
+size_t mm_heap_offset(mm_heap_t *heap, const void *ptr){
+	return (const char *) ptr - (const char *) heap->hdr;
+}
+
+/**
+ * mm_heap_ptr - Where memory at @offset of a shared heap is mapped in the calling process.
+ */
+void *mm_heap_ptr(mm_heap_t *heap, size_t offset){
+	return (char *) heap->hdr + offset;
+}
+
+/**
+ * mm_heap_detach - Unmap a shared heap from the calling process. The heap lives on in its file
+ *                  for the other processes and the next attach, memory allocated from it stays allocated.
+ */
+void mm_heap_detach(mm_heap_t *heap){
+	sheap_hdr_t *hdr = heap->hdr;
+
+	// Only the last process gets the lock exclusively, it leaves the heap marked clean for the next one.
+	// Inside the gate, so an attach between its exclusive and its shared lock isn't taken for gone.
+	sheap_gate(heap->fd, F_WRLCK);
+	if(flock(heap->fd, LOCK_EX | LOCK_NB) == 0){
+		sheap_lock(hdr);
+		hdr->checksum = sheap_checksum(hdr);
+		hdr->clean = 1;
+		pthread_mutex_unlock(&hdr->lock);
+	}
+	munmap(hdr, heap->size);
+	close(heap->fd);
+	free(heap);
+}
+
+/**
+ * mm_heap_root - The object set with mm_heap_set_root(), how a process finds its data in a reopened heap.
+ *                NULL if none was set.
+ */
+void *mm_heap_root(mm_heap_t *heap){
+	size_t root = __atomic_load_n(&heap->hdr->root, __ATOMIC_ACQUIRE);
+
+	return (root != 0) ? mm_heap_ptr(heap, root) : NULL;
+}
+
+/**
+ * mm_heap_set_root - Make @ptr, memory allocated from @heap or NULL, the heap's root object.
+ */
+void mm_heap_set_root(mm_heap_t *heap, void *ptr){
+	__atomic_store_n(&heap->hdr->root, (ptr != NULL) ? mm_heap_offset(heap, ptr) : 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * mm_heap_sync - Write a shared heap back to its file. Only needed to survive a crash of the machine,
+ *                the page cache keeps it across restarts of the processes. Returns 0 or -1 with errno set.
+ */
+int mm_heap_sync(mm_heap_t *heap){
+	return msync(heap->hdr, heap->size, MS_SYNC);
+}
+
+#ifdef MALLOC_DEBUG
+/**
+ * sheap_check - mm_heap_check() with the heap locked.
+ */
+static int sheap_check(sheap_hdr_t *hdr){
+	sheap_chunk_t *chunk;
+	uint64_t off, prev_size = 0, allocated_bytes = 0;
+	size_t nfree = 0, nbinned = 0;
+	bool prev_free = false;
+	unsigned int bin;
+
+	for(off = hdr->first; ; off += SHEAP_SIZE(chunk)){
+		chunk = SHEAP_AT(hdr, off);
+		if(chunk->prev_size != prev_size){
+			CHECK_FAIL("shared chunk at %lu has prev_size %lu, previous chunk has size %lu", off, chunk->prev_size, prev_size);
+		}
+		if(SHEAP_SIZE(chunk) < SHEAP_MIN_CHUNK || SHEAP_SIZE(chunk) % SHEAP_ALIGN || off + SHEAP_SIZE(chunk) > hdr->size){
+			CHECK_FAIL("shared chunk at %lu has bad size %lu", off, chunk->size);
+		}
+		if(off == hdr->top){
+			break;
+		}
+		if(chunk->size & SHEAP_INUSE){
+			allocated_bytes += SHEAP_SIZE(chunk);
+			prev_free = false;
+		}
+		else {
+			if(prev_free){
+				CHECK_FAIL("free shared chunks next to each other at %lu", off);
+			}
+			nfree++;
+			prev_free = true;
+		}
+		prev_size = SHEAP_SIZE(chunk);
+	}
+	if(prev_free){
+		CHECK_FAIL("free shared chunk before the top chunk");
+	}
+	if(off + chunk->size != hdr->size || (chunk->size & SHEAP_INUSE)){
+		CHECK_FAIL("top chunk at %lu does not end the shared heap", off);
+	}
+	if(allocated_bytes != hdr->allocated_bytes){
+		CHECK_FAIL("%lu bytes of shared chunks in use, the counter says %lu", allocated_bytes, hdr->allocated_bytes);
+	}
+
+	for(bin = 0; bin < SHEAP_NBINS; bin++){
+		if(((hdr->binmap[bin / 64] >> (bin % 64)) & 1) != (hdr->bins[bin] != 0)){
+			CHECK_FAIL("bin %u and its bit in the bin map disagree", bin);
+		}
+		prev_size = 0;
+		for(off = hdr->bins[bin]; off != 0; off = chunk->next){
+			chunk = SHEAP_AT(hdr, off);
+			if((chunk->size & SHEAP_INUSE) || sheap_bin(chunk->size) != bin || chunk->prev != prev_size){
+				CHECK_FAIL("shared chunk at %lu does not belong in bin %u", off, bin);
+			}
+			if(++nbinned > nfree){
+				CHECK_FAIL("more binned shared chunks than free ones");
+			}
+			prev_size = off;
+		}
+	}
+	if(nbinned != nfree){
+		CHECK_FAIL("%lu free shared chunks but %lu binned", nfree, nbinned);
+	}
+	return 0;
+}
+
+/**
+ * mm_heap_check - Verify a shared heap the way mm_check_heap() does the process heap: boundary tags,
+ *                 no adjacent free chunks, bin membership, the top chunk and the byte counter.
+ *                 Returns 0 if the heap is consistent, otherwise reports the problem and returns -1.
+ */
+int mm_heap_check(mm_heap_t *heap){
+	int ret;
+
+	sheap_lock(heap->hdr);
+	ret = sheap_check(heap->hdr);
+	pthread_mutex_unlock(&heap->hdr->lock);
+	return ret;
+}
+#endif
@@ -12,17 +12,209 @@
 	--------------------------------------------------------------------------------------------
 	MALLOC_DEBUG				NOT DEFINED				Enables debugging functions when defined
 	MALLOC_DETECT_DOUBLE_FREE	NOT_DEFINED				Enabled double free detection when defined at the expense of free() runtime performance
+	MALLOC_NUMA					NOT_DEFINED				Allocate from one arena per NUMA node (see numa_fake_nodes below)
+	MALLOC_HARDENED				NOT_DEFINED				Checksum chunk headers and encode quick list links with a per-process secret, abort on corruption
+	MALLOC_PROFILE				NOT_DEFINED				Keep cycle count histograms of the slow paths (see mm_get_profile())
+	MALLOC_NO_PROBES			NOT_DEFINED				Leave out the USDT probes (only compiled in when sys/sdt.h is installed)
+	MALLOC_GUARD				NOT_DEFINED				Allow sampled allocations to end at a PROT_NONE guard page (see guard_sample below)
+	MALLOC_PAGEMAP				NOT_DEFINED				Find chunks' arenas and free neighbours through a radix page map instead of headers, abort on invalid pointers
 
  */
 
+/*
+	** Runtime options **
+
+	Set at startup with MYMALLOC_CONF="key:value,key:value" or later with mallopt(param, value).
+	Sizes in MYMALLOC_CONF accept k, m and g suffixes.
+
+	Key					mallopt() param		Default		Description
+	--------------------------------------------------------------------------------------------
+	alignment			M_ALIGNMENT			8			Byte alignment of all requests (power of 2, only before the first allocation)
+	min_size			M_MIN_SIZE			8			Smallest request size, malloc(0) returns this many bytes
+	brk_increase		M_TOP_PAD			8192		Minimum brk increase in bytes, also kept as padding when the heap is trimmed
+	trim_threshold		M_TRIM_THRESHOLD	128k		Free bytes at the top of the heap, beyond brk_increase or the last growth if larger, before brk is shrunk
+	mmap_threshold		M_MMAP_THRESHOLD	128k		Requests this large get their own mapping (0 disables)
+	placement			M_PLACEMENT			worst		Free chunk placement: worst, first or best (fit)
+	quick_max			M_MXFAST			256			Largest freed chunk (usable bytes) kept unmerged on a quick list (0 disables)
+	quick_budget		M_QUICK_BUDGET		64k			Bytes an arena keeps on quick lists before consolidating them
+	stream_threshold	M_STREAM_THRESHOLD	1m			realloc() copies and calloc() clears this large bypass the cache with streaming stores (0 disables)
+	numa_fake_nodes		-					0			Pretend the machine has this many NUMA nodes (MALLOC_NUMA only)
+	quarantine			M_QUARANTINE		0			Bytes of freed chunks each arena poisons and holds back to catch use after free (0 disables)
+	guard_sample		M_GUARD_SAMPLE		0			Give every n'th request its own mapping ending at a guard page, 1 for all, 0 disables (MALLOC_GUARD only)
+	purge_decay			M_PURGE_DECAY		0			Milliseconds over which a background thread gives freed heap pages back, instead of free() (0 disables)
+	purge_lazy			-					0			Purge with MADV_FREE, the kernel takes the pages only under memory pressure
+	soft_limit			M_SOFT_LIMIT		0			Heap and mapped bytes past which free memory is released and pressure callbacks run (0 disables)
+	hard_limit			M_HARD_LIMIT		0			Heap and mapped bytes never exceeded, malloc() fails with ENOMEM instead (0 disables)
+	cgroup				-					0			Set the limits not given from the cgroup's memory.max and memory.high (v1: limit_in_bytes, soft_limit_in_bytes)
+	mesh				-					0			Pools created from then on can be compacted with mm_pool_mesh(), their slabs are backed by a memfd
+	percpu				-					0			Freed chunks up to quick_max cached per size and CPU, up to 31, used lock free with rseq (x86-64, glibc 2.35+)
+ */
+
+#ifndef MALLOC_H
+#define MALLOC_H
+
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* mallopt() parameters. The ones glibc also has keep glibc's values. */
+#ifndef M_TRIM_THRESHOLD
+#define M_MXFAST			1
+#define M_TRIM_THRESHOLD	-1
+#define M_TOP_PAD			-2
+#define M_MMAP_THRESHOLD	-3
+#endif
+#define M_ALIGNMENT			-100
+#define M_MIN_SIZE			-101
+#define M_PLACEMENT			-102
+#define M_QUICK_BUDGET		-103
+#define M_GUARD_SAMPLE		-104
+#define M_QUARANTINE		-105
+#define M_PURGE_DECAY		-106
+#define M_STREAM_THRESHOLD	-107
+#define M_SOFT_LIMIT		-108
+#define M_HARD_LIMIT		-109
+
+/* M_PLACEMENT values */
+#define M_PLACEMENT_WORST_FIT	0
+#define M_PLACEMENT_FIRST_FIT	1
+#define M_PLACEMENT_BEST_FIT	2
+
+/* C++ already has these from <cstdlib>, with exception specifications that must match */
+#ifndef __cplusplus
 void *calloc(size_t nmemb, size_t size);
 void *malloc(size_t size);
 void free(void *ptr);
 void *realloc(void *ptr, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *valloc(size_t size);
+#endif
+void *memalign(size_t alignment, size_t size);
+void *pvalloc(size_t size);
+size_t malloc_usable_size(void *ptr);
+int mallopt(int param, int value);
+
+/* Size classes for allocations of a size known at compile time, see malloc_inline.h */
+#define MM_CLASS_ALIGN	8		/* bytes per class, the default alignment */
+#define MM_CLASS_MAX	256		/* largest size with a class, the default quick_max */
+
+void *mm_alloc_class(size_t cls);
+
+/* Allocator statistics, see mm_get_stats() */
+struct mm_stats {
+	size_t heap_bytes;				/* bytes of heap (brk and NUMA arenas) */
+	size_t allocated_bytes;			/* heap bytes in chunks handed out, headers included */
+	size_t free_bytes;				/* heap bytes in free chunks and the top chunks */
+	size_t quick_bytes;				/* heap bytes in freed chunks waiting on quick lists */
+	size_t quarantine_bytes;		/* heap bytes in freed chunks held in quarantine */
+	size_t mmapped_bytes;			/* bytes in chunks with their own mapping */
+	size_t region_count;			/* live regions */
+	size_t region_bytes;			/* bytes of blocks held by regions */
+	size_t region_allocated_bytes;	/* bytes handed out by regions */
+	size_t pool_count;				/* live object pools */
+	size_t pool_bytes;				/* bytes of slabs held by pools */
+	size_t purged_bytes;			/* bytes given back by the purge thread and mm_release_free_memory() */
+	size_t percpu_bytes;			/* bytes in freed chunks held in per-CPU caches, counted in allocated_bytes too */
+	size_t meshed_bytes;			/* bytes of pool slabs given back by mm_pool_mesh() */
+	size_t footprint_bytes;			/* heap and mmapped bytes taken from the kernel, what soft_limit and hard_limit count */
+	size_t pressure_count;			/* times the soft or hard limit made the allocator release memory */
+};
+
+void mm_get_stats(struct mm_stats *stats);
+size_t mm_release_free_memory(void);
+
+/* Memory pressure callbacks, see soft_limit and hard_limit */
+#define MM_PRESSURE_SOFT	0		/* over the soft limit after releasing free memory */
+#define MM_PRESSURE_HARD	1		/* an allocation is about to fail against the hard limit */
+
+typedef void (*mm_pressure_fn)(int level, void *arg);
+
+int mm_add_pressure_callback(mm_pressure_fn fn, void *arg);
+int mm_remove_pressure_callback(mm_pressure_fn fn, void *arg);
+
+/* Tagged allocations: bytes and chunks counted per tag, e.g. per subsystem, see mm_get_tag_stats() */
+#define MM_MAX_TAGS		64		/* tags are 1 to MM_MAX_TAGS - 1, 0 is untagged */
+
+struct mm_tag_stats {
+	size_t live_bytes;				/* bytes of chunks allocated with the tag and not freed yet, headers included */
+	size_t live_count;				/* chunks allocated with the tag and not freed yet */
+	size_t total_count;				/* chunks ever allocated with the tag */
+	size_t limit;					/* cap set with mm_set_tag_limit(), 0 if none */
+	size_t failed;					/* allocations refused because of the cap */
+};
+
+void *mm_malloc_tagged(size_t size, unsigned int tag);
+unsigned int mm_set_tag(unsigned int tag);
+int mm_set_tag_limit(unsigned int tag, size_t bytes);
+int mm_get_tag_stats(unsigned int tag, struct mm_tag_stats *stats);
+
+#ifdef MALLOC_PROFILE
+/* Slow paths timed by mm_get_profile() */
+#define MM_PROF_SYS_MALLOC		0	/* carving a chunk off the top chunk, growth included */
+#define MM_PROF_GROW			1	/* growing a heap (brk or arena break) */
+#define MM_PROF_TRIM			2	/* giving memory at the top of a heap back */
+#define MM_PROF_MMAP			3	/* mmap() of a large request */
+#define MM_PROF_CONSOLIDATE		4	/* merging the quick lists back into the heap */
+#define MM_PROF_LOCK_WAIT		5	/* waiting for a contended arena lock */
+#define MM_PROF_NPATHS			6
+
+#define MM_PROF_BUCKETS			64
+
+/* count[path][i] is the number of passes that took [2^i, 2^(i+1)) cycles (TSC ticks on x86, ns elsewhere) */
+struct mm_profile {
+	unsigned long long count[MM_PROF_NPATHS][MM_PROF_BUCKETS];
+};
+
+void mm_get_profile(struct mm_profile *prof);
+#endif
+
+/* Regions: bump allocation for objects that are all released together */
+typedef struct mm_region mm_region_t;
+
+mm_region_t *mm_region_create(size_t block_size);
+void *mm_region_alloc(mm_region_t *region, size_t size);
+void mm_region_reset(mm_region_t *region);
+void mm_region_destroy(mm_region_t *region);
+
+/* Object pools: fixed size objects that stay constructed while cached */
+typedef struct mm_pool mm_pool_t;
+
+mm_pool_t *mm_pool_create(size_t obj_size, size_t align, void (*ctor)(void *), void (*dtor)(void *));
+void *mm_pool_alloc(mm_pool_t *pool);
+void mm_pool_free(mm_pool_t *pool, void *obj);
+void mm_pool_shrink(mm_pool_t *pool);
+size_t mm_pool_mesh(mm_pool_t *pool);
+void mm_pool_destroy(mm_pool_t *pool);
+
+/* Shared heaps: a heap in a file or shared memory object that several processes map and allocate from */
+typedef struct mm_heap mm_heap_t;
+
+/* mm_heap_open() flags */
+#define MM_HEAP_FIXED	1	/* fail unless the heap is mapped at the address it was created at */
+
+mm_heap_t *mm_heap_attach(int fd, size_t size);
+mm_heap_t *mm_heap_open(const char *path, size_t size, int flags);
+void *mm_heap_alloc(mm_heap_t *heap, size_t size);
+void mm_heap_free(mm_heap_t *heap, void *ptr);
+size_t mm_heap_offset(mm_heap_t *heap, const void *ptr);
+void *mm_heap_ptr(mm_heap_t *heap, size_t offset);
+void *mm_heap_root(mm_heap_t *heap);
+void mm_heap_set_root(mm_heap_t *heap, void *ptr);
+int mm_heap_sync(mm_heap_t *heap);
+void mm_heap_detach(mm_heap_t *heap);
 
 #ifdef MALLOC_DEBUG
 void print_free_list(void);
 void print_heap_chunks(void);
+int mm_check_heap(void);
+int mm_heap_check(mm_heap_t *heap);
+#endif
+
+#ifdef __cplusplus
+}
 #endif
+
+#endif /* MALLOC_H */
@@ -0,0 +1,50 @@
+/*
+ * Title: Dynamic Memory Allocator 
+ * Author: Christian Wills <cwills.dev@gmail.com>
+ * License: GPLv2 (see COPYING)
+ * File: malloc_inline.h
+ */
+
+/*
+ * Optional fast path for allocations whose size is a compile time constant, e.g. mm_alloc_fixed(sizeof(T)).
+ * The size class is read from a table the compiler folds away, so only the call into mm_alloc_class()
+ * is left, and with the static library and -flto that gets inlined too. Memory is freed with free().
+ */
+#ifndef MALLOC_INLINE_H
+#define MALLOC_INLINE_H
+
+#include "malloc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size class of a request of @size bytes: aligned up to MM_CLASS_ALIGN, 0 bytes rounded up to one class */
+#define MM_SIZE_CLASS(size) ((size) == 0 ? 1 : ((size) + MM_CLASS_ALIGN - 1) / MM_CLASS_ALIGN)
+
+#define MM_SIZE_CLASS_4(size) MM_SIZE_CLASS(size), MM_SIZE_CLASS((size) + 1), MM_SIZE_CLASS((size) + 2), MM_SIZE_CLASS((size) + 3)
+#define MM_SIZE_CLASS_16(size) MM_SIZE_CLASS_4(size), MM_SIZE_CLASS_4((size) + 4), MM_SIZE_CLASS_4((size) + 8), MM_SIZE_CLASS_4((size) + 12)
+#define MM_SIZE_CLASS_64(size) MM_SIZE_CLASS_16(size), MM_SIZE_CLASS_16((size) + 16), MM_SIZE_CLASS_16((size) + 32), MM_SIZE_CLASS_16((size) + 48)
+#define MM_SIZE_CLASS_256(size) MM_SIZE_CLASS_64(size), MM_SIZE_CLASS_64((size) + 64), MM_SIZE_CLASS_64((size) + 128), MM_SIZE_CLASS_64((size) + 192)
+
+/* Size class of every request size up to MM_CLASS_MAX */
+static const unsigned char mm_size_classes[MM_CLASS_MAX + 1] = {
+	MM_SIZE_CLASS_256(0), MM_SIZE_CLASS(MM_CLASS_MAX)
+};
+
+/*
+ * mm_alloc_fixed - malloc() for a @size known at compile time. Anything else, or anything larger
+ *                  than MM_CLASS_MAX, just goes to malloc().
+ */
+static inline void *mm_alloc_fixed(size_t size){
+	if(__builtin_constant_p(size) && size <= MM_CLASS_MAX){
+		return mm_alloc_class(mm_size_classes[size]);
+	}
+	return malloc(size);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MALLOC_INLINE_H */
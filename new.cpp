@@ -0,0 +1,156 @@
+/*
+ * Title: Dynamic Memory Allocator 
+ * Author: Christian Wills <cwills.dev@gmail.com>
+ * License: GPLv2 (see COPYING)
+ * File: new.cpp
+ */
+
+/*
+ * Replacements for every global operator new and delete, so C++ programs allocate straight from
+ * malloc.c instead of going through libstdc++'s wrappers. The common case is a single call into
+ * malloc() or free(), the new_handler loop only runs once an allocation has failed.
+ */
+#include <cstdlib>
+#include <new>
+
+#include "malloc.h"
+
+/**
+ * new_failed - Retry an allocation that came back NULL after calling the installed new_handler, as
+ *              the standard requires. Throws std::bad_alloc (or returns NULL if @nothrow) once there is none.
+ * @size: size of the request
+ * @alignment: alignment of the request, 0 for the default
+ * @nothrow: true for the nothrow overloads
+ */
+static void *new_failed(std::size_t size, std::size_t alignment, bool nothrow){
+	void *mem;
+
+	for(;;){
+		std::new_handler handler = std::get_new_handler();
+
+		if(handler == nullptr){
+			if(nothrow){
+				return nullptr;
+			}
+			throw std::bad_alloc();
+		}
+
+		if(nothrow){
+			try {
+				handler();
+			}
+			catch(...){
+				return nullptr;
+			}
+		}
+		else {
+			handler();
+		}
+
+		mem = (alignment != 0) ? aligned_alloc(alignment, size) : malloc(size);
+		if(mem != nullptr){
+			return mem;
+		}
+	}
+}
+
+static inline void *new_impl(std::size_t size, bool nothrow){
+	void *mem = malloc(size);
+
+	if(__builtin_expect(mem != nullptr, 1)){
+		return mem;
+	}
+	return new_failed(size, 0, nothrow);
+}
+
+static inline void *new_aligned_impl(std::size_t size, std::align_val_t alignment, bool nothrow){
+	void *mem = aligned_alloc(static_cast<std::size_t>(alignment), size);
+
+	if(__builtin_expect(mem != nullptr, 1)){
+		return mem;
+	}
+	return new_failed(size, static_cast<std::size_t>(alignment), nothrow);
+}
+
+void *operator new(std::size_t size){
+	return new_impl(size, false);
+}
+
+void *operator new[](std::size_t size){
+	return new_impl(size, false);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+	return new_impl(size, true);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+	return new_impl(size, true);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment){
+	return new_aligned_impl(size, alignment, false);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment){
+	return new_aligned_impl(size, alignment, false);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+	return new_aligned_impl(size, alignment, true);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+	return new_aligned_impl(size, alignment, true);
+}
+
+/*
+ * Every chunk records its own size and aligned chunks are ordinary chunks, so all the deletes are free().
+ */
+void operator delete(void *ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+	free(ptr);
+}
@@ -0,0 +1,148 @@
+/*
+ * Title: Dynamic Memory Allocator 
+ * Author: Christian Wills <cwills.dev@gmail.com>
+ * License: GPLv2 (see COPYING)
+ * File: newtest.cpp
+ */
+
+/*
+ * Checks that every global operator new and delete resolves to libmymalloc and behaves. Built without
+ * linking the library and run with LD_PRELOAD=./libmymalloc.so, the way C++ services pick it up.
+ *
+ * Usage: LD_PRELOAD=./libmymalloc.so ./newtest
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <dlfcn.h>
+
+#include "malloc.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if(!(cond)){ \
+		std::fprintf(stderr, "newtest: " __VA_ARGS__); \
+		std::fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while(0)
+
+/// Mangled names of all replaceable global allocation functions
+static const char *overloads[] = {
+	"_Znwm", "_Znam",
+	"_ZnwmRKSt9nothrow_t", "_ZnamRKSt9nothrow_t",
+	"_ZnwmSt11align_val_t", "_ZnamSt11align_val_t",
+	"_ZnwmSt11align_val_tRKSt9nothrow_t", "_ZnamSt11align_val_tRKSt9nothrow_t",
+	"_ZdlPv", "_ZdaPv",
+	"_ZdlPvRKSt9nothrow_t", "_ZdaPvRKSt9nothrow_t",
+	"_ZdlPvm", "_ZdaPvm",
+	"_ZdlPvSt11align_val_t", "_ZdaPvSt11align_val_t",
+	"_ZdlPvSt11align_val_tRKSt9nothrow_t", "_ZdaPvSt11align_val_tRKSt9nothrow_t",
+	"_ZdlPvmSt11align_val_t", "_ZdaPvmSt11align_val_t",
+};
+
+struct alignas(256) over_aligned {
+	char data[300];
+};
+
+/**
+ * check_resolution - Every overload must come from libmymalloc, not libstdc++.
+ */
+static void check_resolution(void){
+	for(const char *name : overloads){
+		void *sym = dlsym(RTLD_DEFAULT, name);
+		Dl_info info;
+
+		if(sym == nullptr || !dladdr(sym, &info) || info.dli_fname == nullptr){
+			CHECK(false, "%s does not resolve", name);
+			continue;
+		}
+		CHECK(std::strstr(info.dli_fname, "libmymalloc") != nullptr, "%s resolves to %s", name, info.dli_fname);
+	}
+}
+
+/**
+ * check_accounting - new and delete have to show up in the allocator's own counters.
+ */
+static void check_accounting(void){
+	void (*get_stats)(struct mm_stats *) = (void (*)(struct mm_stats *)) dlsym(RTLD_DEFAULT, "mm_get_stats");
+	struct mm_stats before, after;
+
+	CHECK(get_stats != nullptr, "mm_get_stats not found, is libmymalloc preloaded?");
+	if(get_stats == nullptr){
+		return;
+	}
+
+	get_stats(&before);
+	int *arr = new int[1000];
+	get_stats(&after);
+	CHECK(after.allocated_bytes >= before.allocated_bytes + 1000 * sizeof(int), "new[] did not allocate from the heap");
+	delete[] arr;
+}
+
+static void check_overloads(void){
+	int *one = new int(7);
+	CHECK(*one == 7, "new int");
+	delete one;
+
+	char *arr = new char[100];
+	std::memset(arr, 1, 100);
+	delete[] arr;
+
+	int *nt = new (std::nothrow) int(3);
+	CHECK(nt != nullptr, "nothrow new");
+	delete nt;
+
+	char *nta = new (std::nothrow) char[10];
+	CHECK(nta != nullptr, "nothrow new[]");
+	::operator delete[](nta, std::nothrow);
+
+	over_aligned *oa = new over_aligned;
+	CHECK(((uintptr_t) oa & 255) == 0, "aligned new returned %p", (void *) oa);
+	delete oa;
+
+	over_aligned *oaa = new over_aligned[5];
+	CHECK(((uintptr_t) oaa & 255) == 0, "aligned new[] returned %p", (void *) oaa);
+	delete[] oaa;
+
+	void *p = ::operator new(64, std::align_val_t(4096), std::nothrow);
+	CHECK(p != nullptr && ((uintptr_t) p & 4095) == 0, "nothrow aligned new returned %p", p);
+	::operator delete(p, std::align_val_t(4096), std::nothrow);
+
+	p = ::operator new[](64, std::align_val_t(64));
+	CHECK(((uintptr_t) p & 63) == 0, "aligned new[] returned %p", p);
+	::operator delete[](p, 64, std::align_val_t(64));
+
+	p = ::operator new(40);
+	::operator delete(p, 40);
+	p = ::operator new[](40);
+	::operator delete[](p, 40);
+
+	// Requests too large for any heap
+	volatile std::size_t huge = SIZE_MAX / 2 + 1;
+	CHECK(::operator new(huge, std::nothrow) == nullptr, "nothrow new of a huge size succeeded");
+	bool thrown = false;
+	try {
+		p = ::operator new(huge);
+	}
+	catch(const std::bad_alloc &){
+		thrown = true;
+	}
+	CHECK(thrown, "new of a huge size did not throw");
+}
+
+int main(void){
+	check_resolution();
+	check_accounting();
+	check_overloads();
+
+	if(failures){
+		std::fprintf(stderr, "newtest: %d failures\n", failures);
+		return 1;
+	}
+	std::printf("newtest: OK\n");
+	return 0;
+}
@@ -0,0 +1,1479 @@
+/*
+ * Title: Dynamic Memory Allocator 
+ * Author: Christian Wills <cwills.dev@gmail.com>
+ * License: GPLv2 (see COPYING)
+ * File: stress.c
+ */
+
+/*
+ * Randomized stress test. Every thread runs a long random sequence of malloc(), calloc(),
+ * realloc() and free() on its own slots, hands some blocks to another thread to free, fills
+ * every block with a canary pattern and verifies it before the block is touched again.
+ * The heap invariants are checked with mm_check_heap() every -c steps.
+ *
+ * With -H the threads are processes instead, allocating from and freeing to one shared heap
+ * (mm_heap_alloc()) backed by a memfd and handing blocks over as heap offsets. The run ends with checks of
+ * mm_heap_open(): reopening a heap file, concurrently too, and repairing one a process died attached to.
+ *
+ * With -T every thread allocates under its own tag (mm_set_tag()). Once everything is freed, by
+ * whichever thread, every tag must be back to zero live bytes, and a capped tag must stop at its cap.
+ *
+ * With -P, run with purge_decay set, the run ends with a check that the purge thread gives freed heap
+ * memory back. With -M, run with mesh:1, it ends with a check that mm_pool_mesh() compacts a pool
+ * without losing what another thread writes to it meanwhile. With -B it ends with a check of the hard
+ * limit and its pressure callbacks. With -C, run with percpu set, it ends with a check that small frees are
+ * cached per CPU and that mm_release_free_memory() empties every CPU's cache. With -A it ends by corrupting the heap in forked children, which the
+ * library must catch and abort.
+ *
+ * Every run without -H ends with deterministic checks of the region and pool APIs and of
+ * mm_release_free_memory(). Built with MALLOC_PROFILE, every run ends with a check that mm_get_profile()
+ * timed the slow paths.
+ *
+ * Usage: stress [-H] [-T] [-P] [-M] [-B] [-C] [-A] [-t threads] [-n steps per thread] [-s seed] [-c check interval]
+ *
+ * Needs a library built with MALLOC_DEBUG. Exits non-zero on the first problem found.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "malloc.h"
+#include "malloc_inline.h"
+
+/// Live blocks per thread
+#define NSLOTS 512
+
+/// Blocks in flight between threads
+#define NEXCHANGE 64
+
+/// Canary bytes written at the start and end of large blocks (small ones are filled completely)
+#define CANARY_SPAN 256
+
+typedef struct {
+	unsigned char *ptr;
+	size_t size;
+	unsigned char tag;				// canary byte of the block
+} block_t;
+
+typedef struct {
+	int id;
+	unsigned int seed;
+	block_t slots[NSLOTS];
+} thread_ctx_t;
+
+/// Blocks handed from one thread to another, swapped in and out atomically
+static block_t *exchange[NEXCHANGE];
+
+static int nthreads = 4;
+static long nsteps = 200000;
+static long check_every = 1000;
+static unsigned int base_seed = 1;
+static bool tagged = false;
+static bool purging = false;
+static bool meshing = false;
+static bool budgeted = false;
+static bool crashing = false;
+static bool percpu = false;
+
+/// Shared heap of the -H processes, NULL when testing malloc()
+static mm_heap_t *heap = NULL;
+
+/// Size of the shared heap, only the pages touched take memory
+#define HEAP_SIZE ((size_t) 256 << 20)
+
+/// -H counterpart of exchange: offsets in the shared heap of block_t's handed between processes, 0 if empty
+static size_t *heap_exchange;
+
+#define FAIL(...) do { \
+	fprintf(stderr, "stress: " __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	abort(); \
+} while(0)
+
+/**
+ * check_tags - After the -T run, with everything freed: no tag may have live bytes left. Then cap a tag
+ *              and allocate under it till it is refused, the cap must hold. Last, realloc() must keep
+ *              the tags of the blocks it moves.
+ */
+static void check_tags(void){
+	struct mm_tag_stats stats;
+	void *blocks[1024];
+	unsigned int tag;
+	int n, k;
+
+	for(tag = 1; tag < MM_MAX_TAGS; tag++){
+		mm_get_tag_stats(tag, &stats);
+		if(stats.live_bytes != 0 || stats.live_count != 0){
+			FAIL("tag %u has %lu bytes in %lu chunks left after everything was freed (seed %u)", tag,
+			     stats.live_bytes, stats.live_count, base_seed);
+		}
+		if(tag <= (unsigned int) nthreads && stats.total_count == 0){
+			FAIL("tag %u counted no allocations (seed %u)", tag, base_seed);
+		}
+	}
+
+	tag = MM_MAX_TAGS - 1;
+	mm_set_tag_limit(tag, 64 * 1024);
+	for(n = 0; n < 1024 && (blocks[n] = mm_malloc_tagged(200, tag)) != NULL; n++);
+	mm_get_tag_stats(tag, &stats);
+	if(n == 0 || n == 1024 || stats.live_bytes > stats.limit || stats.live_count != (size_t) n || stats.failed != 1){
+		FAIL("cap of tag %u not kept: %d blocks, %lu bytes, %lu refused", tag, n, stats.live_bytes, stats.failed);
+	}
+	for(k = 0; k < n; k++){
+		free(blocks[k]);
+	}
+	mm_get_tag_stats(tag, &stats);
+	if(stats.live_bytes != 0){
+		FAIL("tag %u has %lu bytes left after its blocks were freed", tag, stats.live_bytes);
+	}
+	mm_set_tag_limit(tag, 0);
+
+	// realloc() moves a block with its own tag, not the thread's
+	tag = MM_MAX_TAGS - 2;
+	blocks[0] = malloc(200);
+	blocks[1] = mm_malloc_tagged(200, tag);
+	blocks[2] = malloc(200);
+	mm_set_tag(tag);
+	blocks[0] = realloc(blocks[0], 64 * 1024);
+	mm_set_tag(0);
+	mm_get_tag_stats(tag, &stats);
+	if(stats.live_count != 1){
+		FAIL("tag %u has %lu chunks after an untagged block was moved under it", tag, stats.live_count);
+	}
+	blocks[1] = realloc(blocks[1], 64 * 1024);
+	mm_get_tag_stats(tag, &stats);
+	if(stats.live_count != 1 || stats.live_bytes < 64 * 1024){
+		FAIL("tag %u has %lu bytes in %lu chunks after its block was moved", tag, stats.live_bytes, stats.live_count);
+	}
+	for(k = 0; k < 3; k++){
+		free(blocks[k]);
+	}
+	mm_get_tag_stats(tag, &stats);
+	if(stats.live_bytes != 0){
+		FAIL("tag %u has %lu bytes left after its blocks were freed", tag, stats.live_bytes);
+	}
+}
+
+/**
+ * random_size - Mostly small requests with the odd large (mmap) one.
+ */
+static size_t random_size(unsigned int *seed){
+	switch(rand_r(seed) % 16){
+		case 0:
+			return rand_r(seed) % (512 * 1024);
+		case 1: case 2:
+			return rand_r(seed) % 8192;
+		default:
+			return rand_r(seed) % 300;
+	}
+}
+
+/**
+ * fill - Write @blk's canary: the whole block if small, the first and last CANARY_SPAN bytes otherwise.
+ */
+static void fill(block_t *blk){
+	if(blk->size <= 2 * CANARY_SPAN){
+		memset(blk->ptr, blk->tag, blk->size);
+		return;
+	}
+	memset(blk->ptr, blk->tag, CANARY_SPAN);
+	memset(blk->ptr + blk->size - CANARY_SPAN, blk->tag, CANARY_SPAN);
+}
+
+/**
+ * verify_range - Check that bytes [@from, @to) of @blk hold @tag.
+ */
+static void verify_range(block_t *blk, size_t from, size_t to, unsigned char tag){
+	size_t i;
+
+	for(i = from; i < to; i++){
+		if(blk->ptr[i] != tag){
+			FAIL("block %p (%lu bytes) corrupted at offset %lu: 0x%02x instead of 0x%02x",
+			     blk->ptr, blk->size, i, blk->ptr[i], tag);
+		}
+	}
+}
+
+static void verify(block_t *blk){
+	if(blk->size <= 2 * CANARY_SPAN){
+		verify_range(blk, 0, blk->size, blk->tag);
+		return;
+	}
+	verify_range(blk, 0, CANARY_SPAN, blk->tag);
+	verify_range(blk, blk->size - CANARY_SPAN, blk->size, blk->tag);
+}
+
+/**
+ * check_alignment - Every pointer has to honour the default 8 byte alignment at least.
+ */
+static void check_alignment(void *ptr){
+	if(((uintptr_t) ptr) % 8){
+		FAIL("%p is not aligned", ptr);
+	}
+}
+
+/**
+ * check_regions - Regions hand out distinct, aligned memory (0 bytes included) that survives later
+ *                 allocations, and a reset gives back everything but one regular block, oversized
+ *                 blocks included.
+ */
+static void check_regions(void){
+	struct mm_stats before, stats;
+	mm_region_t *region;
+	unsigned char *small[256], *big, *zero[2];
+	int i, round;
+
+	mm_get_stats(&before);
+	if( (region = mm_region_create(4096)) == NULL){
+		FAIL("mm_region_create() failed");
+	}
+
+	for(round = 0; round < 2; round++){
+		// First request oversized, it must not become the block reset keeps
+		if( (big = mm_region_alloc(region, 64 * 1024)) == NULL){
+			FAIL("oversized mm_region_alloc() failed");
+		}
+		memset(big, 0xbb, 64 * 1024);
+
+		zero[0] = mm_region_alloc(region, 0);
+		zero[1] = mm_region_alloc(region, 0);
+		if(zero[0] == NULL || zero[1] == NULL || zero[0] == zero[1]){
+			FAIL("mm_region_alloc(0) returned %p and %p", zero[0], zero[1]);
+		}
+
+		for(i = 0; i < 256; i++){
+			if( (small[i] = mm_region_alloc(region, 1 + i % 100)) == NULL){
+				FAIL("mm_region_alloc(%d) failed", 1 + i % 100);
+			}
+			check_alignment(small[i]);
+			memset(small[i], i, 1 + i % 100);
+		}
+		for(i = 0; i < 256; i++){
+			if(small[i][0] != (unsigned char) i || small[i][i % 100] != (unsigned char) i){
+				FAIL("region memory %p overwritten", small[i]);
+			}
+		}
+		if(big[0] != 0xbb || big[64 * 1024 - 1] != 0xbb){
+			FAIL("oversized region block %p overwritten", big);
+		}
+
+		mm_get_stats(&stats);
+		if(stats.region_count != before.region_count + 1 || stats.region_bytes < before.region_bytes + 64 * 1024 + 4096){
+			FAIL("region counters wrong: %lu regions, %lu bytes", stats.region_count, stats.region_bytes);
+		}
+
+		mm_region_reset(region);
+		mm_get_stats(&stats);
+		if(stats.region_bytes != before.region_bytes + 4096 || stats.region_allocated_bytes != before.region_allocated_bytes){
+			FAIL("reset kept %lu bytes of blocks and %lu allocated bytes", stats.region_bytes - before.region_bytes,
+			     stats.region_allocated_bytes - before.region_allocated_bytes);
+		}
+	}
+
+	mm_region_destroy(region);
+	mm_get_stats(&stats);
+	if(stats.region_count != before.region_count || stats.region_bytes != before.region_bytes){
+		FAIL("destroyed region left %lu bytes", stats.region_bytes - before.region_bytes);
+	}
+}
+
+/// Constructed state of a pool object
+#define POOL_MAGIC 0x600dcafe
+
+typedef struct {
+	unsigned int magic;				// POOL_MAGIC while constructed
+	unsigned int owner;				// written by whoever holds the object
+	char pad[92];
+} pool_obj_t;
+
+static long pool_ctors, pool_dtors;
+
+static void pool_ctor(void *arg){
+	pool_obj_t *obj = arg;
+
+	obj->magic = POOL_MAGIC;
+	__atomic_add_fetch(&pool_ctors, 1, __ATOMIC_RELAXED);
+}
+
+static void pool_dtor(void *arg){
+	pool_obj_t *obj = arg;
+
+	if(obj->magic != POOL_MAGIC){
+		FAIL("pool object %p destructed twice or never constructed", obj);
+	}
+	obj->magic = 0;
+	__atomic_add_fetch(&pool_dtors, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * check_pools - Pool objects are aligned, distinct and constructed, every constructor is matched by a
+ *               destructor by the time the pool is destroyed, shrinking gives every slab back, and a
+ *               slab costs the heap little more than its own size.
+ */
+static void check_pools(void){
+	struct mm_stats before, stats;
+	pool_obj_t *objs[1000];
+	size_t heap_used;
+	mm_pool_t *pool;
+	int i, round;
+
+	pool_ctors = pool_dtors = 0;
+	mm_get_stats(&before);
+	if( (pool = mm_pool_create(sizeof(pool_obj_t), 64, pool_ctor, pool_dtor)) == NULL){
+		FAIL("mm_pool_create() failed");
+	}
+
+	for(round = 0; round < 2; round++){
+		for(i = 0; i < 1000; i++){
+			if( (objs[i] = mm_pool_alloc(pool)) == NULL){
+				FAIL("mm_pool_alloc() failed");
+			}
+			if(((uintptr_t) objs[i]) % 64 || objs[i]->magic != POOL_MAGIC){
+				FAIL("pool object %p misaligned or not constructed", objs[i]);
+			}
+			objs[i]->owner = i;
+		}
+		for(i = 0; i < 1000; i++){
+			if(objs[i]->owner != (unsigned int) i){
+				FAIL("pool object %p handed out twice", objs[i]);
+			}
+		}
+
+		// Slabs from the heap (not mapped on their own) are trimmed to their size
+		mm_get_stats(&stats);
+		heap_used = stats.allocated_bytes - before.allocated_bytes;
+		if(stats.mmapped_bytes == before.mmapped_bytes && heap_used > (stats.pool_bytes - before.pool_bytes) * 5 / 4 + 4096){
+			FAIL("%lu bytes of pool slabs take %lu bytes of heap", stats.pool_bytes - before.pool_bytes, heap_used);
+		}
+
+		for(i = 0; i < 1000; i++){
+			mm_pool_free(pool, objs[i]);
+		}
+		mm_pool_shrink(pool);
+		mm_get_stats(&stats);
+		if(stats.pool_bytes != before.pool_bytes){
+			FAIL("%lu bytes of slabs left after mm_pool_shrink()", stats.pool_bytes - before.pool_bytes);
+		}
+		if(pool_ctors < 1000 || pool_ctors != pool_dtors){
+			FAIL("%ld objects constructed, %ld destructed after mm_pool_shrink()", pool_ctors, pool_dtors);
+		}
+	}
+
+	// Objects still cached in slabs are destructed by destroy
+	for(i = 0; i < 10; i++){
+		objs[i] = mm_pool_alloc(pool);
+	}
+	for(i = 0; i < 10; i++){
+		mm_pool_free(pool, objs[i]);
+	}
+	mm_pool_destroy(pool);
+	mm_get_stats(&stats);
+	if(pool_ctors != pool_dtors || stats.pool_count != before.pool_count || stats.pool_bytes != before.pool_bytes){
+		FAIL("destroyed pool left %ld objects constructed and %lu bytes", pool_ctors - pool_dtors, stats.pool_bytes - before.pool_bytes);
+	}
+}
+
+/// Object size of the check_release() pool: 8 to a slab at any alignment up to 64, a full magazine spans 4 slabs
+#define RELEASE_OBJ_SIZE 1920
+
+static mm_pool_t *release_pool;
+static pthread_barrier_t release_barrier;
+static size_t release_cached_bytes;			// pool_bytes while the thread's magazine is full
+
+/**
+ * release_thread - Leave a full magazine of check_release()'s pool behind, then after the main thread's
+ *                  mm_release_free_memory() keep using the pool till its scavenges give the cached
+ *                  objects back.
+ */
+static void *release_thread(void *arg){
+	struct mm_stats stats;
+	void *objs[32], *obj;
+	int i;
+
+	(void) arg;
+	for(i = 0; i < 32; i++){
+		objs[i] = mm_pool_alloc(release_pool);
+	}
+	for(i = 0; i < 32; i++){
+		mm_pool_free(release_pool, objs[i]);
+	}
+	pthread_barrier_wait(&release_barrier);
+
+	// The main thread released memory, the magazine must go back at one of the next scavenges
+	pthread_barrier_wait(&release_barrier);
+	for(i = 0; i < 4096; i++){
+		obj = mm_pool_alloc(release_pool);
+		mm_pool_free(release_pool, obj);
+		mm_get_stats(&stats);
+		if(stats.pool_bytes < release_cached_bytes){
+			break;
+		}
+	}
+	if(i == 4096){
+		FAIL("idle magazine kept %lu bytes of slabs after mm_release_free_memory()", stats.pool_bytes);
+	}
+	return NULL;
+}
+
+/**
+ * check_release - mm_release_free_memory() gives the calling thread's magazine and every empty slab back,
+ *                 and another thread's magazine at that thread's next scavenge.
+ */
+static void check_release(void){
+	struct mm_stats before, stats;
+	pthread_t thread;
+	void *objs[1000];
+	int i;
+
+	mm_get_stats(&before);
+	if( (release_pool = mm_pool_create(RELEASE_OBJ_SIZE, 0, NULL, NULL)) == NULL){
+		FAIL("mm_pool_create() failed");
+	}
+
+	for(i = 0; i < 1000; i++){
+		objs[i] = mm_pool_alloc(release_pool);
+	}
+	for(i = 0; i < 1000; i++){
+		mm_pool_free(release_pool, objs[i]);
+	}
+	mm_get_stats(&stats);
+	if(stats.pool_bytes == before.pool_bytes){
+		FAIL("freed pool objects left no slabs cached");
+	}
+	mm_release_free_memory();
+	mm_get_stats(&stats);
+	if(stats.pool_bytes != before.pool_bytes){
+		FAIL("mm_release_free_memory() left %lu bytes of empty slabs", stats.pool_bytes - before.pool_bytes);
+	}
+
+	pthread_barrier_init(&release_barrier, NULL, 2);
+	pthread_create(&thread, NULL, release_thread, NULL);
+	pthread_barrier_wait(&release_barrier);
+	mm_release_free_memory();
+	mm_get_stats(&stats);
+	release_cached_bytes = stats.pool_bytes;
+	if(stats.pool_bytes < before.pool_bytes + 2 * 8 * RELEASE_OBJ_SIZE){
+		FAIL("another thread's magazine holds only %lu bytes of slabs", stats.pool_bytes - before.pool_bytes);
+	}
+	pthread_barrier_wait(&release_barrier);
+	pthread_join(thread, NULL);
+	pthread_barrier_destroy(&release_barrier);
+
+	mm_pool_destroy(release_pool);
+}
+
+/// Heap blocks check_purge() frees at once, small enough to stay off mmap()
+#define PURGE_BLOCKS 64
+#define PURGE_BLOCK_SIZE (32 * 1024)
+
+/// purge_decay check_purge() sets again after turning it off, the one make check runs -P with
+#define PURGE_DECAY 5
+
+/**
+ * purge_pass - Free a few MB of heap at once, the purge thread must count them in mm_stats' purged_bytes
+ *              within a second.
+ */
+static void purge_pass(void){
+	struct mm_stats before, stats;
+	void *blocks[PURGE_BLOCKS];
+	int i;
+
+	for(i = 0; i < PURGE_BLOCKS; i++){
+		if( (blocks[i] = malloc(PURGE_BLOCK_SIZE)) == NULL){
+			FAIL("malloc(%d) failed", PURGE_BLOCK_SIZE);
+		}
+		memset(blocks[i], 0xa5, PURGE_BLOCK_SIZE);
+	}
+	mm_get_stats(&before);
+	for(i = 0; i < PURGE_BLOCKS; i++){
+		free(blocks[i]);
+	}
+
+	for(i = 0; i < 100; i++){
+		usleep(10000);
+		mm_get_stats(&stats);
+		if(stats.purged_bytes - before.purged_bytes >= PURGE_BLOCKS * PURGE_BLOCK_SIZE / 2){
+			return;
+		}
+	}
+	FAIL("purged_bytes grew by only %lu bytes in a second after %d bytes were freed (is purge_decay set?)",
+	     stats.purged_bytes - before.purged_bytes, PURGE_BLOCKS * PURGE_BLOCK_SIZE);
+}
+
+/**
+ * check_purge - After the -P run, which needs purge_decay set: the purge thread must give freed heap memory
+ *               back, and still does after purge_decay was turned off and on again, however quickly.
+ */
+static void check_purge(void){
+	int i;
+
+	purge_pass();
+	for(i = 0; i < 100; i++){
+		mallopt(M_PURGE_DECAY, 0);
+		usleep(i * 20);
+		mallopt(M_PURGE_DECAY, PURGE_DECAY);
+	}
+	purge_pass();
+}
+
+/// check_mesh() objects. 256 bytes take the smallest (16K) slabs, aligned to their size in the mesh region.
+#define MESH_OBJ_SIZE 256
+#define MESH_SLAB_SIZE (16 * 1024)
+#define MESH_OBJS 1024
+#define MESH_PASSES 100
+
+/// Objects check_mesh() keeps, and whether it is done meshing
+static uint64_t *mesh_live[MESH_OBJS];
+static int mesh_nlive;
+static bool mesh_done;
+static uint64_t mesh_rounds;
+
+/**
+ * mesh_writer - Rewrite every live object of check_mesh() over and over while it is meshed, each word
+ *               holding the round number after its address. A write lost in the remap shows up next round.
+ */
+static void *mesh_writer(void *arg){
+	uint64_t round = 0;
+	bool last = false;
+	int i, k;
+
+	(void) arg;
+	while(!last){
+		last = __atomic_load_n(&mesh_done, __ATOMIC_ACQUIRE);
+		for(i = 0; i < mesh_nlive; i++){
+			if(mesh_live[i][0] != (uintptr_t) mesh_live[i]){
+				FAIL("meshed object %p holds the address %p", (void *) mesh_live[i], (void *) mesh_live[i][0]);
+			}
+			for(k = 1; k < MESH_OBJ_SIZE / 8; k++){
+				if(mesh_live[i][k] != round){
+					FAIL("meshed object %p lost a write: word %d is %lu, not %lu", (void *) mesh_live[i], k,
+					     mesh_live[i][k], round);
+				}
+				mesh_live[i][k] = round + 1;
+			}
+		}
+		__atomic_store_n(&mesh_rounds, ++round, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/**
+ * mesh_prepare - Create a pool, fill it and free every other slot with the odd slabs keeping the other
+ *                half, so neighbouring slabs mesh. The objects kept are in mesh_live, each holding its
+ *                address and zeros. Returns the pool.
+ */
+static mm_pool_t *mesh_prepare(void){
+	uint64_t *objs[MESH_OBJS];
+	mm_pool_t *pool;
+	uintptr_t addr;
+	int i;
+
+	if( (pool = mm_pool_create(MESH_OBJ_SIZE, 0, NULL, NULL)) == NULL){
+		FAIL("mm_pool_create() failed");
+	}
+	for(i = 0; i < MESH_OBJS; i++){
+		if( (objs[i] = mm_pool_alloc(pool)) == NULL){
+			FAIL("mm_pool_alloc() failed");
+		}
+	}
+	mesh_nlive = 0;
+	for(i = 0; i < MESH_OBJS; i++){
+		addr = (uintptr_t) objs[i];
+		if((addr / MESH_OBJ_SIZE) % 2 == (addr / MESH_SLAB_SIZE) % 2){
+			objs[i][0] = addr;
+			memset(&objs[i][1], 0, MESH_OBJ_SIZE - 8);
+			mesh_live[mesh_nlive++] = objs[i];
+		}
+		else {
+			mm_pool_free(pool, objs[i]);
+		}
+	}
+	// Objects in this thread's magazine count as live
+	mm_pool_shrink(pool);
+	return pool;
+}
+
+/// SIGSEGV handler an application might install after the library's, never called
+static void mesh_other_segv(int sig){
+	(void) sig;
+	abort();
+}
+
+/**
+ * check_mesh - After the -M run, which needs mesh:1: mm_pool_mesh() a pool from mesh_prepare() while
+ *              another thread keeps writing to the live objects. Once another SIGSEGV handler replaced the
+ *              library's, it must merge nothing.
+ */
+static void check_mesh(void){
+	struct mm_stats before, stats;
+	struct sigaction sa, old;
+	mm_pool_t *pool;
+	pthread_t thread;
+	size_t released;
+	int pass, i;
+
+	// One pass is over quickly, repeat it so the writer also gets to run mid-merge on a single CPU
+	for(pass = 0; pass < MESH_PASSES; pass++){
+		pool = mesh_prepare();
+
+		mm_get_stats(&before);
+		mesh_done = false;
+		mesh_rounds = 0;
+		pthread_create(&thread, NULL, mesh_writer, NULL);
+		while(__atomic_load_n(&mesh_rounds, __ATOMIC_ACQUIRE) == 0){
+			sched_yield();
+		}
+		released = mm_pool_mesh(pool);
+		__atomic_store_n(&mesh_done, true, __ATOMIC_RELEASE);
+		pthread_join(thread, NULL);
+
+		mm_get_stats(&stats);
+		if(released == 0 || stats.meshed_bytes - before.meshed_bytes != released || before.pool_bytes - stats.pool_bytes != released){
+			FAIL("mm_pool_mesh() gave back %lu bytes, meshed_bytes grew by %lu and pool_bytes fell by %lu", released,
+			     stats.meshed_bytes - before.meshed_bytes, before.pool_bytes - stats.pool_bytes);
+		}
+
+		for(i = 0; i < mesh_nlive; i++){
+			mm_pool_free(pool, mesh_live[i]);
+		}
+		mm_pool_destroy(pool);
+	}
+
+	// With the library's SIGSEGV handler replaced, a write during a merge would crash, so nothing is merged
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = mesh_other_segv;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old);
+	pool = mesh_prepare();
+	if( (released = mm_pool_mesh(pool)) != 0){
+		FAIL("mm_pool_mesh() gave back %lu bytes with another SIGSEGV handler installed", released);
+	}
+	sigaction(SIGSEGV, &old, NULL);
+	if(mm_pool_mesh(pool) == 0){
+		FAIL("mm_pool_mesh() gave back nothing once its SIGSEGV handler was back");
+	}
+	for(i = 0; i < mesh_nlive; i++){
+		mm_pool_free(pool, mesh_live[i]);
+	}
+	mm_pool_destroy(pool);
+}
+
+/// Room check_budget() leaves under the hard limit, and the cache its pressure callback drops
+#define BUDGET_HEADROOM (8 << 20)
+#define BUDGET_CACHE_SIZE (1 << 20)
+
+/// Times check_budget()'s pressure callback ran, per level, and the cache it drops
+static int budget_levels[2];
+static void *budget_cache;
+
+static void budget_callback(int level, void *arg){
+	(void) arg;
+	budget_levels[level]++;
+	free(budget_cache);
+	budget_cache = NULL;
+}
+
+/**
+ * check_budget - After the -B run: set a hard limit a little over the footprint and allocate till
+ *                malloc() fails. It must fail with ENOMEM, and only after the pressure callback ran with
+ *                MM_PRESSURE_HARD and dropped its cache. Meshing and releasing memory must still work with
+ *                the heap that full, when their own allocation fails (run with mesh:1 for that).
+ */
+static void check_budget(void){
+	static const size_t sizes[] = { 256 * 1024, 4096, 64, 16 };
+	struct mm_stats stats;
+	mm_pool_t *pool;
+	void *blocks = NULL;
+	void *blk;
+	size_t limit;
+	unsigned int i;
+	int k;
+
+	pool = mesh_prepare();
+	if( (budget_cache = malloc(BUDGET_CACHE_SIZE)) == NULL){
+		FAIL("malloc(%d) failed", BUDGET_CACHE_SIZE);
+	}
+	budget_levels[MM_PRESSURE_SOFT] = budget_levels[MM_PRESSURE_HARD] = 0;
+	mm_add_pressure_callback(budget_callback, NULL);
+	mm_get_stats(&stats);
+	limit = stats.footprint_bytes + BUDGET_HEADROOM;
+	mallopt(M_HARD_LIMIT, (int) limit);
+
+	// Largest blocks first, down to the smallest, so nothing is left in between
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+		while( (blk = malloc(sizes[i])) != NULL){
+			*(void **) blk = blocks;
+			blocks = blk;
+		}
+		if(errno != ENOMEM){
+			FAIL("malloc(%lu) failed against the hard limit with errno %d", sizes[i], errno);
+		}
+	}
+	mm_get_stats(&stats);
+	if(budget_levels[MM_PRESSURE_HARD] == 0 || budget_cache != NULL){
+		FAIL("hard limit reached without the pressure callback dropping its cache");
+	}
+	if(stats.footprint_bytes > limit){
+		FAIL("footprint of %lu bytes over the hard limit of %lu", stats.footprint_bytes, limit);
+	}
+
+	// Neither may deadlock when their bookkeeping allocation fails
+	mm_pool_mesh(pool);
+	mm_release_free_memory();
+
+	while( (blk = blocks) != NULL){
+		blocks = *(void **) blk;
+		free(blk);
+	}
+	mallopt(M_HARD_LIMIT, 0);
+	mm_remove_pressure_callback(budget_callback, NULL);
+
+	for(k = 0; k < mesh_nlive; k++){
+		mm_pool_free(pool, mesh_live[k]);
+	}
+	mm_pool_destroy(pool);
+}
+
+/// Small blocks check_percpu() frees on each CPU, fewer than a bin holds
+#define PERCPU_BLOCKS 8
+#define PERCPU_BLOCK_SIZE 64
+
+/**
+ * check_percpu - After the -C run, which needs percpu set and rseq: small blocks freed on each CPU in
+ *                turn must show up in mm_stats' percpu_bytes, and mm_release_free_memory() must hand
+ *                back every CPU's cache, not just the one it runs on.
+ */
+static void check_percpu(void){
+	void *blocks[PERCPU_BLOCKS];
+	struct mm_stats stats;
+	cpu_set_t all, one;
+	int cpu, i;
+
+	if(sched_getaffinity(0, sizeof(all), &all) != 0){
+		FAIL("sched_getaffinity() failed: %s", strerror(errno));
+	}
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		if(!CPU_ISSET(cpu, &all)){
+			continue;
+		}
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		sched_setaffinity(0, sizeof(one), &one);
+		for(i = 0; i < PERCPU_BLOCKS; i++){
+			blocks[i] = malloc(PERCPU_BLOCK_SIZE);
+		}
+		for(i = 0; i < PERCPU_BLOCKS; i++){
+			free(blocks[i]);
+		}
+	}
+	sched_setaffinity(0, sizeof(all), &all);
+
+	mm_get_stats(&stats);
+	if(stats.percpu_bytes == 0){
+		FAIL("no bytes in the per-CPU caches after %d frees of %d bytes (is percpu set?)", PERCPU_BLOCKS, PERCPU_BLOCK_SIZE);
+	}
+	mm_release_free_memory();
+	mm_get_stats(&stats);
+	if(stats.percpu_bytes != 0){
+		FAIL("%lu bytes left in the per-CPU caches after mm_release_free_memory()", stats.percpu_bytes);
+	}
+}
+
+/// Chunk header in front of the memory malloc() returns, laid out as malloc.c does with MALLOC_HARDENED
+/// and the default alignment of 8, for which PAD_SIZE comes out as 8 bytes
+typedef struct {
+	size_t prev_size;
+	size_t size;
+	void *next;						// quick list link, stored encoded
+	void *prev;
+	short used;
+	unsigned short tag;
+	unsigned int cksum;
+	size_t pad;
+} chunk_head_t;
+
+#define HEAD(ptr) ((chunk_head_t *) (ptr) - 1)
+
+// The crash cases misuse the heap on purpose
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuse-after-free"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wfree-nonheap-object"
+
+/// Size of the blocks the crash cases corrupt, small enough for the quick lists
+#define CRASH_SIZE 136
+
+#ifdef MALLOC_HARDENED
+
+static void crash_size(void){
+	char *p = malloc(CRASH_SIZE), *q = malloc(CRASH_SIZE);
+
+	HEAD(p)->size += 64;
+	free(p);
+	free(q);
+}
+
+static void crash_prev_size(void){
+	char *p = malloc(CRASH_SIZE), *q = malloc(CRASH_SIZE);
+
+	HEAD(q)->prev_size = 8;
+	free(q);
+	free(p);
+}
+
+static void crash_quick_link(void){
+	char *p = malloc(CRASH_SIZE);
+
+	free(p);
+	// Whatever it decodes to, the link is misaligned now
+	HEAD(p)->next = (void *) ((uintptr_t) HEAD(p)->next ^ 1);
+	p = malloc(CRASH_SIZE);
+	p = malloc(CRASH_SIZE);
+	free(p);
+}
+#endif
+
+static void crash_quarantine_write(void){
+	char *p, *q[64];
+	int i;
+
+	mallopt(M_QUARANTINE, 4096);
+	p = malloc(100);
+	free(p);
+	p[10] = 'A';
+	// Pushes it out of the quarantine, where the write is found
+	for(i = 0; i < 64; i++){
+		q[i] = malloc(100);
+	}
+	for(i = 0; i < 64; i++){
+		free(q[i]);
+	}
+}
+
+#ifdef MALLOC_PAGEMAP
+/// Size of a block crash_mmapped_*() get mmap()ed on its own
+#define CRASH_MMAP_SIZE (1 << 20)
+
+static void crash_foreign(void){
+	static long not_malloced[16];
+
+	free(&not_malloced[8]);
+}
+
+static void crash_interior(void){
+	char *p = malloc(CRASH_SIZE);
+
+	free(p + 32);
+}
+
+static void crash_mmapped_interior(void){
+	char *p = malloc(CRASH_MMAP_SIZE);
+
+	free(p + 4096);
+}
+
+static void crash_mmapped_double_free(void){
+	char *p = malloc(CRASH_MMAP_SIZE);
+
+	free(p);
+	free(p);
+}
+#endif
+
+#ifdef MALLOC_GUARD
+static void crash_guard_overflow(void){
+	char *p;
+
+	mallopt(M_GUARD_SAMPLE, 1);
+	p = malloc(128);
+	p[128] = 1;
+}
+
+static void crash_guard_overflow_aligned(void){
+	char *p;
+
+	mallopt(M_GUARD_SAMPLE, 1);
+	p = aligned_alloc(64, 128);
+	p[128] = 1;
+}
+#endif
+
+#pragma GCC diagnostic pop
+
+/// Misuses of the heap that must kill the process, each run in a child of its own
+static const struct {
+	const char *what;
+	void (*fn)(void);
+	int sig;						// signal the child must die of
+	const char *report;				// text its stderr must contain, NULL for none
+} crash_cases[] = {
+#ifdef MALLOC_HARDENED
+	{ "overwritten chunk size", crash_size, SIGABRT, "corrupted chunk header" },
+	{ "overwritten prev_size", crash_prev_size, SIGABRT, "corrupted chunk header" },
+	{ "overwritten quick list link", crash_quick_link, SIGABRT, "corrupted quick list" },
+#endif
+#ifdef MALLOC_PAGEMAP
+	{ "free() of a static array", crash_foreign, SIGABRT, "invalid pointer" },
+	{ "free() inside a heap chunk", crash_interior, SIGABRT, "ERROR in free()" },
+	{ "free() inside an mmap()ed chunk", crash_mmapped_interior, SIGABRT, "invalid pointer" },
+	{ "double free() of an mmap()ed chunk", crash_mmapped_double_free, SIGABRT, "invalid pointer" },
+#endif
+	{ "write to a quarantined chunk", crash_quarantine_write, SIGABRT, "was written at offset 10" },
+#ifdef MALLOC_GUARD
+	{ "overflow of a guarded block", crash_guard_overflow, SIGSEGV, NULL },
+	{ "overflow of an aligned guarded block", crash_guard_overflow_aligned, SIGSEGV, NULL },
+#endif
+	{ NULL, NULL, 0, NULL }
+};
+
+/**
+ * expect_crash - Run @fn in a forked child, which must write @report to stderr and be killed by @sig.
+ *                @what names the case when it fails.
+ */
+static void expect_crash(const char *what, void (*fn)(void), int sig, const char *report){
+	char out[1024];
+	size_t len = 0;
+	ssize_t n;
+	int fds[2], status;
+	pid_t pid;
+
+	if(pipe(fds) != 0 || (pid = fork()) < 0){
+		FAIL("can't fork for the %s case", what);
+	}
+	if(pid == 0){
+		close(fds[0]);
+		dup2(fds[1], STDERR_FILENO);
+		fn();
+		_exit(0);
+	}
+	close(fds[1]);
+	while(len < sizeof(out) - 1 && (n = read(fds[0], out + len, sizeof(out) - 1 - len)) > 0){
+		len += n;
+	}
+	out[len] = '\0';
+	close(fds[0]);
+
+	if(waitpid(pid, &status, 0) != pid || !WIFSIGNALED(status) || WTERMSIG(status) != sig){
+		FAIL("%s: the child wasn't killed by signal %d (status %#x): %s", what, sig, status, out);
+	}
+	if(report != NULL && strstr(out, report) == NULL){
+		FAIL("%s: the child didn't report \"%s\": %s", what, report, out);
+	}
+}
+
+/**
+ * check_crashes - After the -A run: every case in crash_cases[] must be caught and kill its child.
+ */
+static void check_crashes(void){
+	int i;
+
+	for(i = 0; crash_cases[i].what != NULL; i++){
+		expect_crash(crash_cases[i].what, crash_cases[i].fn, crash_cases[i].sig, crash_cases[i].report);
+	}
+}
+
+#ifdef MALLOC_PROFILE
+/// Names of the MM_PROF_* paths for the failure message
+static const char *profile_paths[MM_PROF_NPATHS] = { "sys_malloc", "grow", "trim", "mmap", "consolidate", "lock_wait" };
+
+/**
+ * check_profile - After a run of a MALLOC_PROFILE build: every slow path a default run is bound to take
+ *                 must have been timed at least once.
+ */
+static void check_profile(void){
+	static const int paths[] = { MM_PROF_SYS_MALLOC, MM_PROF_GROW, MM_PROF_TRIM, MM_PROF_MMAP, MM_PROF_CONSOLIDATE };
+	struct mm_profile prof;
+	unsigned long long count;
+	size_t i;
+	int bucket;
+
+	mm_get_profile(&prof);
+	for(i = 0; i < sizeof(paths) / sizeof(paths[0]); i++){
+		count = 0;
+		for(bucket = 0; bucket < MM_PROF_BUCKETS; bucket++){
+			count += prof.count[paths[i]][bucket];
+		}
+		if(count == 0){
+			FAIL("the %s path was never timed", profile_paths[paths[i]]);
+		}
+	}
+}
+#endif
+
+/**
+ * step - Do one random operation on a random slot of @ctx.
+ */
+static void step(thread_ctx_t *ctx){
+	block_t *blk = &ctx->slots[rand_r(&ctx->seed) % NSLOTS];
+	size_t size, keep;
+
+	if(blk->ptr != NULL){
+		verify(blk);
+	}
+
+	switch(rand_r(&ctx->seed) % 8){
+		case 0: case 1:
+			// free
+			free(blk->ptr);
+			blk->ptr = NULL;
+			break;
+
+		case 2:
+			// calloc, must come back zeroed
+			free(blk->ptr);
+			size = random_size(&ctx->seed);
+			if( (blk->ptr = calloc(1, size)) == NULL){
+				FAIL("calloc(1, %lu) failed", size);
+			}
+			check_alignment(blk->ptr);
+			blk->size = size;
+			verify_range(blk, 0, size, 0);
+			blk->tag = rand_r(&ctx->seed);
+			fill(blk);
+			break;
+
+		case 3: case 4:
+			// realloc, the common prefix must survive the move
+			if(blk->ptr == NULL){
+				goto do_malloc;
+			}
+			size = random_size(&ctx->seed);
+			if(size == 0){
+				size = 1;
+			}
+			if( (blk->ptr = realloc(blk->ptr, size)) == NULL){
+				FAIL("realloc(%lu) failed", size);
+			}
+			check_alignment(blk->ptr);
+			keep = (size < blk->size) ? size : blk->size;
+			if(blk->size > 2 * CANARY_SPAN && keep > CANARY_SPAN){
+				keep = CANARY_SPAN;
+			}
+			verify_range(blk, 0, keep, blk->tag);
+			blk->size = size;
+			fill(blk);
+			break;
+
+		case 5:
+			// hand the block to whichever thread picks the exchange slot next
+			if(blk->ptr != NULL){
+				block_t *mine = mm_alloc_fixed(sizeof(*mine));
+				block_t *theirs;
+
+				*mine = *blk;
+				theirs = __atomic_exchange_n(&exchange[rand_r(&ctx->seed) % NEXCHANGE], mine, __ATOMIC_ACQ_REL);
+				blk->ptr = NULL;
+				if(theirs != NULL){
+					verify(theirs);
+					free(theirs->ptr);
+					free(theirs);
+				}
+			}
+			break;
+
+		default:
+		do_malloc:
+			free(blk->ptr);
+			size = random_size(&ctx->seed);
+			if( (blk->ptr = malloc(size)) == NULL){
+				FAIL("malloc(%lu) failed", size);
+			}
+			check_alignment(blk->ptr);
+			blk->size = size;
+			blk->tag = rand_r(&ctx->seed);
+			fill(blk);
+			break;
+	}
+}
+
+/**
+ * heap_step - step() for a process on the shared heap: allocate, free or hand over a block.
+ */
+static void heap_step(thread_ctx_t *ctx){
+	block_t *blk = &ctx->slots[rand_r(&ctx->seed) % NSLOTS];
+	block_t *mine, *theirs;
+	size_t size, off;
+
+	if(blk->ptr != NULL){
+		verify(blk);
+	}
+
+	switch(rand_r(&ctx->seed) % 4){
+		case 0:
+			mm_heap_free(heap, blk->ptr);
+			blk->ptr = NULL;
+			break;
+
+		case 1:
+			// The block_t travels in the shared heap too, so the other process can see it
+			if(blk->ptr != NULL){
+				if( (mine = mm_heap_alloc(heap, sizeof(*mine))) == NULL){
+					FAIL("shared heap full");
+				}
+				*mine = *blk;
+				off = __atomic_exchange_n(&heap_exchange[rand_r(&ctx->seed) % NEXCHANGE], mm_heap_offset(heap, mine), __ATOMIC_ACQ_REL);
+				blk->ptr = NULL;
+				if(off != 0){
+					theirs = mm_heap_ptr(heap, off);
+					verify(theirs);
+					mm_heap_free(heap, theirs->ptr);
+					mm_heap_free(heap, theirs);
+				}
+			}
+			break;
+
+		default:
+			mm_heap_free(heap, blk->ptr);
+			size = random_size(&ctx->seed);
+			if( (blk->ptr = mm_heap_alloc(heap, size)) == NULL){
+				FAIL("mm_heap_alloc(%lu) failed", size);
+			}
+			check_alignment(blk->ptr);
+			blk->size = size;
+			blk->tag = rand_r(&ctx->seed);
+			fill(blk);
+			break;
+	}
+}
+
+/**
+ * heap_process - Body of a -H process.
+ */
+static void heap_process(thread_ctx_t *ctx){
+	long i;
+	int k;
+
+	for(i = 1; i <= nsteps; i++){
+		heap_step(ctx);
+		if(check_every > 0 && i % check_every == 0 && mm_heap_check(heap) != 0){
+			FAIL("shared heap invariant broken in process %d after step %ld (seed %u)", ctx->id, i, base_seed);
+		}
+	}
+
+	for(k = 0; k < NSLOTS; k++){
+		if(ctx->slots[k].ptr != NULL){
+			verify(&ctx->slots[k]);
+			mm_heap_free(heap, ctx->slots[k].ptr);
+		}
+	}
+}
+
+/// Heap file of check_heap_open(), and the root object it keeps in it
+#define HEAP_FILE_SIZE ((size_t) 1 << 20)
+#define HEAP_ROOT_SIZE 4096
+
+/// Attaches and detaches per process in check_heap_open()
+#define HEAP_REOPENS 200
+
+/**
+ * heap_file_child - Fork a process that opens the heap file at @path and runs @what on it: 'r' attaches and
+ *                   detaches it HEAP_REOPENS times, 'c' allocates a block, stores its offset in the root and
+ *                   dies attached, 'x' does the same and also smashes the block's chunk size.
+ */
+static pid_t heap_file_child(const char *path, char what){
+	mm_heap_t *file;
+	uint64_t *root;
+	char *blk;
+	pid_t pid;
+	int i;
+
+	if( (pid = fork()) != 0){
+		return pid;
+	}
+	for(i = 0; i < (what == 'r' ? HEAP_REOPENS : 1); i++){
+		if( (file = mm_heap_open(path, 0, 0)) == NULL){
+			FAIL("can't reopen the heap file (errno %d)", errno);
+		}
+		if( (blk = mm_heap_alloc(file, 100)) == NULL){
+			FAIL("heap file full");
+		}
+		memset(blk, 0x5a, 100);
+		if(what == 'r'){
+			mm_heap_free(file, blk);
+			mm_heap_detach(file);
+			continue;
+		}
+		root = mm_heap_root(file);
+		root[0] = mm_heap_offset(file, blk);
+		if(what == 'x'){
+			// The chunk's size word sits right before the memory handed out, see sheap_chunk_t
+			((uint64_t *) blk)[-1] = ((uint64_t) 1 << 40) | 1;
+		}
+		_exit(0);
+	}
+	_exit(0);
+}
+
+/**
+ * heap_file_wait - Wait for the @n processes started by heap_file_child().
+ */
+static void heap_file_wait(int n){
+	int status;
+
+	while(n-- > 0){
+		if(wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+			FAIL("a heap file process failed");
+		}
+	}
+}
+
+/**
+ * check_heap_reopen - Reopen the heap file at @path, which must hold the root left by check_heap_open()
+ *                     and be intact. Returns the heap, attached.
+ */
+static mm_heap_t *check_heap_reopen(const char *path, int flags, uint64_t *expect_root){
+	mm_heap_t *file;
+	uint64_t *root;
+	int k;
+
+	if( (file = mm_heap_open(path, 0, flags)) == NULL){
+		FAIL("can't reopen the heap file (errno %d)", errno);
+	}
+	if( (root = mm_heap_root(file)) == NULL || (expect_root != NULL && root != expect_root)){
+		FAIL("reopened heap file has its root at %p, not %p", (void *) root, (void *) expect_root);
+	}
+	for(k = 1; k < HEAP_ROOT_SIZE / 8; k++){
+		if(root[k] != (uint64_t) k * 0x9e3779b97f4a7c15ULL){
+			FAIL("root of the reopened heap file changed at word %d", k);
+		}
+	}
+	if(mm_heap_check(file) != 0){
+		FAIL("reopened heap file is broken");
+	}
+	return file;
+}
+
+/**
+ * check_heap_open - After the -H run: a heap file keeps its root across mm_heap_open(), at the same address
+ *                   with MM_HEAP_FIXED, while processes attach and detach it concurrently, and after a
+ *                   process died attached. If that process broke a chunk, reopening fails with EUCLEAN.
+ */
+static void check_heap_open(void){
+	mm_heap_t *file;
+	uint64_t *root, *first_root;
+	const char *dir = getenv("TMPDIR");
+	char path[256];
+	char *blk;
+	int t, k;
+
+	snprintf(path, sizeof(path), "%s/stress-heap.%d", (dir != NULL) ? dir : "/tmp", (int) getpid());
+	unlink(path);
+	if( (file = mm_heap_open(path, HEAP_FILE_SIZE, 0)) == NULL){
+		FAIL("can't create the heap file %s (errno %d)", path, errno);
+	}
+	if( (root = mm_heap_alloc(file, HEAP_ROOT_SIZE)) == NULL){
+		FAIL("heap file full");
+	}
+	root[0] = 0;
+	for(k = 1; k < HEAP_ROOT_SIZE / 8; k++){
+		root[k] = (uint64_t) k * 0x9e3779b97f4a7c15ULL;
+	}
+	mm_heap_set_root(file, root);
+	first_root = root;
+	mm_heap_detach(file);
+
+	mm_heap_detach(check_heap_reopen(path, MM_HEAP_FIXED, first_root));
+
+	// Every process may be the first or the last to attach, in any order
+	for(t = 0; t < nthreads; t++){
+		heap_file_child(path, 'r');
+	}
+	heap_file_wait(nthreads);
+	mm_heap_detach(check_heap_reopen(path, 0, NULL));
+
+	// A process died attached: its block is still there after the repair
+	heap_file_child(path, 'c');
+	heap_file_wait(1);
+	file = check_heap_reopen(path, 0, NULL);
+	root = mm_heap_root(file);
+	blk = mm_heap_ptr(file, root[0]);
+	for(k = 0; k < 100; k++){
+		if(blk[k] != 0x5a){
+			FAIL("block of the process that died changed at byte %d", k);
+		}
+	}
+	mm_heap_free(file, blk);
+	root[0] = 0;
+	mm_heap_detach(file);
+
+	heap_file_child(path, 'x');
+	heap_file_wait(1);
+	if( (file = mm_heap_open(path, 0, 0)) != NULL || errno != EUCLEAN){
+		FAIL("heap file with a broken chunk was attached (errno %d)", (file != NULL) ? 0 : errno);
+	}
+	unlink(path);
+}
+
+/**
+ * heap_main - Run the -H test: fork the processes, wait for them and check what they left behind.
+ */
+static int heap_main(void){
+	thread_ctx_t *ctx;
+	block_t *theirs;
+	int fd, t, k, status;
+	pid_t pid;
+
+	if( (fd = memfd_create("stress", 0)) < 0 || (heap = mm_heap_attach(fd, HEAP_SIZE)) == NULL){
+		FAIL("can't create the shared heap");
+	}
+	if( (heap_exchange = mm_heap_alloc(heap, NEXCHANGE * sizeof(*heap_exchange))) == NULL){
+		FAIL("shared heap full");
+	}
+	memset(heap_exchange, 0, NEXCHANGE * sizeof(*heap_exchange));
+
+	ctx = calloc(1, sizeof(*ctx));
+	for(t = 0; t < nthreads; t++){
+		if( (pid = fork()) < 0){
+			FAIL("fork failed");
+		}
+		if(pid == 0){
+			ctx->id = t;
+			ctx->seed = base_seed * 7919 + t;
+			heap_process(ctx);
+			_exit(0);
+		}
+	}
+	for(t = 0; t < nthreads; t++){
+		if(wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+			FAIL("a process failed (seed %u)", base_seed);
+		}
+	}
+
+	for(k = 0; k < NEXCHANGE; k++){
+		if(heap_exchange[k] != 0){
+			theirs = mm_heap_ptr(heap, heap_exchange[k]);
+			verify(theirs);
+			mm_heap_free(heap, theirs->ptr);
+			mm_heap_free(heap, theirs);
+		}
+	}
+	mm_heap_free(heap, heap_exchange);
+
+	if(mm_heap_check(heap) != 0){
+		FAIL("shared heap invariant broken after the run (seed %u)", base_seed);
+	}
+
+	mm_heap_detach(heap);
+	close(fd);
+	free(ctx);
+	check_heap_open();
+	printf("stress: %d processes x %ld steps on a shared heap OK (seed %u)\n", nthreads, nsteps, base_seed);
+	return 0;
+}
+
+static void *stress_thread(void *arg){
+	thread_ctx_t *ctx = arg;
+	long i;
+	int k;
+
+	if(tagged){
+		mm_set_tag(1 + ctx->id % (MM_MAX_TAGS - 1));
+	}
+
+	for(i = 1; i <= nsteps; i++){
+		step(ctx);
+		if(check_every > 0 && i % check_every == 0 && mm_check_heap() != 0){
+			FAIL("heap invariant broken in thread %d after step %ld (seed %u)", ctx->id, i, base_seed);
+		}
+	}
+
+	for(k = 0; k < NSLOTS; k++){
+		if(ctx->slots[k].ptr != NULL){
+			verify(&ctx->slots[k]);
+			free(ctx->slots[k].ptr);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv){
+	pthread_t *threads;
+	thread_ctx_t *ctxs;
+	int opt, t, k;
+	bool shared = false;
+
+	while( (opt = getopt(argc, argv, "HTPMBCAt:n:s:c:")) != -1){
+		switch(opt){
+			case 'H': shared = true; break;
+			case 'T': tagged = true; break;
+			case 'P': purging = true; break;
+			case 'M': meshing = true; break;
+			case 'B': budgeted = true; break;
+			case 'C': percpu = true; break;
+			case 'A': crashing = true; break;
+			case 't': nthreads = atoi(optarg); break;
+			case 'n': nsteps = atol(optarg); break;
+			case 's': base_seed = strtoul(optarg, NULL, 0); break;
+			case 'c': check_every = atol(optarg); break;
+			default:
+				fprintf(stderr, "usage: stress [-H] [-T] [-P] [-M] [-B] [-C] [-A] [-t threads] [-n steps per thread] [-s seed] [-c check interval]\n");
+				return 2;
+		}
+	}
+
+	if(shared){
+		return heap_main();
+	}
+
+	threads = calloc(nthreads, sizeof(*threads));
+	ctxs = calloc(nthreads, sizeof(*ctxs));
+	for(t = 0; t < nthreads; t++){
+		ctxs[t].id = t;
+		ctxs[t].seed = base_seed * 7919 + t;
+		pthread_create(&threads[t], NULL, stress_thread, &ctxs[t]);
+	}
+	for(t = 0; t < nthreads; t++){
+		pthread_join(threads[t], NULL);
+	}
+
+	for(k = 0; k < NEXCHANGE; k++){
+		if(exchange[k] != NULL){
+			verify(exchange[k]);
+			free(exchange[k]->ptr);
+			free(exchange[k]);
+		}
+	}
+
+	if(mm_check_heap() != 0){
+		FAIL("heap invariant broken after the run (seed %u)", base_seed);
+	}
+	if(tagged){
+		check_tags();
+	}
+	check_regions();
+	check_pools();
+	check_release();
+	if(purging){
+		check_purge();
+	}
+	if(meshing){
+		check_mesh();
+	}
+	if(budgeted){
+		check_budget();
+	}
+	if(percpu){
+		check_percpu();
+	}
+	if(crashing){
+		check_crashes();
+	}
+#ifdef MALLOC_PROFILE
+	check_profile();
+#endif
+
+	free(threads);
+	free(ctxs);
+	printf("stress: %d threads x %ld steps%s OK (seed %u)\n", nthreads, nsteps, tagged ? " tagged" : "", base_seed);
+	return 0;
+}